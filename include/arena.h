@@ -0,0 +1,49 @@
+/**
+ * File:        include/arena.h
+ * Description: Header file for region (arena) allocator, memory of objects
+ *              living as long as SMTP session is bump-allocated and released
+ *              at once.
+ * Author:      Tomasz Pieczerak (tphaster)
+ */
+
+#ifndef __ARENA_H
+#define __ARENA_H
+
+#include <stddef.h>
+
+/** Constants **/
+#define ARENA_BLOCK     4096    /* default block size */
+
+
+/** Typedefs **/
+
+/* struct arena_block - memory block of arena */
+struct arena_block {
+    struct arena_block *prev;   /* previous block (or next spare one) */
+    size_t size;                /* usable size of block */
+    max_align_t mem[];          /* block memory */
+};
+
+/* struct arena - region allocator */
+struct arena {
+    struct arena_block *cur;    /* block being filled */
+    size_t used;                /* bytes used in current block */
+    struct arena_block *spare;  /* released blocks, reused before malloc() */
+};
+
+/* struct arena_mark - position in arena, to which it can be reset */
+struct arena_mark {
+    struct arena_block *block;
+    size_t used;
+};
+
+
+/** Functions **/
+void arena_init (struct arena *a);
+void *arena_alloc (struct arena *a, size_t size);
+char *arena_strdup (struct arena *a, const char *s);
+void arena_mark (struct arena *a, struct arena_mark *mark);
+void arena_reset (struct arena *a, const struct arena_mark *mark);
+void arena_free (struct arena *a);
+
+#endif  /* __ARENA_H */
@@ -10,6 +10,7 @@
 
 #include <stdint.h>
 #include <netinet/in.h>
+#include "rules.h"
 
 /** Constants **/
 
@@ -19,6 +20,9 @@
 #define DEFAULT_RULES_FILE      "/etc/smime-gate/rules"
 #define DEFAULT_WORKING_DIR     "/var/run/smime-gate"
 #define DEFAULT_UNSENT_DIR      "/var/run/smime-gate/unsent"
+#ifndef DEFAULT_QUEUE_DIR   /* (queue test builds queue.c with its own) */
+#define DEFAULT_QUEUE_DIR       "/var/run/smime-gate/queue"
+#endif
 #define DEFAULT_SMTP_PORT       587
 
 #define DPREF       "smime-gate-debug: "    /* debug prefix */
@@ -26,6 +30,15 @@
 
 #define CONF_MAXLEN     256     /* maximum line length of config/rules files */
 
+/* Spool backends */
+#define SPOOL_DIR       0       /* one file per mail object */
+#define SPOOL_LOG       1       /* append-only segmented log */
+
+/* Durability modes */
+#define DURABLE_NONE    0       /* accepted mail is left in page cache */
+#define DURABLE_FSYNC   1       /* every accepted mail is synced on its own */
+#define DURABLE_BATCH   2       /* group commit by flusher process */
+
 
 /** Typedefs **/
 
@@ -46,9 +59,21 @@ struct config {
     size_t decr_rules_size;         /* decryption array size */
     struct vrfy_rule* vrfy_rules;   /* verification rules */
     size_t vrfy_rules_size;         /* verification array size */
+    struct rule_index rule_idx[RULE_TYPES]; /* rules indexed by address */
+    void *rules_map;                /* mapped rules snapshot (or NULL) */
+    size_t rules_map_size;          /* size of the mapping */
+    char *compile_rules;            /* compile rules snapshot to this file */
+    char *event_log;                /* message event log location (or NULL) */
 
     struct sockaddr_in mail_srv;    /* mail server address */
     uint16_t smtp_port;             /* listening port */
+    uint16_t metrics_port;          /* metrics listening port (0: none) */
+    int spool;                      /* spool backend (see Spool backends) */
+    int durability;                 /* see Durability modes */
+    int stream_sign;                /* sign mail while it is received? */
+    int pipelined;                  /* forward mails during the session? */
+    int rcpt_dedup;                 /* drop duplicate recipients? */
+    unsigned int slow_log;          /* slow mail threshold (ms, 0: none) */
 };
 
 /* struct encr_rule - encryption rule */
@@ -89,6 +114,7 @@ extern struct config conf;  /* global configuration */
 void parse_args (int argc, char **argv);
 void load_config (void);
 void print_config (void);
+void free_rules (void);
 void free_config (void);
 
 #endif  /* __CONFIG_H */
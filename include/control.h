@@ -0,0 +1,21 @@
+/**
+ * File:        include/control.h
+ * Description: Header file for control socket (live statistics and
+ *              commands for operator).
+ * Author:      Tomasz Pieczerak (tphaster)
+ */
+
+#ifndef __CONTROL_H
+#define __CONTROL_H
+
+/** Constants **/
+#define CONTROL_PATH    DEFAULT_WORKING_DIR "/control"  /* control socket */
+#define CONTROL_CMDLEN  64      /* command maximum length */
+#define CONTROL_TIMEOUT 1000    /* time to send command (ms) */
+
+
+/** Functions **/
+int control_init (void);
+void control_serve (int listenfd);
+
+#endif  /* __CONTROL_H */
@@ -0,0 +1,22 @@
+/**
+ * File:        include/durable.h
+ * Description: Header file for durability of accepted mail objects
+ *              (per-message fsync or group commit by flusher process).
+ * Author:      Tomasz Pieczerak (tphaster)
+ */
+
+#ifndef __DURABLE_H
+#define __DURABLE_H
+
+#include "smtp-types.h"
+
+/** Constants **/
+#define PART_SUFFIX     ".part"     /* mail object being spooled */
+
+
+/** Functions **/
+void flusher_init (void);
+int durable_sync_fd (int fd);
+int durable_save_mail (struct mail_object *mail, const char *filename);
+
+#endif  /* __DURABLE_H */
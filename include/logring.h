@@ -0,0 +1,43 @@
+/**
+ * File:        include/logring.h
+ * Description: Header file for asynchronous logging (per-process ring
+ *              buffers drained by logger process).
+ * Author:      Tomasz Pieczerak (tphaster)
+ */
+
+#ifndef __LOGRING_H
+#define __LOGRING_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+/** Constants **/
+#define LOG_RECS        64      /* records in ring (power of 2) */
+#define LOG_RECLEN      496     /* record text maximum length (with NUL) */
+#define LOG_IDLE_USEC   20000   /* logger's sleep, when rings are empty */
+
+
+/** Typedefs **/
+
+/* struct log_rec - log record */
+struct log_rec {
+    int level;                  /* syslog level */
+    pid_t pid;                  /* process, which logged it */
+    char text[LOG_RECLEN];      /* message (ended with newline) */
+};
+
+/* struct log_ring - ring of one process (single producer: the process, *
+ *                   single consumer: logger)                           */
+struct log_ring {
+    uint64_t head;              /* records written (by producer) */
+    char pad1[56];              /* head and tail in separate cache lines */
+    uint64_t tail;              /* records read (by logger) */
+    char pad2[56];
+    struct log_rec recs[LOG_RECS];
+};
+
+
+/** Functions **/
+void log_init (void);
+
+#endif  /* __LOGRING_H */
@@ -0,0 +1,18 @@
+/**
+ * File:        include/metrics.h
+ * Description: Header file for metrics service (Prometheus text format
+ *              over HTTP on loopback).
+ * Author:      Tomasz Pieczerak (tphaster)
+ */
+
+#ifndef __METRICS_H
+#define __METRICS_H
+
+/** Constants **/
+#define METRICS_REQLEN  1024    /* HTTP request maximum length */
+
+
+/** Functions **/
+void metrics_init (void);
+
+#endif  /* __METRICS_H */
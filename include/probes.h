@@ -0,0 +1,42 @@
+/**
+ * File:        include/probes.h
+ * Description: Static probes (USDT) of provider 'smime_gate', they can be
+ *              attached by bpftrace or SystemTap. Without <sys/sdt.h>
+ *              (HAVE_SYS_SDT_H is set by Makefile) probes are compiled out,
+ *              otherwise they are single nop instructions until attached.
+ * Author:      Tomasz Pieczerak (tphaster)
+ */
+
+#ifndef __PROBES_H
+#define __PROBES_H
+
+/* Probes:
+ *   session__start(sockfd)          session__end()
+ *   command(code)                   (see smtp-lib.h, command codes)
+ *   data__start()                   data__end(bytes)
+ *   spool__start(bytes)             spool__done(result)
+ *   crypto__start(type, bytes)      crypto__done(type, bytes, ok)
+ *   send__start(bytes)              send__done(result)
+ * where type is rule type (see rules.h) and result is 0 on success */
+
+#ifdef HAVE_SYS_SDT_H
+#include <sys/sdt.h>
+
+#define PROBE0(name)            DTRACE_PROBE(smime_gate, name)
+#define PROBE1(name, a)         DTRACE_PROBE1(smime_gate, name, a)
+#define PROBE2(name, a, b)      DTRACE_PROBE2(smime_gate, name, a, b)
+#define PROBE3(name, a, b, c)   DTRACE_PROBE3(smime_gate, name, a, b, c)
+
+#else
+
+/* arguments are not evaluated, only marked as used */
+#define PROBE0(name)            do { } while (0)
+#define PROBE1(name, a)         do { (void) sizeof(a); } while (0)
+#define PROBE2(name, a, b)      do { (void) sizeof(a); (void) sizeof(b); } \
+                                while (0)
+#define PROBE3(name, a, b, c)   do { (void) sizeof(a); (void) sizeof(b); \
+                                     (void) sizeof(c); } while (0)
+
+#endif  /* HAVE_SYS_SDT_H */
+
+#endif  /* __PROBES_H */
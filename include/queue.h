@@ -0,0 +1,52 @@
+/**
+ * File:        include/queue.h
+ * Description: Header file for append-only segmented log queue (spool
+ *              backend alternative to one file per mail object).
+ * Author:      Tomasz Pieczerak (tphaster)
+ */
+
+#ifndef __QUEUE_H
+#define __QUEUE_H
+
+#include <stdint.h>
+#include <netinet/in.h>
+#include "smtp-types.h"
+
+/** Constants **/
+
+/* Record types */
+#define QREC_MAIL   1       /* received mail object */
+#define QREC_DONE   2       /* processed mail object, waiting for delivery */
+#define QREC_ACK    3       /* mail object delivered */
+
+#define QID_LEN     40      /* maximum message identifier length (with NUL) */
+#define QSEG_FNMAXLEN   64  /* segment path maximum length */
+
+
+/** Typedefs **/
+
+/* struct queue_rec - log record, as seen by queue_scan() callback */
+struct queue_rec {
+    int type;               /* record type (see Record types) */
+    const char *id;         /* message identifier */
+    const char *payload;    /* mail object (in mail file format) */
+    size_t len;             /* payload length */
+    uint32_t segno;         /* segment number */
+    size_t off;             /* record offset in segment */
+};
+
+typedef void queue_scan_fn (const struct queue_rec *rec, void *arg);
+
+
+/** Functions **/
+void queue_init (void);
+void queue_segpath (char *path, uint32_t segno);
+int queue_append (int type, const char *id, struct mail_object *mail);
+int queue_save_mail (struct mail_object *mail, const char *filename);
+int queue_scan (queue_scan_fn *fn, void *arg);
+int queue_load (uint32_t segno, size_t off, struct mail_object *mail);
+int queue_unprocessed (queue_scan_fn *fn, void *arg);
+int send_mails_from_queue (struct sockaddr_in *srv_sock);
+void queue_compact (void);
+
+#endif  /* __QUEUE_H */
@@ -0,0 +1,30 @@
+/**
+ * File:        include/reload.h
+ * Description: Header file for live reload of configuration and rules
+ *              (triggered by SIGHUP).
+ * Author:      Tomasz Pieczerak (tphaster)
+ */
+
+#ifndef __RELOAD_H
+#define __RELOAD_H
+
+#include <signal.h>
+
+/** Constants **/
+
+/* reload_finish() results */
+#define RELOAD_FAIL     -1      /* new generation rejected, old one is kept */
+#define RELOAD_DONE      0      /* switched to new generation */
+#define RELOAD_SRV       1      /* switched, mail server has changed */
+
+
+/** Externs **/
+extern volatile sig_atomic_t reload_request;    /* SIGHUP was received */
+
+
+/** Functions **/
+int reload_start (void);
+int reload_finish (int fd);
+void sig_hup (int signo);
+
+#endif  /* __RELOAD_H */
@@ -0,0 +1,71 @@
+/**
+ * File:        include/rules.h
+ * Description: Header file for indexed encryption/signing rules lookup.
+ * Author:      Tomasz Pieczerak (tphaster)
+ */
+
+#ifndef __RULES_H
+#define __RULES_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/** Constants **/
+
+/* Rule types */
+#define RULE_ENCR       0       /* encryption rules (by recipient) */
+#define RULE_SIGN       1       /* signing rules (by sender) */
+#define RULE_DECR       2       /* decryption rules (by recipient) */
+#define RULE_VRFY       3       /* verification rules (by sender) */
+#define RULE_TYPES      4
+
+
+/** Typedefs **/
+
+/* struct rule_slot - hash table slot of exact address rule */
+struct rule_slot {
+    uint32_t hash;          /* address hash */
+    uint32_t off;           /* address offset in string table + 1 (0: empty) */
+    size_t rule;            /* rule index */
+};
+
+/* struct rule_edge - edge of domain trie (hash table slot) */
+struct rule_edge {
+    uint32_t hash;          /* hash of parent node and label */
+    uint32_t off;           /* label offset in string table + 1 (0: empty) */
+    uint32_t parent;        /* parent node (0: root) */
+    uint32_t child;         /* child node */
+};
+
+/* struct rule_index - rules of one type, indexed by address */
+struct rule_index {
+    struct rule_slot *slots;    /* open addressing hash table of exact */
+    size_t size;                /* addresses (size is power of 2)      */
+
+    char *strtab;               /* lowercase addresses, NUL-terminated */
+    size_t strtab_len;
+
+    /* Aho-Corasick automaton of partial addresses (substring patterns) */
+    unsigned char ac_class[256];    /* lowercase character -> class (0 for *
+                                     * characters absent in all patterns)  */
+    size_t ac_nclass;               /* number of character classes */
+    int32_t *ac_next;               /* transitions, ac_nclass per state */
+    long *ac_out;                   /* first rule matched in state (or -1) */
+    size_t ac_states;               /* number of states */
+
+    /* trie of domain rules (*@domain), labels in reversed order */
+    struct rule_edge *dom_edges;    /* open addressing hash table of edges */
+    size_t dom_size;                /* (size is power of 2)               */
+    long *dom_rule;                 /* first rule of node's domain (or -1) */
+    size_t dom_nodes;               /* number of nodes (with root) */
+};
+
+
+/** Functions **/
+void rules_build (void);
+long rules_lookup (int type, const char *addr);
+void rules_free (void);
+int rules_snapshot_save (const char *filename);
+int rules_snapshot_load (const char *filename);
+
+#endif  /* __RULES_H */
@@ -7,8 +7,15 @@
 #ifndef __SMIME_GATE_H
 #define __SMIME_GATE_H
 
+#include "smtp-types.h"
+
 void smime_gate_service (int sockfd);
+void smime_envelope (struct mail_object *mail);
+void smime_data (struct mail_object *mail, const char *chunk, size_t len,
+                 int end);
+void smime_drop (struct mail_object *mail);
 void unsent_service (void);
+void recover_mails (void);
 
 
 #endif  /* __SMIME_GATE_H */
@@ -14,8 +14,15 @@ struct mail_object {
     char *mail_from;    /* mail sender (MAIL FROM:) */
     char **rcpt_to;     /* mail recipient(s) (RCPT TO:) */
     size_t no_rcpt;     /* number of recipients */
+    size_t rcpt_cap;    /* allocated size of rcpt_to array */
     char *data;         /* mail body */
     size_t data_size;   /* mail body size */
+    void *map_addr;     /* mapped mail file (NULL if data was malloc()ed) */
+    size_t map_size;    /* size of mapped mail file */
+    int in_arena;       /* envelope was allocated from session arena */
+    int rules_set;      /* were processing rules resolved? */
+    long rules[4];      /* processing rules by type (see rules.h), -1: none */
+    void *priv;         /* private data of SMTP Server hooks */
 };
 
 void free_mail_object (struct mail_object *mail);
@@ -7,6 +7,7 @@
 #ifndef __SMTP_H
 #define __SMTP_H
 
+#include "arena.h"
 #include "smtp-types.h"
 
 /** Constants **/
@@ -21,6 +22,9 @@
 #define EQUITRECV   -3  /* QUIT received before mail completion */
 #define EUEXEOF     -4  /* unexpected end of file */
 #define EFOPEN      -5  /* can't open file */
+#define EMMAP       -6  /* can't map file */
+#define EFSYNC      -7  /* can't flush file to disk */
+#define EFWRITE     -8  /* can't write file */
 
 /* SMTP Server states (for smtp_recv_mail()) */
 #define SMTP_SRV_NEW        0   /* use for the first receipt */
@@ -33,6 +37,32 @@
 #define SMTP_CLI_LST    0x2     /* for last mail (close connection) */
 #define SMTP_CLI_CON    0x0     /* don't close connection after sending */
 
+/** Typedefs **/
+
+/* SMTP hooks (for smtp_recv_mail() and send_mails_from_dir()) */
+struct smtp_srv_hooks {
+    /* store received mail object, 0 on success */
+    int (*save) (struct mail_object *mail, const char *filename);
+    /* envelope was changed (MAIL or RCPT accepted), may be NULL */
+    void (*envelope) (struct mail_object *mail);
+    /* part of mail data was received ('end' is set for the last one, *
+     * whole data is passed to 'save' afterwards), may be NULL         */
+    void (*data) (struct mail_object *mail, const char *chunk, size_t len,
+                  int end);
+    /* mail object stored in file was sent by send_mails_from_dir(), *
+     * may be NULL                                                    */
+    void (*sent) (const char *filename);
+    /* receipt of mail object was abandoned (RSET, QUIT or error), its *
+     * private data are to be released, may be NULL                     */
+    void (*drop) (struct mail_object *mail);
+};
+
+
+/** Externs **/
+extern struct smtp_srv_hooks smtp_hooks;
+extern struct arena *smtp_arena;
+extern int smtp_rcpt_dedup;
+
 
 /** Functions **/
 int smtp_recv_mail (int sockfd, struct mail_object *mail, char *filename,
@@ -40,6 +70,9 @@ int smtp_recv_mail (int sockfd, struct mail_object *mail, char *filename,
 int smtp_send_mail (int sockfd, struct mail_object *mail, int cli);
 int save_mail_to_file (struct mail_object *mail, const char *filename);
 int load_mail_from_file (const char *filename, struct mail_object *mail);
+int map_mail_from_fd (int fd, struct mail_object *mail);
+int map_mail_from_file (const char *filename, struct mail_object *mail);
+int parse_mail_buffer (const char *buf, size_t size, struct mail_object *mail);
 int send_mails_from_dir (const char *dirname, struct sockaddr_in *srv_sock);
 
 #endif  /* __SMTP_H */
@@ -0,0 +1,121 @@
+/**
+ * File:        include/stats.h
+ * Description: Header file for pipeline statistics (per-stage latency
+ *              histograms shared by all processes of the gateway).
+ * Author:      Tomasz Pieczerak (tphaster)
+ */
+
+#ifndef __STATS_H
+#define __STATS_H
+
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/types.h>
+#include "smtp-types.h"
+#include "system.h"
+
+/** Constants **/
+
+/* Pipeline stages */
+#define STAGE_RECV      0       /* mail receipt (smtp_recv_mail()) */
+#define STAGE_SPOOL     1       /* spool write (SMTP Server save hook) */
+#define STAGE_ENCR      2       /* crypto steps, in order of rule types */
+#define STAGE_SIGN      3
+#define STAGE_DECR      4
+#define STAGE_VRFY      5
+#define STAGE_CONNECT   6       /* connection to mail server */
+#define STAGE_SEND      7       /* sending mail to mail server */
+#define STAGES          8
+
+#define STAGE_CRYPTO(type)  (STAGE_ENCR + (type))   /* stage of rule type */
+
+/* Counters */
+#define CNT_ACCEPTED    0       /* client connections accepted */
+#define CNT_REFUSED     1       /* client connections refused */
+#define CNT_CLOSED      2       /* client sessions finished */
+#define CNT_RECEIVED    3       /* mails received */
+#define CNT_ENCR        4       /* mails processed, in order of rule types */
+#define CNT_SIGN        5
+#define CNT_DECR        6
+#define CNT_VRFY        7
+#define CNT_CRYPTO_FAIL 8       /* failed crypto steps */
+#define CNT_FORWARDED   9       /* mails forwarded by sessions */
+#define CNT_UNSENT      10      /* mails left for unsent service */
+#define CNT_BYTES_IN    11      /* mail data received */
+#define CNT_BYTES_OUT   12      /* mail data forwarded */
+#define CNT_LOG_DROPPED 13      /* log records dropped (log ring was full) */
+#define COUNTERS        14
+
+#define CNT_PROCESSED(type) (CNT_ENCR + (type))     /* counter of rule type */
+
+/* Gauges (set by one process, not summed up) */
+#define GAUGE_UNSENT_DIR    0   /* mails in unsent directory */
+#define GAUGE_UNSENT_LOG    1   /* mails waiting for delivery in log spool */
+#define GAUGE_UNSENT_MARK   2   /* CNT_UNSENT, when they were measured */
+#define GAUGE_SUBPROC       3   /* forked subprocesses (sproc_counter) */
+#define GAUGES              4
+
+/* Log-bucketed histogram: values (microseconds) below HIST_SUB are exact, *
+ * others fall into one of HIST_SUB buckets of their power of 2            */
+#define HIST_SUB_BITS   3
+#define HIST_SUB        (1 << HIST_SUB_BITS)
+#define HIST_MAX_BITS   40      /* larger values are counted as maximum */
+#define HIST_BUCKETS    ((HIST_MAX_BITS - HIST_SUB_BITS + 1) * HIST_SUB)
+
+#define STATS_SLOTS     (2*MAXSUBPROC + 16) /* sessions, their forwarders *
+                                             * and other services         */
+
+
+/** Typedefs **/
+
+/* struct stats_hist - latency histogram of one stage */
+struct stats_hist {
+    uint64_t count;                 /* number of values */
+    uint64_t sum;                   /* sum of values */
+    uint64_t max;                   /* maximum value */
+    uint64_t buckets[HIST_BUCKETS];
+};
+
+/* struct stats_slot - statistics of one process (only the process *
+ *                     writes to it, readers sum up all slots)      */
+struct stats_slot {
+    pid_t pid;                      /* owner (0: free slot) */
+    uint64_t counters[COUNTERS];
+    struct stats_hist hist[STAGES];
+};
+
+/* struct stats_area - shared memory of statistics */
+struct stats_area {
+    uint64_t gauges[GAUGES];
+    struct stats_slot slots[STATS_SLOTS];
+};
+
+
+/** Externs **/
+extern volatile sig_atomic_t stats_request;     /* SIGUSR1 was received */
+extern int (*stats_save) (struct mail_object *mail, const char *filename);
+extern uint64_t *stats_stages;      /* see stats_record() */
+
+
+/** Functions **/
+void stats_init (void);
+int stats_slot_no (void);
+uint64_t stats_now (void);
+void stats_record (int stage, uint64_t usec);
+void stats_count (int counter, uint64_t n);
+void stats_gauge (int gauge, uint64_t v);
+uint64_t stats_counter (int counter);
+uint64_t stats_gauge_value (int gauge);
+uint64_t stats_unsent (void);
+void stats_collect (int stage, struct stats_hist *hist);
+uint64_t stats_percentile (const struct stats_hist *hist, double q);
+uint64_t stats_count_below (const struct stats_hist *hist, uint64_t usec);
+const char *stats_stage_name (int stage);
+void stats_log (void);
+void stats_print (FILE *fp);
+void stats_print_hist (FILE *fp);
+int stats_save_mail (struct mail_object *mail, const char *filename);
+void sig_usr1 (int signo);
+
+#endif  /* __STATS_H */
@@ -34,14 +34,16 @@ typedef void    Sigfunc(int);   /* for signal handlers */
 #define BUFFSIZE        8192    /* buffer size for reads and writes */
 #define LISTENQ         1024    /* default value of backlog in listen() */
 #define MAXSUBPROC       200    /* maximum number of forked subprocesses */
-#define FNMAXLEN          48    /* filename maximum length */
+#define FNMAXLEN          64    /* filename maximum length */
 #define MAILBUF           10    /* mail buffer size */
 #define CMDMAXLEN        512    /* command maximum length */
 #define UNSENT_SLEEP     900    /* (sec) how often try to resend unsent mails */
+#define RECOVERY_PROCS     4    /* processes resuming work after crash */
 
 
 /** Externs **/
 extern volatile sig_atomic_t sproc_counter; /* forked subprocesses counter */
+extern int (*err_hook) (int level, const char *msg);    /* see error.c */
 
 
 /** Functions **/
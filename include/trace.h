@@ -0,0 +1,34 @@
+/**
+ * File:        include/trace.h
+ * Description: Header file for message tracing (unique message identifiers
+ *              and structured event log).
+ * Author:      Tomasz Pieczerak (tphaster)
+ */
+
+#ifndef __TRACE_H
+#define __TRACE_H
+
+#include "smtp-types.h"
+
+/** Constants **/
+#define TRACE_PREFIX    "mail"  /* spooled file name prefix (before ID) */
+#define TRACE_IDLEN     25      /* message identifier length (with NUL) */
+#define TRACE_LINELEN   1024    /* event line maximum length */
+
+
+/** Externs **/
+extern int (*trace_save) (struct mail_object *mail, const char *filename);
+
+
+/** Functions **/
+void trace_init (void);
+void trace_id (char *id);
+void trace_fn_id (const char *fn, char *id);
+void trace_event (const char *event, const char *fn, const char *fmt, ...)
+    __attribute__((__format__(__printf__, 3, 4)));
+void trace_addr (const char *event, const char *fn, const char *key,
+                 const char *addr);
+int trace_save_mail (struct mail_object *mail, const char *filename);
+void trace_sent (const char *filename);
+
+#endif  /* __TRACE_H */
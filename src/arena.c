@@ -0,0 +1,127 @@
+/**
+ * File:        src/arena.c
+ * Description: Region (arena) allocator. Objects are bump-allocated from
+ *              blocks and never freed one by one, arena is reset to a mark
+ *              (e.g. at RSET) or released as a whole at the end of session.
+ *              Released blocks are kept and reused, so a long session does
+ *              not call malloc() for every mail.
+ * Author:      Tomasz Pieczerak (tphaster)
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "arena.h"
+
+#define ARENA_ALIGN     (_Alignof(max_align_t))
+
+
+/* arena_init - initialize empty arena */
+void arena_init (struct arena *a)
+{
+    a->cur = NULL;
+    a->used = 0;
+    a->spare = NULL;
+}
+
+/* arena_new_block - make new current block of at least 'size' bytes, *
+ *                   spare one is taken if it is large enough           */
+static int arena_new_block (struct arena *a, size_t size)
+{
+    struct arena_block *b, **pp;
+
+    if (size < ARENA_BLOCK)
+        size = ARENA_BLOCK;
+
+    for (pp = &(a->spare); NULL != *pp; pp = &((*pp)->prev)) {
+        if ((*pp)->size >= size)
+            break;
+    }
+
+    if (NULL != *pp) {
+        b = *pp;
+        *pp = b->prev;
+    }
+    else {
+        if (NULL == (b = malloc(sizeof(struct arena_block) + size)))
+            return -1;
+        b->size = size;
+    }
+
+    b->prev = a->cur;
+    a->cur = b;
+    a->used = 0;
+
+    return 0;
+}
+
+/* arena_alloc - allocate memory from arena (aligned as malloc() does), *
+ *               returns NULL if there is no memory                     */
+void *arena_alloc (struct arena *a, size_t size)
+{
+    void *ptr;
+
+    size = (size + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1);
+    if (0 == size)
+        size = ARENA_ALIGN;
+
+    if (NULL == a->cur || a->cur->size - a->used < size) {
+        if (0 != arena_new_block(a, size))
+            return NULL;
+    }
+
+    ptr = (char *) a->cur->mem + a->used;
+    a->used += size;
+
+    return ptr;
+}
+
+/* arena_strdup - duplicate string into arena */
+char *arena_strdup (struct arena *a, const char *s)
+{
+    size_t len = strlen(s) + 1;
+    char *d;
+
+    if (NULL != (d = arena_alloc(a, len)))
+        memcpy(d, s, len);
+
+    return d;
+}
+
+/* arena_mark - remember current position in arena */
+void arena_mark (struct arena *a, struct arena_mark *mark)
+{
+    mark->block = a->cur;
+    mark->used = a->used;
+}
+
+/* arena_reset - release everything allocated since mark was taken */
+void arena_reset (struct arena *a, const struct arena_mark *mark)
+{
+    struct arena_block *b;
+
+    while (a->cur != mark->block && NULL != a->cur) {
+        b = a->cur;
+        a->cur = b->prev;
+        b->prev = a->spare;
+        a->spare = b;
+    }
+
+    a->used = (NULL != a->cur) ? mark->used : 0;
+}
+
+/* arena_free - release all memory of arena */
+void arena_free (struct arena *a)
+{
+    struct arena_block *b;
+
+    while (NULL != (b = a->cur)) {
+        a->cur = b->prev;
+        free(b);
+    }
+    while (NULL != (b = a->spare)) {
+        a->spare = b->prev;
+        free(b);
+    }
+
+    a->used = 0;
+}
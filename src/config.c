@@ -57,7 +57,9 @@ static void help (void)
 
     printf("Configuration files:\n"
            "  -c FILE,  --config=FILE   get config from FILE.\n"
-           "  -r FILE,  --rules=FILE    get encryption/signing rules from FILE\n");
+           "  -r FILE,  --rules=FILE    get encryption/signing rules from FILE\n"
+           "  --compile-rules=FILE      compile rules into binary snapshot FILE\n"
+           "                            (usable as rules file) and exit\n");
 
     printf("\nMail bug reports and suggestions to <tphaster AT gmail.com>.\n");
 }
@@ -131,6 +133,18 @@ void parse_args (int argc, char **argv)
                 conf.rules_file = Malloc(len);
                 strncpy(conf.rules_file, arg+8, len);
             }
+            /* --compile-rules=FILE */
+            else if (0 == strncmp(arg+2, "compile-rules", 13)) {
+                if ('=' != arg[15] || '\0' == arg[16]) {
+                    fprintf(stderr, "No FILE given in 'compile-rules' option.\n");
+                    usage();
+                    exit(1);
+                }
+
+                len = strlen(arg+16)+1;
+                conf.compile_rules = Malloc(len);
+                strncpy(conf.compile_rules, arg+16, len);
+            }
             else {
                 fprintf(stderr, "Unknown option.\n");
                 usage();
@@ -283,6 +297,15 @@ void load_config (void)
                 fprintf(stderr, "Syntax error in config file on line %u"
                        "-- bad SMTP port (smtp_port).\n", (unsigned int)line_cnt);
         }
+        /* Prometheus metrics port */
+        else if (0 == strncmp("metrics_port = ", buf, 15)) {
+            if ((port = atoi(buf+15)) > 0 && port < 65536)
+                conf.metrics_port = htons(port);
+            else
+                fprintf(stderr, "Syntax error in config file on line %u"
+                       " -- bad metrics port (metrics_port).\n",
+                       (unsigned int)line_cnt);
+        }
         /* rules file location */
         else if (0 == strncmp("rules = ", buf, 8)) {
             if (NULL != conf.rules_file)
@@ -293,6 +316,14 @@ void load_config (void)
             strncpy(conf.rules_file, buf+8, len);
             conf.rules_file[len-2] = '\0';
         }
+        /* message event log location */
+        else if (0 == strncmp("event_log = ", buf, 12)) {
+            (buf+12)[strcspn(buf+12, "\n")] = '\0';
+            if (NULL != conf.event_log)
+                free(conf.event_log);
+            conf.event_log = Malloc(strlen(buf+12)+1);
+            strcpy(conf.event_log, buf+12);
+        }
         /* mail server address */
         else if (0 == strncmp("mail_srv_addr = ", buf, 16)) {
             (buf+16)[strlen(buf+16)-1] = '\0';
@@ -313,6 +344,78 @@ void load_config (void)
                 fprintf(stderr, "Syntax error in config file on line %u"
                        "-- bad mail server port (mail_srv_port).\n", (unsigned int)line_cnt);
         }
+        /* spool backend */
+        else if (0 == strncmp("spool = ", buf, 8)) {
+            (buf+8)[strcspn(buf+8, "\n")] = '\0';
+            if (0 == strcmp("dir", buf+8))
+                conf.spool = SPOOL_DIR;
+            else if (0 == strcmp("log", buf+8))
+                conf.spool = SPOOL_LOG;
+            else
+                fprintf(stderr, "Syntax error in config file on line %u"
+                       " -- unknown spool backend (spool).\n",
+                       (unsigned int)line_cnt);
+        }
+        /* durability of accepted mail */
+        else if (0 == strncmp("durability = ", buf, 13)) {
+            (buf+13)[strcspn(buf+13, "\n")] = '\0';
+            if (0 == strcmp("none", buf+13))
+                conf.durability = DURABLE_NONE;
+            else if (0 == strcmp("fsync", buf+13))
+                conf.durability = DURABLE_FSYNC;
+            else if (0 == strcmp("batch", buf+13))
+                conf.durability = DURABLE_BATCH;
+            else
+                fprintf(stderr, "Syntax error in config file on line %u"
+                       " -- unknown durability mode (durability).\n",
+                       (unsigned int)line_cnt);
+        }
+        /* processing and forwarding during client session */
+        else if (0 == strncmp("pipelined = ", buf, 12)) {
+            (buf+12)[strcspn(buf+12, "\n")] = '\0';
+            if (0 == strcmp("yes", buf+12))
+                conf.pipelined = 1;
+            else if (0 == strcmp("no", buf+12))
+                conf.pipelined = 0;
+            else
+                fprintf(stderr, "Syntax error in config file on line %u"
+                       " -- expected yes or no (pipelined).\n",
+                       (unsigned int)line_cnt);
+        }
+        /* signing while mail data are received */
+        else if (0 == strncmp("stream_sign = ", buf, 14)) {
+            (buf+14)[strcspn(buf+14, "\n")] = '\0';
+            if (0 == strcmp("yes", buf+14))
+                conf.stream_sign = 1;
+            else if (0 == strcmp("no", buf+14))
+                conf.stream_sign = 0;
+            else
+                fprintf(stderr, "Syntax error in config file on line %u"
+                       " -- expected yes or no (stream_sign).\n",
+                       (unsigned int)line_cnt);
+        }
+        /* duplicate recipients detection */
+        else if (0 == strncmp("rcpt_dedup = ", buf, 13)) {
+            (buf+13)[strcspn(buf+13, "\n")] = '\0';
+            if (0 == strcmp("yes", buf+13))
+                conf.rcpt_dedup = 1;
+            else if (0 == strcmp("no", buf+13))
+                conf.rcpt_dedup = 0;
+            else
+                fprintf(stderr, "Syntax error in config file on line %u"
+                       " -- expected yes or no (rcpt_dedup).\n",
+                       (unsigned int)line_cnt);
+        }
+
+        /* slow mails logging threshold */
+        else if (0 == strncmp("slow_log = ", buf, 11)) {
+            if ((port = atoi(buf+11)) >= 0)
+                conf.slow_log = port;
+            else
+                fprintf(stderr, "Syntax error in config file on line %u"
+                       " -- bad threshold (slow_log).\n",
+                       (unsigned int)line_cnt);
+        }
 
         else
             fprintf(stderr, "Syntax error in config file on line %u.\n",
@@ -341,6 +444,18 @@ void load_config (void)
 
     /*** load encryption/signing rules ***/
 
+    /* compiled rules snapshot is mapped with prebuilt indexes */
+    switch (rules_snapshot_load(conf.rules_file)) {
+        case 0:
+            return;
+        case 1:
+            break;      /* plain rules file */
+        default:
+            fprintf(stderr, "Can't load '%s' rules snapshot.\n",
+                    conf.rules_file);
+            exit(1);
+    }
+
     if (NULL == (rules = fopen(conf.rules_file, "r"))) {
         fprintf(stderr, "Can't read '%s' rules file.\n", conf.rules_file);
         exit(1);
@@ -729,6 +844,9 @@ void load_config (void)
     }
 
     fclose(rules);
+
+    /* index rules by address */
+    rules_build();
 }
 
 /* print_config - print current global configuration */
@@ -761,10 +879,20 @@ void print_config (void)
                 ntohs(conf.mail_srv.sin_port));
     }
 
-    printf("SMTP Port:    %d\n\n", ntohs(conf.smtp_port));
+    printf("SMTP Port:    %d\n", ntohs(conf.smtp_port));
+    printf("Metrics Port: %d\n", ntohs(conf.metrics_port));
+    printf("Spool:        %s\n", SPOOL_LOG == conf.spool ? "log" : "dir");
+    printf("Durability:   %s\n", DURABLE_BATCH == conf.durability ? "batch" :
+           (DURABLE_FSYNC == conf.durability ? "fsync" : "none"));
+    printf("Stream sign:  %s\n", conf.stream_sign ? "yes" : "no");
+    printf("Pipelined:    %s\n", conf.pipelined ? "yes" : "no");
+    printf("Rcpt dedup:   %s\n", conf.rcpt_dedup ? "yes" : "no");
+    printf("Slow log:     %u ms\n\n", conf.slow_log);
 
     printf("Config file:  %s\n", conf.config_file);
-    printf("Rules file:   %s\n\n", conf.rules_file);
+    printf("Rules file:   %s\n", conf.rules_file);
+    printf("Event log:    %s\n\n",
+           NULL != conf.event_log ? conf.event_log : "none");
 
     printf("Loaded rules:\n");
 
@@ -810,57 +938,53 @@ void print_config (void)
     printf("\n");
 }
 
-/* free_config - free global configuration structure */
-void free_config (void)
+/* free_rules - free encryption/signing rules and their indexes */
+void free_rules (void)
 {
     size_t i;
 
-    if (NULL != conf.prog_name)
-        free(conf.prog_name);
-    if (NULL != conf.version)
-        free(conf.version);
-    if (NULL != conf.config_file)
-        free(conf.config_file);
-    if (NULL != conf.rules_file)
-        free(conf.rules_file);
+    /* strings of snapshot rules are in its mapping */
+    if (NULL == conf.rules_map) {
+        for (i = 0; i < conf.encr_rules_size; ++i) {
+            if (NULL != conf.encr_rules[i].rcpt)
+                free(conf.encr_rules[i].rcpt);
+            if (NULL != conf.encr_rules[i].cert_path)
+                free(conf.encr_rules[i].cert_path);
+        }
 
-    for (i = 0; i < conf.encr_rules_size; ++i) {
-        if (NULL != conf.encr_rules[i].rcpt)
-            free(conf.encr_rules[i].rcpt);
-        if (NULL != conf.encr_rules[i].cert_path)
-            free(conf.encr_rules[i].cert_path);
-    }
+        for (i = 0; i < conf.sign_rules_size; ++i) {
+            if (NULL != conf.sign_rules[i].sndr)
+                free(conf.sign_rules[i].sndr);
+            if (NULL != conf.sign_rules[i].cert_path)
+                free(conf.sign_rules[i].cert_path);
+            if (NULL != conf.sign_rules[i].key_path)
+                free(conf.sign_rules[i].key_path);
+            if (NULL != conf.sign_rules[i].key_pass)
+                free(conf.sign_rules[i].key_pass);
+        }
 
-    for (i = 0; i < conf.sign_rules_size; ++i) {
-        if (NULL != conf.sign_rules[i].sndr)
-            free(conf.sign_rules[i].sndr);
-        if (NULL != conf.sign_rules[i].cert_path)
-            free(conf.sign_rules[i].cert_path);
-        if (NULL != conf.sign_rules[i].key_path)
-            free(conf.sign_rules[i].key_path);
-        if (NULL != conf.sign_rules[i].key_pass)
-            free(conf.sign_rules[i].key_pass);
-    }
+        for (i = 0; i < conf.decr_rules_size; ++i) {
+            if (NULL != conf.decr_rules[i].rcpt)
+                free(conf.decr_rules[i].rcpt);
+            if (NULL != conf.decr_rules[i].cert_path)
+                free(conf.decr_rules[i].cert_path);
+            if (NULL != conf.decr_rules[i].key_path)
+                free(conf.decr_rules[i].key_path);
+            if (NULL != conf.decr_rules[i].key_pass)
+                free(conf.decr_rules[i].key_pass);
+        }
 
-    for (i = 0; i < conf.decr_rules_size; ++i) {
-        if (NULL != conf.decr_rules[i].rcpt)
-            free(conf.decr_rules[i].rcpt);
-        if (NULL != conf.decr_rules[i].cert_path)
-            free(conf.decr_rules[i].cert_path);
-        if (NULL != conf.decr_rules[i].key_path)
-            free(conf.decr_rules[i].key_path);
-        if (NULL != conf.decr_rules[i].key_pass)
-            free(conf.decr_rules[i].key_pass);
+        for (i = 0; i < conf.vrfy_rules_size; ++i) {
+            if (NULL != conf.vrfy_rules[i].sndr)
+                free(conf.vrfy_rules[i].sndr);
+            if (NULL != conf.vrfy_rules[i].cert_path)
+                free(conf.vrfy_rules[i].cert_path);
+            if (NULL != conf.vrfy_rules[i].cacert_path)
+                free(conf.vrfy_rules[i].cacert_path);
+        }
     }
 
-    for (i = 0; i < conf.vrfy_rules_size; ++i) {
-        if (NULL != conf.vrfy_rules[i].sndr)
-            free(conf.vrfy_rules[i].sndr);
-        if (NULL != conf.vrfy_rules[i].cert_path)
-            free(conf.vrfy_rules[i].cert_path);
-        if (NULL != conf.vrfy_rules[i].cacert_path)
-            free(conf.vrfy_rules[i].cacert_path);
-    }
+    rules_free();
 
     if (NULL != conf.encr_rules)
         free(conf.encr_rules);
@@ -870,5 +994,31 @@ void free_config (void)
         free(conf.decr_rules);
     if (NULL != conf.vrfy_rules)
         free(conf.vrfy_rules);
+
+    conf.encr_rules = NULL;
+    conf.sign_rules = NULL;
+    conf.decr_rules = NULL;
+    conf.vrfy_rules = NULL;
+    conf.encr_rules_size = conf.sign_rules_size = 0;
+    conf.decr_rules_size = conf.vrfy_rules_size = 0;
+}
+
+/* free_config - free global configuration structure */
+void free_config (void)
+{
+    if (NULL != conf.prog_name)
+        free(conf.prog_name);
+    if (NULL != conf.version)
+        free(conf.version);
+    if (NULL != conf.config_file)
+        free(conf.config_file);
+    if (NULL != conf.rules_file)
+        free(conf.rules_file);
+    if (NULL != conf.compile_rules)
+        free(conf.compile_rules);
+    if (NULL != conf.event_log)
+        free(conf.event_log);
+
+    free_rules();
 }
 
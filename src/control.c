@@ -0,0 +1,118 @@
+/**
+ * File:        src/control.c
+ * Description: Control socket. Operator connects to Unix socket in working
+ *              directory, sends one command line and gets plain text reply:
+ *                  stats   - counters of all processes
+ *                  hist    - latency percentiles of pipeline stages (us)
+ *                  reload  - reload configuration and rules (like SIGHUP)
+ *              Requests are served by the main process between accepts,
+ *              whole command line has to arrive within CONTROL_TIMEOUT.
+ * Author:      Tomasz Pieczerak (tphaster)
+ */
+
+#include <errno.h>
+#include <poll.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include "config.h"
+#include "control.h"
+#include "reload.h"
+#include "stats.h"
+#include "system.h"
+
+
+/* control_init - create control socket, returns listening descriptor */
+int control_init (void)
+{
+    int listenfd;
+    mode_t mask;
+    struct sockaddr_un addr;
+
+    listenfd = Socket(AF_UNIX, SOCK_STREAM, 0);
+
+    bzero(&addr, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, CONTROL_PATH);
+    unlink(CONTROL_PATH);
+
+    /* socket is created for owner only (no window with other modes) */
+    mask = umask(S_IXUSR | S_IRWXG | S_IRWXO);
+    Bind(listenfd, (SA *) &addr, sizeof(addr));
+    umask(mask);
+    Listen(listenfd, LISTENQ);
+
+    return listenfd;
+}
+
+/* control_serve - accept connection to control socket and serve its *
+ *                 command (slow clients are given up, not to stall  *
+ *                 accepting of SMTP connections)                    */
+void control_serve (int listenfd)
+{
+    int connfd;
+    ssize_t n, len = 0;
+    uint64_t now, deadline;
+    char cmd[CONTROL_CMDLEN];
+    struct timeval tv = { 1, 0 };
+    struct pollfd pfd;
+    FILE *fp;
+
+    if ((connfd = accept(listenfd, NULL, NULL)) < 0)
+        return;
+
+    setsockopt(connfd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+
+    /* read one line, all of it within the deadline */
+    deadline = stats_now() + CONTROL_TIMEOUT * 1000;
+    pfd.fd = connfd;
+    pfd.events = POLLIN;
+    while (len < CONTROL_CMDLEN-1) {
+        if ((now = stats_now()) >= deadline ||
+            0 == (n = poll(&pfd, 1, (deadline - now + 999) / 1000)))
+        {
+            close(connfd);  /* too slow */
+            return;
+        }
+        if (n < 0) {
+            if (EINTR == errno)
+                continue;
+            break;
+        }
+
+        if ((n = read(connfd, cmd+len, CONTROL_CMDLEN-1-len)) < 0) {
+            if (EINTR == errno)
+                continue;
+            break;
+        }
+        if (0 == n)
+            break;
+        len += n;
+        if (NULL != memchr(cmd, '\n', len))
+            break;
+    }
+    cmd[len] = '\0';
+    cmd[strcspn(cmd, "\r\n")] = '\0';
+
+    if (NULL == (fp = fdopen(connfd, "w"))) {
+        close(connfd);
+        return;
+    }
+
+    if (0 == strcmp("stats", cmd))
+        stats_print(fp);
+    else if (0 == strcmp("hist", cmd))
+        stats_print_hist(fp);
+    else if (0 == strcmp("reload", cmd)) {
+        reload_request = 1;     /* handled by main loop */
+        fprintf(fp, "reload requested\n");
+    }
+    else
+        fprintf(fp, "unknown command, expected stats, hist or reload\n");
+
+    fclose(fp);
+}
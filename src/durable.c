@@ -0,0 +1,387 @@
+/**
+ * File:        src/durable.c
+ * Description: Durability of accepted mail objects. Mail is acknowledged
+ *              (250 reply) after it reaches the disk, either by its own
+ *              fsync or by group commit: sessions pass descriptors of
+ *              their files to the flusher process, which serves all pending
+ *              requests at once and syncs each file (or directory) only
+ *              once. Mail files are written under temporary name and
+ *              renamed when complete.
+ * Author:      Tomasz Pieczerak (tphaster)
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/prctl.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/un.h>
+#include "config.h"
+#include "durable.h"
+#include "smtp.h"
+#include "stats.h"
+#include "system.h"
+
+#define FLUSHER_PATH    DEFAULT_WORKING_DIR "/flusher"  /* flusher socket */
+#define FLUSH_MAXCLI    STATS_SLOTS     /* maximum flusher clients (every *
+                                         * process, which accepts mail)   */
+#define FLUSH_RETRY     5   /* seconds before unavailable flusher is *
+                             * asked again                           */
+
+
+/** Local variables **/
+static pid_t fl_owner;          /* process which connected fl_fd */
+static int fl_fd = -1;          /* connection to flusher */
+static time_t fl_retry;         /* when to connect to flusher again */
+
+
+/* sync_fd - flush file data (or directory entries) to disk */
+static int sync_fd (int fd)
+{
+    struct stat st;
+
+    if (fstat(fd, &st) < 0)
+        return -1;
+
+    return S_ISDIR(st.st_mode) ? fsync(fd) : fdatasync(fd);
+}
+
+/* open_dir - open directory of file */
+static int open_dir (const char *filename)
+{
+    int fd;
+    char *dir, *slash;
+
+    if (NULL == (dir = strdup(filename)))
+        return -1;
+    if (NULL != (slash = strrchr(dir, '/')) && slash != dir)
+        *slash = '\0';
+    else
+        strcpy(dir, NULL == slash ? "." : "/");
+
+    fd = open(dir, O_RDONLY);
+    free(dir);
+
+    return fd;
+}
+
+/* flush_files - sync all requested files (or directories), each one only *
+ *               once, and store status of each request                   */
+static void flush_files (const int *fds, int32_t *status, int n)
+{
+    int i, j;
+    static struct stat st[FLUSH_MAXCLI];
+
+    for (i = 0; i < n; ++i) {
+        if (fds[i] < 0 || fstat(fds[i], st+i) < 0) {
+            status[i] = -1;
+            continue;
+        }
+
+        for (j = 0; j < i; ++j) {
+            if (fds[j] >= 0 && st[j].st_dev == st[i].st_dev &&
+                st[j].st_ino == st[i].st_ino)
+                break;
+        }
+
+        if (j < i)
+            status[i] = status[j];  /* already synced */
+        else if (S_ISDIR(st[i].st_mode))
+            status[i] = fsync(fds[i]);
+        else
+            status[i] = fdatasync(fds[i]);
+    }
+}
+
+/* flush_recv - receive sync request with descriptor of file, returns *
+ *              size of request (1) and the descriptor (-1 if none)    */
+static int flush_recv (int connfd, int *fd)
+{
+    int n;
+    char byte;
+    struct iovec iov;
+    struct msghdr msg;
+    struct cmsghdr *cmsg;
+    union {
+        struct cmsghdr hdr;
+        char buf[CMSG_SPACE(sizeof(int))];
+    } ctl;
+
+    iov.iov_base = &byte;
+    iov.iov_len = 1;
+    bzero(&msg, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = ctl.buf;
+    msg.msg_controllen = sizeof(ctl.buf);
+
+    *fd = -1;
+    if ((n = recvmsg(connfd, &msg, MSG_CMSG_CLOEXEC)) <= 0)
+        return n;
+
+    cmsg = CMSG_FIRSTHDR(&msg);
+    if (NULL != cmsg && SOL_SOCKET == cmsg->cmsg_level &&
+        SCM_RIGHTS == cmsg->cmsg_type &&
+        CMSG_LEN(sizeof(int)) == cmsg->cmsg_len)
+        memcpy(fd, CMSG_DATA(cmsg), sizeof(int));
+
+    return n;
+}
+
+/* flusher_service - wait for sync requests and serve all of them, which *
+ *                   are pending, at once (group commit)                  */
+static void flusher_service (int listenfd)
+{
+    int i, n, nfds, nreq, connfd, fd;
+    struct pollfd fds[FLUSH_MAXCLI+1];
+    int reqfds[FLUSH_MAXCLI];
+    int32_t status[FLUSH_MAXCLI];
+    int waiting[FLUSH_MAXCLI+1];    /* index of request or -1 */
+
+    prctl(PR_SET_PDEATHSIG, SIGTERM);
+
+    fds[0].fd = listenfd;
+    fds[0].events = POLLIN;
+    nfds = 1;
+
+    for (;;) {
+        if (poll(fds, nfds, -1) < 0) {
+            if (EINTR == errno)
+                continue;
+            err_sys("flusher: poll error");
+        }
+
+        /* new session */
+        if (fds[0].revents & POLLIN) {
+            if ((connfd = accept(listenfd, NULL, NULL)) >= 0) {
+                if (nfds <= FLUSH_MAXCLI) {
+                    fds[nfds].fd = connfd;
+                    fds[nfds].events = POLLIN;
+                    fds[nfds].revents = 0;
+                    ++nfds;
+                }
+                else
+                    close(connfd);  /* client syncs on its own for a while */
+            }
+        }
+
+        /* collect requests, which arrived while previous sync was running */
+        nreq = 0;
+        for (i = 1; i < nfds; ++i) {
+            waiting[i] = -1;
+            if (0 == (fds[i].revents & (POLLIN | POLLHUP | POLLERR)))
+                continue;
+
+            n = flush_recv(fds[i].fd, &fd);
+            if (n > 0) {
+                waiting[i] = nreq;
+                reqfds[nreq++] = fd;    /* (-1 fails the request) */
+            }
+            else if (n < 0 && EINTR == errno)
+                continue;
+            else {
+                close(fds[i].fd);
+                fds[i].fd = -1;
+            }
+        }
+
+        if (nreq > 0) {
+            flush_files(reqfds, status, nreq);
+
+            for (i = 1; i < nfds; ++i) {
+                if (waiting[i] < 0)
+                    continue;
+
+                if (reqfds[waiting[i]] >= 0)
+                    close(reqfds[waiting[i]]);
+                if (send(fds[i].fd, status + waiting[i], sizeof(int32_t),
+                         MSG_NOSIGNAL) != sizeof(int32_t)) {
+                    close(fds[i].fd);
+                    fds[i].fd = -1;
+                }
+            }
+        }
+
+        /* drop closed connections */
+        for (i = n = 1; i < nfds; ++i) {
+            if (fds[i].fd >= 0)
+                fds[n++] = fds[i];
+        }
+        nfds = n;
+    }
+}
+
+/* flusher_init - start flusher process, if batched durability is set */
+void flusher_init (void)
+{
+    int listenfd;
+    mode_t mask;
+    struct sockaddr_un addr;
+
+    if (DURABLE_BATCH != conf.durability)
+        return;
+
+    listenfd = Socket(AF_UNIX, SOCK_SEQPACKET, 0);
+
+    bzero(&addr, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, FLUSHER_PATH);
+    unlink(FLUSHER_PATH);
+
+    /* socket is created for owner only (no window with other modes) */
+    mask = umask(S_IXUSR | S_IRWXG | S_IRWXO);
+    Bind(listenfd, (SA *) &addr, sizeof(addr));
+    umask(mask);
+    Listen(listenfd, LISTENQ);
+
+    if (Fork() == 0) {
+        err_msg("starting flusher");
+        flusher_service(listenfd);
+        exit(0);
+    }
+    ++sproc_counter;    /* (SIGCHLD isn't handled yet) */
+
+    Close(listenfd);
+}
+
+/* flush_request - ask flusher to sync file (or directory) open as 'fd', *
+ *                 returns sync status or -1 if flusher is unavailable    */
+static int flush_request (int fd)
+{
+    char byte = 0;
+    int32_t status;
+    time_t now;
+    struct iovec iov;
+    struct msghdr msg;
+    struct cmsghdr *cmsg;
+    struct sockaddr_un addr;
+    union {
+        struct cmsghdr hdr;
+        char buf[CMSG_SPACE(sizeof(int))];
+    } ctl;
+
+    /* connection inherited from parent would mix up replies */
+    if (getpid() != fl_owner) {
+        if (fl_fd >= 0)
+            close(fl_fd);
+        fl_fd = -1;
+        fl_owner = getpid();
+        fl_retry = 0;
+    }
+
+    /* flusher, which is unavailable (or full), is tried again later */
+    if (fl_fd < 0) {
+        if ((now = time(NULL)) < fl_retry)
+            return -1;
+        fl_retry = now + FLUSH_RETRY;
+
+        if ((fl_fd = socket(AF_UNIX, SOCK_SEQPACKET, 0)) < 0)
+            return -1;
+
+        bzero(&addr, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        strcpy(addr.sun_path, FLUSHER_PATH);
+        if (connect(fl_fd, (SA *) &addr, sizeof(addr)) < 0) {
+            close(fl_fd);
+            fl_fd = -1;
+            return -1;
+        }
+    }
+
+    iov.iov_base = &byte;
+    iov.iov_len = 1;
+    bzero(&msg, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = ctl.buf;
+    msg.msg_controllen = sizeof(ctl.buf);
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+
+    if (sendmsg(fl_fd, &msg, MSG_NOSIGNAL) != 1 ||
+        recv(fl_fd, &status, sizeof(status), 0) != sizeof(status)) {
+        close(fl_fd);
+        fl_fd = -1;
+        fl_retry = time(NULL) + FLUSH_RETRY;
+        return -1;
+    }
+
+    return status;
+}
+
+/* durable_sync_fd - make data written to file (or entries of directory) *
+ *                   open as 'fd' durable, as durability option says     */
+int durable_sync_fd (int fd)
+{
+    switch (conf.durability) {
+        case DURABLE_NONE:
+            return 0;
+
+        case DURABLE_BATCH:
+            if (0 == flush_request(fd))
+                return 0;
+            /* flusher failed, sync on our own */
+            /* FALLTHROUGH */
+
+        default:
+            return sync_fd(fd);
+    }
+}
+
+/* durable_sync - make file data (or its directory entry, if 'dir' is set) *
+ *                durable, as durability option says                       */
+static int durable_sync (const char *filename, int dir)
+{
+    int fd, ret;
+
+    if (DURABLE_NONE == conf.durability)
+        return 0;
+
+    /* sync directory, so the file itself survives crash */
+    if ((fd = dir ? open_dir(filename) : open(filename, O_RDONLY)) < 0)
+        return -1;
+    ret = durable_sync_fd(fd);
+    close(fd);
+
+    return ret;
+}
+/* durable_save_mail - save mail object to temporary file, make its data  *
+ *                     durable and rename it to 'filename', so only whole *
+ *                     mail objects are found there after crash (SMTP     *
+ *                     Server hook for directory spool)                   */
+int durable_save_mail (struct mail_object *mail, const char *filename)
+{
+    int ret;
+    char part[FNMAXLEN];
+
+    if (snprintf(part, FNMAXLEN, "%s" PART_SUFFIX, filename) >= FNMAXLEN)
+        return EFOPEN;
+
+    if (0 != (ret = save_mail_to_file(mail, part))) {
+        remove(part);
+        return ret;
+    }
+
+    if (0 != durable_sync(part, 0) || 0 != rename(part, filename)) {
+        remove(part);
+        return EFSYNC;
+    }
+
+    if (0 != durable_sync(filename, 1)) {
+        /* mail is not safe, it will be rejected */
+        remove(filename);
+        return EFSYNC;
+    }
+
+    return 0;
+}
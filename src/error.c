@@ -15,6 +15,10 @@
 
 int daemon_proc;    /* set nonzero by daemonize() */
 
+/* takes formatted message instead of syslog()/stderr, unless it *
+ * returns nonzero (NULL: messages are written directly)          */
+int (*err_hook) (int level, const char *msg) = NULL;
+
 static void err_doit (int, int, const char *, va_list);
 
 
@@ -93,6 +97,9 @@ static void err_doit (int errnoflag, int level, const char *fmt, va_list ap)
 
     strcat(buf, "\n");
 
+    if (NULL != err_hook && 0 == err_hook(level, buf))
+        return;
+
     if (daemon_proc) {
         syslog(level, buf);
     }
@@ -0,0 +1,162 @@
+/**
+ * File:        src/logring.c
+ * Description: Asynchronous logging. Messages are pushed into ring buffer
+ *              of the process (in shared memory, one per statistics slot)
+ *              and written to syslog or stderr by logger process in
+ *              batches, so sessions never wait for slow log sink. When
+ *              ring is full, message is dropped and counted. Syslog lines
+ *              carry pid of the process which logged them, as if written
+ *              directly. Errors (LOG_ERR and worse) are written directly,
+ *              not to be lost in ring before exit, so they may precede
+ *              less severe messages of the same process still in ring.
+ * Author:      Tomasz Pieczerak (tphaster)
+ */
+
+#define _GNU_SOURCE
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include "config.h"
+#include "logring.h"
+#include "stats.h"
+#include "system.h"
+
+extern int daemon_proc;
+
+
+/** Local variables **/
+static struct log_ring *rings;      /* rings of all processes */
+static volatile sig_atomic_t log_stop = 0;  /* logger is terminated */
+
+
+/* log_push - put message into ring of calling process (error reporting *
+ *            hook), returns nonzero, if it has to be written directly  */
+static int log_push (int level, const char *msg)
+{
+    int i;
+    uint64_t head, tail;
+    struct log_ring *r;
+    struct log_rec *rec;
+
+    /* fatal errors precede exit, they would be lost in ring */
+    if (level <= LOG_ERR || (i = stats_slot_no()) < 0)
+        return -1;
+
+    r = &(rings[i]);
+    head = __atomic_load_n(&(r->head), __ATOMIC_RELAXED);
+    tail = __atomic_load_n(&(r->tail), __ATOMIC_ACQUIRE);
+
+    if (head - tail >= LOG_RECS) {
+        stats_count(CNT_LOG_DROPPED, 1);
+        return 0;   /* logger is behind, don't wait for it */
+    }
+
+    rec = &(r->recs[head & (LOG_RECS - 1)]);
+    rec->level = level;
+    rec->pid = getpid();
+    snprintf(rec->text, LOG_RECLEN, "%s", msg);
+    if (strlen(msg) >= LOG_RECLEN)
+        rec->text[LOG_RECLEN-2] = '\n';     /* truncated */
+
+    __atomic_store_n(&(r->head), head + 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+/* log_drain - write out all pending records, returns their number */
+static int log_drain (void)
+{
+    int i, n = 0;
+    uint64_t head, tail;
+    struct log_ring *r;
+    struct log_rec *rec;
+    static char ident[64];
+
+    for (i = 0; i < STATS_SLOTS; ++i) {
+        r = &(rings[i]);
+        tail = __atomic_load_n(&(r->tail), __ATOMIC_RELAXED);
+        head = __atomic_load_n(&(r->head), __ATOMIC_ACQUIRE);
+
+        for (; tail != head; ++tail, ++n) {
+            rec = &(r->recs[tail & (LOG_RECS - 1)]);
+            if (daemon_proc) {
+                /* same line as syslog() with LOG_PID in that process */
+                snprintf(ident, sizeof(ident), "%s[%d]", conf.prog_name,
+                         (int) rec->pid);
+                openlog(ident, 0, 0);
+                syslog(rec->level, "%s", rec->text);
+            }
+            else
+                fputs(rec->text, stderr);
+        }
+
+        __atomic_store_n(&(r->tail), tail, __ATOMIC_RELEASE);
+    }
+
+    if (n > 0 && daemon_proc)
+        openlog(conf.prog_name, LOG_PID, 0);    /* (see daemonize()) */
+    else if (n > 0)
+        fflush(stderr);
+
+    return n;
+}
+
+/* sig_log_term - let logger drain rings before it terminates */
+static void sig_log_term (int signo __attribute__((__unused__)))
+{
+    log_stop = 1;
+}
+
+/* logger - drain rings of all processes, until terminated */
+static void logger (void)
+{
+    time_t last = 0;
+    uint64_t dropped, reported = 0;
+
+    prctl(PR_SET_PDEATHSIG, SIGTERM);
+    Signal(SIGTERM, sig_log_term);
+
+    while (!log_stop) {
+        if (0 == log_drain())
+            usleep(LOG_IDLE_USEC);
+
+        /* report dropped records once a second at most */
+        if (time(NULL) != last) {
+            last = time(NULL);
+            dropped = stats_counter(CNT_LOG_DROPPED);
+            if (dropped != reported) {
+                err_msg("logger: %llu log records dropped",
+                        (unsigned long long) (dropped - reported));
+                reported = dropped;
+            }
+        }
+    }
+
+    log_drain();
+}
+
+/* log_init - start logger, messages of this process and its children *
+ *            are logged asynchronously from now on (statistics have   *
+ *            to be initialized, rings are indexed by their slots)     */
+void log_init (void)
+{
+    rings = mmap(NULL, STATS_SLOTS * sizeof(struct log_ring),
+                 PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (MAP_FAILED == rings)
+        err_sys("mmap error");
+
+    fflush(NULL);   /* logger exits normally, it must not repeat output */
+    if (Fork() == 0) {
+        err_msg("starting logger");     /* written directly */
+        logger();
+        exit(0);
+    }
+    ++sproc_counter;    /* (SIGCHLD isn't handled yet) */
+
+    err_hook = log_push;
+}
@@ -4,24 +4,60 @@
  * Author:      Tomasz Pieczerak (tphaster)
  */
 
+#define _GNU_SOURCE
 #include <errno.h>
+#include <poll.h>
+#include <signal.h>
 #include <string.h>
 #include <stdlib.h>
 #include <netinet/in.h>
 #include "config.h"
+#include "control.h"
+#include "durable.h"
+#include "logring.h"
+#include "metrics.h"
+#include "queue.h"
+#include "reload.h"
+#include "smtp.h"
+#include "stats.h"
 #include "system.h"
+#include "trace.h"
 #include "smime-gate.h"
 
 /** Global Variables **/
 struct config conf;     /* global configuration */
 volatile sig_atomic_t sproc_counter = 0;    /* forked subprocesses counter */
 
+
+/* start_unsent - start unsent service */
+static pid_t start_unsent (void)
+{
+    pid_t pid;
+    sigset_t mask, chld_mask;
+
+    sigemptyset(&chld_mask);
+    sigaddset(&chld_mask, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &chld_mask, &mask);
+
+    if ( (pid = Fork()) == 0) {
+        sigprocmask(SIG_SETMASK, &mask, NULL);
+        err_msg("starting unsent service");
+        unsent_service();
+        exit(0);
+    }
+    ++sproc_counter;
+    sigprocmask(SIG_SETMASK, &mask, NULL);
+
+    return pid;
+}
+
 /* S/MIME Gate main function */
 int main (int argc, char **argv)
 {
-    int listenfd, connfd;
+    int listenfd, connfd, ctlfd, loaderfd = -1;
     pid_t childpid, unsentpid;
-    sigset_t mask, chld_mask;
+    sigset_t mask, chld_mask, ctl_mask, wait_mask;
+    struct pollfd fds[3];
     socklen_t clilen;
     struct sockaddr_in cliaddr, servaddr;
     void sig_chld(int);
@@ -30,6 +66,17 @@ int main (int argc, char **argv)
     parse_args(argc, argv);
     load_config();
 
+    /* compile rules snapshot, if it was requested */
+    if (NULL != conf.compile_rules) {
+        if (0 != rules_snapshot_save(conf.compile_rules)) {
+            fprintf(stderr, "Can't write '%s' rules snapshot.\n",
+                    conf.compile_rules);
+            exit(1);
+        }
+        printf("Rules compiled into '%s'.\n", conf.compile_rules);
+        exit(0);
+    }
+
     printf("Starting smime-gate (v%s)...\n", conf.version);
 
 #ifdef DEBUG
@@ -42,6 +89,43 @@ int main (int argc, char **argv)
         err_msg("Starting smime-gate (v%s) in daemon mode...", conf.version);
     }
 
+    /* open log spool, received mails are appended to it */
+    if (SPOOL_LOG == conf.spool) {
+        queue_init();
+        smtp_hooks.save = queue_save_mail;
+    }
+    else    /* directory spool, mail files appear only when written whole */
+        smtp_hooks.save = durable_save_mail;
+
+    /* statistics shared by all processes, spool writes are measured */
+    stats_init();
+    stats_save = smtp_hooks.save;
+    smtp_hooks.save = stats_save_mail;
+
+    /* message events are logged (if it is set so) */
+    trace_init();
+    if (NULL != conf.event_log) {
+        trace_save = smtp_hooks.save;
+        smtp_hooks.save = trace_save_mail;
+        smtp_hooks.sent = trace_sent;
+    }
+
+    /* sessions don't wait for syslog, messages are written by logger */
+    log_init();
+
+    /* resolve processing rules while the client is still sending mail */
+    smtp_hooks.envelope = smime_envelope;
+    if (conf.stream_sign) {
+        smtp_hooks.data = smime_data;
+        smtp_hooks.drop = smime_drop;
+    }
+
+    /* start flusher for group commit of accepted mails */
+    flusher_init();
+
+    /* start metrics service (if it is set so) */
+    metrics_init();
+
     /* create listening socket for SMTP Server */
     listenfd = Socket(AF_INET, SOCK_STREAM, 0);
 
@@ -63,15 +147,71 @@ int main (int argc, char **argv)
     sigemptyset(&chld_mask);
     sigaddset(&chld_mask, SIGCHLD);
 
+    /* SIGHUP reloads configuration and SIGUSR1 logs statistics, they are *
+     * delivered only while waiting for connections (see ppoll() below)   */
+    Signal(SIGHUP, sig_hup);
+    Signal(SIGUSR1, sig_usr1);
+    sigemptyset(&ctl_mask);
+    sigaddset(&ctl_mask, SIGHUP);
+    sigaddset(&ctl_mask, SIGUSR1);
+    sigprocmask(SIG_BLOCK, &ctl_mask, &wait_mask);
+    sigdelset(&wait_mask, SIGHUP);
+    sigdelset(&wait_mask, SIGUSR1);
+
+    /* control socket for operator (statistics and commands) */
+    ctlfd = control_init();
+
+    /* resume work left by crashed sessions (before unsent service starts, *
+     * as it takes over already processed mails)                          */
+    recover_mails();
+
     /* start unsent service */
-    if ( (unsentpid = Fork()) == 0) {
-        err_msg("starting unsent service");
-        unsent_service();
-        exit(0);
-    }
+    unsentpid = start_unsent();
 
     /* SMTP Server's main loop */
     for (;;) {
+        stats_gauge(GAUGE_SUBPROC, sproc_counter > 0 ? sproc_counter : 0);
+        if (stats_request) {
+            stats_request = 0;
+            stats_log();
+        }
+
+        /* parse new generation in loader, accepting goes on meanwhile */
+        if (reload_request && loaderfd < 0) {
+            reload_request = 0;
+            loaderfd = reload_start();
+        }
+
+        fds[0].fd = listenfd;
+        fds[0].events = POLLIN;
+        fds[1].fd = loaderfd;
+        fds[1].events = POLLIN;
+        fds[2].fd = ctlfd;
+        fds[2].events = POLLIN;
+
+        if (ppoll(fds, 3, NULL, &wait_mask) < 0) {
+            if (errno == EINTR)
+                continue;
+            else
+                err_sys("poll error");
+        }
+
+        /* switch new sessions to new generation, running ones keep theirs */
+        if (loaderfd >= 0 && 0 != fds[1].revents) {
+            if (RELOAD_SRV == reload_finish(loaderfd)) {
+                /* unsent service delivers to the new mail server */
+                kill(unsentpid, SIGTERM);
+                unsentpid = start_unsent();
+            }
+            loaderfd = -1;
+        }
+
+        if (fds[2].revents & POLLIN)
+            control_serve(ctlfd);
+
+        if (0 == (fds[0].revents & POLLIN))
+            continue;
+
         clilen = sizeof(cliaddr);
         if ( (connfd = accept(listenfd, (SA *) &cliaddr, &clilen)) < 0) {
 #ifdef DEBUG
@@ -90,15 +230,21 @@ int main (int argc, char **argv)
 #endif
             if ( (childpid = Fork()) == 0) {    /* child process */
                 Close(listenfd);                /* close listening socket */
+                Close(ctlfd);
+                if (loaderfd >= 0)
+                    Close(loaderfd);
                 smime_gate_service(connfd);     /* process the request */
                 exit(0);
             }
             sigprocmask(SIG_BLOCK, &chld_mask, &mask);
             ++sproc_counter;
             sigprocmask(SIG_SETMASK, &mask, NULL);
+            stats_count(CNT_ACCEPTED, 1);
         }
-        else
+        else {
             err_msg("subprocesses limit exceeded, connection refused");
+            stats_count(CNT_REFUSED, 1);
+        }
 
         Close(connfd);  /* parent closes connected socket */
     }
@@ -0,0 +1,233 @@
+/**
+ * File:        src/metrics.c
+ * Description: Metrics service. Separate process listens on loopback
+ *              (metrics_port option) and answers 'GET /metrics' with
+ *              statistics in Prometheus text exposition format. Counters
+ *              are summed up from per-process slots at scrape time, so
+ *              sessions are not disturbed by scraping.
+ * Author:      Tomasz Pieczerak (tphaster)
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <sys/prctl.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include "config.h"
+#include "metrics.h"
+#include "stats.h"
+#include "system.h"
+
+#define METRIC_PREFIX   "smime_gate_"
+
+
+/** Local variables **/
+
+/* upper bounds of latency histogram buckets (microseconds) */
+static const uint64_t metric_buckets[] = {
+    100, 250, 500, 1000, 2500, 5000, 10000, 25000, 50000, 100000,
+    250000, 500000, 1000000, 2500000, 5000000, 10000000, 30000000, 60000000
+};
+
+/* names of operations (rule types) */
+static const char *metric_ops[RULE_TYPES] = {
+    "encrypt", "sign", "decrypt", "verify"
+};
+
+
+/* metric_head - write HELP and TYPE lines of metric */
+static void metric_head (FILE *fp, const char *name, const char *type,
+                         const char *help)
+{
+    fprintf(fp, "# HELP " METRIC_PREFIX "%s %s\n", name, help);
+    fprintf(fp, "# TYPE " METRIC_PREFIX "%s %s\n", name, type);
+}
+
+/* metric - write metric without labels */
+static void metric (FILE *fp, const char *name, const char *type,
+                    const char *help, uint64_t value)
+{
+    metric_head(fp, name, type, help);
+    fprintf(fp, METRIC_PREFIX "%s %llu\n", name, (unsigned long long) value);
+}
+
+/* metrics_write - write all metrics in Prometheus text format */
+static void metrics_write (FILE *fp)
+{
+    int i;
+    unsigned int b;
+    uint64_t accepted, closed;
+    struct stats_hist h;
+
+    metric(fp, "connections_accepted_total", "counter",
+           "Client connections accepted.", stats_counter(CNT_ACCEPTED));
+    metric(fp, "connections_refused_total", "counter",
+           "Client connections refused (subprocesses limit).",
+           stats_counter(CNT_REFUSED));
+
+    accepted = stats_counter(CNT_ACCEPTED);
+    closed = stats_counter(CNT_CLOSED);
+    metric(fp, "connections_active", "gauge",
+           "Client sessions in progress.",
+           accepted > closed ? accepted - closed : 0);
+    metric(fp, "subprocesses", "gauge", "Forked subprocesses.",
+           stats_gauge_value(GAUGE_SUBPROC));
+    metric(fp, "subprocesses_max", "gauge", "Limit of forked subprocesses.",
+           MAXSUBPROC);
+
+    metric(fp, "mails_received_total", "counter", "Mails received.",
+           stats_counter(CNT_RECEIVED));
+    metric_head(fp, "mails_processed_total", "counter",
+                "Mails processed by S/MIME operation.");
+    for (i = 0; i < RULE_TYPES; ++i)
+        fprintf(fp, METRIC_PREFIX "mails_processed_total{operation=\"%s\"} "
+                "%llu\n", metric_ops[i],
+                (unsigned long long) stats_counter(CNT_PROCESSED(i)));
+    metric(fp, "crypto_failures_total", "counter",
+           "Failed S/MIME operations.", stats_counter(CNT_CRYPTO_FAIL));
+    metric(fp, "mails_forwarded_total", "counter",
+           "Mails forwarded to mail server.", stats_counter(CNT_FORWARDED));
+    metric(fp, "mails_unsent_total", "counter",
+           "Mails left for unsent service.", stats_counter(CNT_UNSENT));
+    metric(fp, "unsent_queue", "gauge",
+           "Mails waiting for unsent service.", stats_unsent());
+    metric(fp, "received_bytes_total", "counter",
+           "Mail data received from clients.", stats_counter(CNT_BYTES_IN));
+    metric(fp, "forwarded_bytes_total", "counter",
+           "Mail data forwarded to mail server.",
+           stats_counter(CNT_BYTES_OUT));
+    metric(fp, "log_dropped_total", "counter",
+           "Log records dropped, because logger was behind.",
+           stats_counter(CNT_LOG_DROPPED));
+
+    metric_head(fp, "stage_latency_seconds", "histogram",
+                "Latency of mail pipeline stages.");
+    for (i = 0; i < STAGES; ++i) {
+        stats_collect(i, &h);
+
+        for (b = 0; b < sizeof(metric_buckets)/sizeof(metric_buckets[0]); ++b)
+            fprintf(fp, METRIC_PREFIX "stage_latency_seconds_bucket"
+                    "{stage=\"%s\",le=\"%g\"} %llu\n", stats_stage_name(i),
+                    metric_buckets[b] / 1e6,
+                    (unsigned long long) stats_count_below(&h,
+                                                           metric_buckets[b]));
+        fprintf(fp, METRIC_PREFIX "stage_latency_seconds_bucket"
+                "{stage=\"%s\",le=\"+Inf\"} %llu\n", stats_stage_name(i),
+                (unsigned long long) h.count);
+        fprintf(fp, METRIC_PREFIX "stage_latency_seconds_sum{stage=\"%s\"} "
+                "%.6f\n", stats_stage_name(i), h.sum / 1e6);
+        fprintf(fp, METRIC_PREFIX "stage_latency_seconds_count{stage=\"%s\"} "
+                "%llu\n", stats_stage_name(i), (unsigned long long) h.count);
+    }
+}
+
+/* metrics_serve - answer one HTTP request */
+static void metrics_serve (int connfd)
+{
+    ssize_t n, len = 0;
+    size_t body_len = 0;
+    char req[METRICS_REQLEN], hdr[256];
+    char *body = NULL;
+    FILE *fp;
+    struct timeval tv = { 1, 0 };
+
+    setsockopt(connfd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    setsockopt(connfd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+
+    /* read request line and headers */
+    while (len < METRICS_REQLEN-1) {
+        if ((n = read(connfd, req+len, METRICS_REQLEN-1-len)) < 0) {
+            if (EINTR == errno)
+                continue;
+            return;
+        }
+        if (0 == n)
+            break;
+        len += n;
+        req[len] = '\0';
+        if (NULL != strstr(req, "\r\n\r\n") || NULL != strstr(req, "\n\n"))
+            break;
+    }
+    req[len] = '\0';
+
+    if (0 != strncmp("GET /metrics", req, 12) ||
+        (' ' != req[12] && '?' != req[12])) {
+        n = snprintf(hdr, sizeof(hdr), "HTTP/1.0 404 Not Found\r\n"
+                     "Content-Type: text/plain\r\n"
+                     "Content-Length: 10\r\n"
+                     "Connection: close\r\n\r\nnot found\n");
+        writen(connfd, hdr, n);
+        return;
+    }
+
+    if (NULL == (fp = open_memstream(&body, &body_len)))
+        return;
+    metrics_write(fp);
+    fclose(fp);
+
+    n = snprintf(hdr, sizeof(hdr), "HTTP/1.0 200 OK\r\n"
+                 "Content-Type: text/plain; version=0.0.4\r\n"
+                 "Content-Length: %lu\r\n"
+                 "Connection: close\r\n\r\n", (unsigned long) body_len);
+    if (writen(connfd, hdr, n) == n)
+        writen(connfd, body, body_len);
+    free(body);
+}
+
+/* metrics_service - serve scrapes one by one */
+static void metrics_service (int listenfd)
+{
+    int connfd;
+
+    prctl(PR_SET_PDEATHSIG, SIGTERM);
+
+    for (;;) {
+        if ((connfd = accept(listenfd, NULL, NULL)) < 0) {
+            if (EINTR != errno && ECONNABORTED != errno) {
+                err_ret("metrics: accept error");
+                sleep(1);   /* e.g. out of descriptors, don't spin */
+            }
+            continue;
+        }
+
+        metrics_serve(connfd);
+        close(connfd);
+    }
+}
+
+/* metrics_init - start metrics service, if metrics port is set */
+void metrics_init (void)
+{
+    int listenfd, on = 1;
+    struct sockaddr_in addr;
+
+    if (0 == conf.metrics_port)
+        return;
+
+    listenfd = Socket(AF_INET, SOCK_STREAM, 0);
+    setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+
+    /* metrics are for local scraper (or a proxy) only */
+    bzero(&addr, sizeof(addr));
+    addr.sin_family      = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port        = conf.metrics_port;
+
+    Bind(listenfd, (SA *) &addr, sizeof(addr));
+    Listen(listenfd, LISTENQ);
+
+    if (Fork() == 0) {
+        err_msg("starting metrics service on port %d",
+                ntohs(conf.metrics_port));
+        metrics_service(listenfd);
+        exit(0);
+    }
+    ++sproc_counter;    /* (SIGCHLD isn't handled yet) */
+
+    Close(listenfd);
+}
@@ -0,0 +1,827 @@
+/**
+ * File:        src/queue.c
+ * Description: Append-only segmented log queue. Mail objects are appended
+ *              to the active segment (see durable.c), delivery is
+ *              recorded as an acknowledgement record and fully acknowledged
+ *              segments are compacted and deleted.
+ * Author:      Tomasz Pieczerak (tphaster)
+ */
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include "config.h"
+#include "durable.h"
+#include "queue.h"
+#include "smtp.h"
+#include "smtp-lib.h"
+#include "stats.h"
+#include "system.h"
+#include "trace.h"
+
+#define QREC_MAGIC      0x51474d53          /* record magic, "SMGQ" */
+#ifndef QSEG_MAXSIZE   /* (queue test builds queue.c with smaller one) */
+#define QSEG_MAXSIZE    (16*1024*1024)      /* segment rotation size */
+#endif
+
+/* Index entry flags */
+#define QE_MAIL     0x1     /* QREC_MAIL record seen */
+#define QE_DONE     0x2     /* QREC_DONE record seen */
+#define QE_ACK      0x4     /* QREC_ACK record seen */
+
+
+/** Typedefs **/
+
+/* struct qrec_hdr - on-disk record header, followed by payload */
+struct qrec_hdr {
+    uint32_t magic;         /* QREC_MAGIC */
+    uint32_t type;          /* record type */
+    uint32_t len;           /* payload length */
+    uint32_t sum;           /* checksum of header and payload */
+    char id[QID_LEN];       /* message identifier */
+};
+
+/* struct queue_shm - queue state shared by all processes */
+struct queue_shm {
+    uint32_t segno;         /* active segment number */
+};
+
+/* struct qent - index entry, state of one message */
+struct qent {
+    char id[QID_LEN];       /* message identifier (empty for free entry) */
+    int flags;              /* records seen (see Index entry flags) */
+    uint32_t mail_seg;      /* location of the latest QREC_MAIL */
+    size_t mail_off;
+    uint32_t done_seg;      /* location of the latest QREC_DONE */
+    size_t done_off;
+    uint32_t last_seg;      /* segment of the latest MAIL/DONE record */
+};
+
+/* struct qindex - open addressing hash table of messages */
+struct qindex {
+    struct qent *ents;
+    size_t size;            /* table size (power of 2) */
+    size_t used;            /* number of used entries */
+    int failed;             /* some record couldn't be indexed */
+};
+
+/* struct qcompact - queue_compact() state */
+struct qcompact {
+    struct qindex *idx;
+    int failed;             /* copying of some live record failed */
+    int copied;             /* some live record was copied */
+};
+
+
+/** Local variables **/
+static struct queue_shm *qshm;  /* shared queue state */
+static pid_t q_owner;           /* process which opened descriptors below */
+static int q_lockfd = -1;       /* lock file, appends hold it shared, *
+                                 * rotation and compaction exclusive */
+static int q_segfd = -1;        /* active segment opened for appending */
+static uint32_t q_segno;        /* number of segment opened in q_segfd */
+
+
+/* queue_segpath - make path of segment file */
+void queue_segpath (char *path, uint32_t segno)
+{
+    snprintf(path, QSEG_FNMAXLEN, DEFAULT_QUEUE_DIR "/%08u.log",
+             (unsigned int) segno);
+}
+
+/* q_syncdir - make new directory entries of the queue durable */
+static void q_syncdir (void)
+{
+    int fd;
+
+    if ((fd = open(DEFAULT_QUEUE_DIR, O_RDONLY)) >= 0) {
+        fsync(fd);
+        close(fd);
+    }
+}
+
+/* q_hash - FNV-1a hash, continued from given value */
+static uint32_t q_hash (uint32_t h, const void *buf, size_t len)
+{
+    const unsigned char *p = buf;
+
+    while (len-- > 0) {
+        h ^= *p++;
+        h *= 16777619u;
+    }
+
+    return h;
+}
+
+/* q_sum - checksum of record header (without sum field) and payload */
+static uint32_t q_sum (const struct qrec_hdr *hdr, const struct iovec *iov,
+                       int iovcnt)
+{
+    int i;
+    uint32_t h = 2166136261u;
+
+    h = q_hash(h, &(hdr->type), sizeof(hdr->type));
+    h = q_hash(h, &(hdr->len), sizeof(hdr->len));
+    h = q_hash(h, hdr->id, QID_LEN);
+    for (i = 0; i < iovcnt; ++i)
+        h = q_hash(h, iov[i].iov_base, iov[i].iov_len);
+
+    return h;
+}
+
+/* q_segfilter - select segment files */
+static int q_segfilter (const struct dirent *en)
+{
+    size_t len = strlen(en->d_name);
+
+    return len > 4 && 0 == strcmp(en->d_name+len-4, ".log");
+}
+
+/* q_segments - get sorted numbers of all segments, returns their count */
+static int q_segments (uint32_t **segs)
+{
+    int i, n;
+    struct dirent **eps;
+
+    *segs = NULL;
+    if ((n = scandir(DEFAULT_QUEUE_DIR, &eps, q_segfilter, alphasort)) < 0)
+        return -1;
+
+    if (n > 0 && NULL == (*segs = malloc(n * sizeof(uint32_t)))) {
+        for (i = 0; i < n; ++i)
+            free(eps[i]);
+        free(eps);
+        return -1;
+    }
+
+    /* segment names are zero-padded, so they are already sorted */
+    for (i = 0; i < n; ++i) {
+        (*segs)[i] = strtoul(eps[i]->d_name, NULL, 10);
+        free(eps[i]);
+    }
+    free(eps);
+
+    return n;
+}
+
+/* queue_init - prepare queue for appending, must be called before *
+ *              forking any process which uses the queue            */
+void queue_init (void)
+{
+    int fd, n;
+    uint32_t *segs;
+    char path[QSEG_FNMAXLEN];
+
+    if (0 != mkdir(DEFAULT_QUEUE_DIR, 0700) && EEXIST != errno)
+        err_sys("can't create queue directory");
+
+    qshm = mmap(NULL, sizeof(struct queue_shm), PROT_READ | PROT_WRITE,
+                MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (MAP_FAILED == qshm)
+        err_sys("mmap error");
+
+    if ((n = q_segments(&segs)) < 0)
+        err_sys("can't read queue directory");
+
+    /* always start a fresh segment, so a record torn by crash stays *
+     * at the end of closed segment                                  */
+    qshm->segno = (n > 0) ? segs[n-1]+1 : 1;
+    free(segs);
+
+    queue_segpath(path, qshm->segno);
+    if ((fd = open(path, O_WRONLY | O_CREAT, 0600)) < 0)
+        err_sys("can't create queue segment");
+    close(fd);
+    q_syncdir();
+}
+
+/* q_open - (re)open lock file for this process */
+static int q_open (void)
+{
+    if (NULL == qshm)
+        return -1;  /* queue_init() was not called */
+
+    /* descriptors inherited from parent share lock with it */
+    if (getpid() != q_owner) {
+        if (q_lockfd >= 0)
+            close(q_lockfd);
+        if (q_segfd >= 0)
+            close(q_segfd);
+        q_segfd = -1;
+
+        q_lockfd = open(DEFAULT_QUEUE_DIR "/lock", O_RDWR | O_CREAT, 0600);
+        if (q_lockfd < 0)
+            return -1;
+        q_owner = getpid();
+    }
+
+    return 0;
+}
+
+/* q_open_segment - (re)open active segment, lock has to be held, so it *
+ *                  can't be rotated and compacted while written to     */
+static int q_open_segment (void)
+{
+    char path[QSEG_FNMAXLEN];
+
+    /* follow segment rotation */
+    if (q_segfd < 0 || q_segno != qshm->segno) {
+        if (q_segfd >= 0)
+            close(q_segfd);
+
+        q_segno = qshm->segno;
+        queue_segpath(path, q_segno);
+        q_segfd = open(path, O_WRONLY | O_APPEND | O_CREAT, 0600);
+        if (q_segfd < 0)
+            return -1;
+    }
+
+    return 0;
+}
+
+/* q_lock - lock/unlock queue rotation lock */
+static void q_lock (int op)
+{
+    while (flock(q_lockfd, op) < 0 && EINTR == errno)
+        ;
+}
+
+/* q_commit - make records written up to 'end' durable (according to *
+ *            configured durability), full segment is rotated          */
+static int q_commit (off_t end)
+{
+    int fd, ret;
+    char path[QSEG_FNMAXLEN];
+
+    ret = durable_sync_fd(q_segfd);
+
+    /* rotate full segment, unless someone already did it */
+    if (end >= QSEG_MAXSIZE) {
+        q_lock(LOCK_EX);
+        if (qshm->segno == q_segno) {
+            queue_segpath(path, q_segno+1);
+            if ((fd = open(path, O_WRONLY | O_CREAT, 0600)) >= 0) {
+                close(fd);
+                q_syncdir();
+                qshm->segno = q_segno+1;
+            }
+        }
+        q_lock(LOCK_UN);
+    }
+
+    return ret;
+}
+
+/* q_envelope - make mail object's envelope in mail file format, returns *
+ *              allocated pointer (behaves like malloc())                */
+static char *q_envelope (struct mail_object *mail, size_t *len)
+{
+    char *env;
+    size_t i, pos;
+
+    *len = strlen(mail->mail_from) + 1 + 24;
+    for (i = 0; i < mail->no_rcpt; ++i)
+        *len += strlen(mail->rcpt_to[i]) + 1;
+
+    if (NULL == (env = malloc(*len)))
+        return NULL;
+
+    pos = sprintf(env, "%s\n%u\n", mail->mail_from,
+                  (unsigned int) mail->no_rcpt);
+    for (i = 0; i < mail->no_rcpt; ++i)
+        pos += sprintf(env+pos, "%s\n", mail->rcpt_to[i]);
+    *len = pos;
+
+    return env;
+}
+
+/* q_write - write record to the active segment, lock has to be held, *
+ *           returns end of the record or -1 on error                   */
+static off_t q_write (int type, const char *id, struct mail_object *mail)
+{
+    int iovcnt = 1;
+    char *env = NULL;
+    size_t envlen = 0;
+    ssize_t total;
+    struct qrec_hdr hdr;
+    struct iovec iov[3];
+
+    if (strlen(id) >= QID_LEN || 0 != q_open_segment())
+        return -1;
+
+    bzero(&hdr, sizeof(hdr));
+    hdr.magic = QREC_MAGIC;
+    hdr.type = type;
+    strcpy(hdr.id, id);
+
+    if (NULL != mail) {
+        if (NULL == (env = q_envelope(mail, &envlen)))
+            return -1;
+
+        iov[1].iov_base = env;
+        iov[1].iov_len = envlen;
+        iov[2].iov_base = mail->data;
+        iov[2].iov_len = mail->data_size;
+        iovcnt = 3;
+        hdr.len = envlen + mail->data_size;
+    }
+    hdr.sum = q_sum(&hdr, iov+1, iovcnt-1);
+
+    iov[0].iov_base = &hdr;
+    iov[0].iov_len = sizeof(hdr);
+    total = sizeof(hdr) + hdr.len;
+
+    /* single write with O_APPEND, records of processes don't interleave */
+    if (total != writev(q_segfd, iov, iovcnt)) {
+        free(env);
+        return -1;
+    }
+    free(env);
+
+    return lseek(q_segfd, 0, SEEK_CUR);
+}
+
+/* queue_append - append record to the log, returns when it is durable *
+ *                (according to configured durability)                 */
+int queue_append (int type, const char *id, struct mail_object *mail)
+{
+    off_t end;
+
+    if (0 != q_open())
+        return -1;
+
+    q_lock(LOCK_SH);
+    end = q_write(type, id, mail);
+    q_lock(LOCK_UN);
+
+    if (end < 0)
+        return -1;
+
+    return q_commit(end);
+}
+
+/* queue_save_mail - store received mail object in the log (SMTP Server *
+ *                   hook), file name is used as message identifier     */
+int queue_save_mail (struct mail_object *mail, const char *filename)
+{
+    const char *id;
+
+    if (NULL == (id = strrchr(filename, '/')))
+        id = filename;
+    else
+        ++id;
+
+    return queue_append(QREC_MAIL, id, mail);
+}
+
+/* q_resync - find next record header after damaged one */
+static size_t q_resync (const char *map, size_t size, size_t pos)
+{
+    uint32_t magic = QREC_MAGIC;
+
+    for (; pos + sizeof(magic) <= size; ++pos) {
+        if (0 == memcmp(map+pos, &magic, sizeof(magic)))
+            return pos;
+    }
+
+    return size;
+}
+
+/* q_scan_segment - call 'fn' for each valid record of segment */
+static int q_scan_segment (uint32_t segno, queue_scan_fn *fn, void *arg)
+{
+    int fd;
+    char *map;
+    size_t pos;
+    struct stat st;
+    struct iovec iov;
+    struct qrec_hdr hdr;
+    struct queue_rec rec;
+    char path[QSEG_FNMAXLEN];
+
+    queue_segpath(path, segno);
+    if ((fd = open(path, O_RDONLY)) < 0)
+        return (ENOENT == errno) ? 0 : -1;  /* (compacted meanwhile) */
+    if (fstat(fd, &st) < 0) {
+        close(fd);
+        return -1;
+    }
+    if (0 == st.st_size) {
+        close(fd);
+        return 0;   /* empty segment */
+    }
+
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (MAP_FAILED == map)
+        return -1;
+    madvise(map, st.st_size, MADV_SEQUENTIAL);
+
+    pos = 0;
+    while (pos + sizeof(hdr) <= (size_t) st.st_size) {
+        memcpy(&hdr, map+pos, sizeof(hdr));
+        iov.iov_base = map+pos+sizeof(hdr);
+        iov.iov_len = hdr.len;
+
+        /* skip records torn by crash or otherwise damaged */
+        if (QREC_MAGIC != hdr.magic
+            || hdr.len > st.st_size - pos - sizeof(hdr)
+            || '\0' != hdr.id[QID_LEN-1]
+            || hdr.sum != q_sum(&hdr, &iov, 1))
+        {
+            pos = q_resync(map, st.st_size, pos+1);
+            continue;
+        }
+
+        rec.type = hdr.type;
+        rec.id = hdr.id;
+        rec.payload = iov.iov_base;
+        rec.len = hdr.len;
+        rec.segno = segno;
+        rec.off = pos;
+        fn(&rec, arg);
+
+        pos += sizeof(hdr) + hdr.len;
+    }
+
+    munmap(map, st.st_size);
+
+    return 0;
+}
+
+/* queue_scan - call 'fn' for each valid record in the log, in order, *
+ *              returns -1 if some segment can't be read (the others   *
+ *              are scanned anyway)                                    */
+int queue_scan (queue_scan_fn *fn, void *arg)
+{
+    int i, n, ret = 0;
+    uint32_t *segs;
+
+    if ((n = q_segments(&segs)) < 0)
+        return -1;
+
+    for (i = 0; i < n; ++i) {
+        if (0 != q_scan_segment(segs[i], fn, arg)) {
+            err_ret("cannot read queue segment %u", (unsigned int) segs[i]);
+            ret = -1;
+        }
+    }
+
+    free(segs);
+
+    return ret;
+}
+
+/* queue_load - load mail object of record at given location, mail body *
+ *              points into mapping of the segment                      */
+int queue_load (uint32_t segno, size_t off, struct mail_object *mail)
+{
+    int fd, ret;
+    char *map;
+    struct stat st;
+    struct qrec_hdr hdr;
+    char path[QSEG_FNMAXLEN];
+
+    bzero(mail, sizeof(struct mail_object));
+
+    queue_segpath(path, segno);
+    if ((fd = open(path, O_RDONLY)) < 0)
+        return EFOPEN;
+    if (fstat(fd, &st) < 0 || (size_t) st.st_size < off + sizeof(hdr)) {
+        close(fd);
+        return EUEXEOF;
+    }
+
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (MAP_FAILED == map)
+        return EMMAP;
+
+    memcpy(&hdr, map+off, sizeof(hdr));
+    if (QREC_MAGIC != hdr.magic || hdr.len > st.st_size - off - sizeof(hdr)) {
+        munmap(map, st.st_size);
+        return EUEXEOF;
+    }
+
+    madvise(map+off, sizeof(hdr) + hdr.len, MADV_SEQUENTIAL);
+    if (0 != (ret = parse_mail_buffer(map+off+sizeof(hdr), hdr.len, mail))) {
+        munmap(map, st.st_size);
+        return ret;
+    }
+    mail->map_addr = map;
+    mail->map_size = st.st_size;
+
+    return 0;
+}
+
+/* qindex_get - find (or add) index entry of message */
+static struct qent *qindex_get (struct qindex *idx, const char *id)
+{
+    size_t i, j, mask;
+    struct qent *ents;
+
+    /* keep load factor below 1/2 */
+    if (2 * (idx->used+1) > idx->size) {
+        size_t size = idx->size ? 2 * idx->size : 256;
+
+        if (NULL == (ents = calloc(size, sizeof(struct qent))))
+            return NULL;
+
+        mask = size-1;
+        for (i = 0; i < idx->size; ++i) {
+            if ('\0' == idx->ents[i].id[0])
+                continue;
+
+            j = q_hash(2166136261u, idx->ents[i].id,
+                       strlen(idx->ents[i].id)) & mask;
+            while ('\0' != ents[j].id[0])
+                j = (j+1) & mask;
+            ents[j] = idx->ents[i];
+        }
+
+        free(idx->ents);
+        idx->ents = ents;
+        idx->size = size;
+    }
+
+    mask = idx->size-1;
+    i = q_hash(2166136261u, id, strlen(id)) & mask;
+    while ('\0' != idx->ents[i].id[0]) {
+        if (0 == strcmp(idx->ents[i].id, id))
+            return idx->ents+i;
+        i = (i+1) & mask;
+    }
+
+    strcpy(idx->ents[i].id, id);
+    ++idx->used;
+
+    return idx->ents+i;
+}
+
+/* q_index_rec - add record to the index (queue_scan() callback) */
+static void q_index_rec (const struct queue_rec *rec, void *arg)
+{
+    struct qent *e;
+    struct qindex *idx = arg;
+
+    if (NULL == (e = qindex_get(idx, rec->id))) {
+        idx->failed = 1;    /* (the index is incomplete) */
+        return;
+    }
+
+    if (QREC_MAIL == rec->type) {
+        e->flags |= QE_MAIL;
+        e->mail_seg = rec->segno;
+        e->mail_off = rec->off;
+        e->last_seg = rec->segno;
+    }
+    else if (QREC_DONE == rec->type) {
+        e->flags |= QE_DONE;
+        e->done_seg = rec->segno;
+        e->done_off = rec->off;
+        e->last_seg = rec->segno;
+    }
+    else if (QREC_ACK == rec->type)
+        e->flags |= QE_ACK;
+}
+
+/* q_pending_cmp - order pending mails by their position in the log */
+static int q_pending_cmp (const void *a, const void *b)
+{
+    const struct qent *x = *(const struct qent **) a;
+    const struct qent *y = *(const struct qent **) b;
+
+    if (x->done_seg != y->done_seg)
+        return x->done_seg < y->done_seg ? -1 : 1;
+    if (x->done_off != y->done_off)
+        return x->done_off < y->done_off ? -1 : 1;
+    return 0;
+}
+
+/* send_mails_from_queue - send all processed, but not yet delivered, *
+ *                         mails stored in the log                    */
+int send_mails_from_queue (struct sockaddr_in *srv_sock)
+{
+    int ret = 0, cli, srvfd, connected, first = 1;
+    size_t i, n = 0;
+    struct qindex idx;
+    struct qent **pend;
+    struct mail_object mail;
+
+    bzero(&idx, sizeof(idx));
+    if (0 != queue_scan(q_index_rec, &idx) || idx.failed) {
+        err_ret("cannot read queue directory");
+        free(idx.ents);
+        return -1;
+    }
+
+    if (NULL == (pend = malloc((idx.used+1) * sizeof(struct qent *)))) {
+        free(idx.ents);
+        return -1;
+    }
+    for (i = 0; i < idx.size; ++i) {
+        if ((idx.ents[i].flags & (QE_DONE | QE_ACK)) == QE_DONE)
+            pend[n++] = idx.ents+i;
+    }
+
+    if (0 == n)
+        goto end_send;  /* no mails waiting for delivery */
+
+    qsort(pend, n, sizeof(struct qent *), q_pending_cmp);
+
+    srvfd = Socket(AF_INET, SOCK_STREAM, 0);
+    if (connect(srvfd, (SA *) srv_sock, sizeof(*srv_sock)) < 0) {
+        err_ret("cannot connect to mail server");
+        close(srvfd);
+        ret = -1;
+        goto end_send;
+    }
+    connected = 1;
+
+    for (i = 0; i < n; ++i) {
+        if (queue_load(pend[i]->done_seg, pend[i]->done_off, &mail)) {
+            err_msg("cannot load mail %s from queue", pend[i]->id);
+            continue;
+        }
+
+        if (first)
+            cli = SMTP_CLI_NEW;
+        else
+            cli = SMTP_CLI_NXT;
+        first = 0;
+        if (n-1 == i)
+            cli |= SMTP_CLI_LST;
+        else
+            cli |= SMTP_CLI_CON;
+
+        if (smtp_send_mail(srvfd, &mail, cli) >= 0) {
+            queue_append(QREC_ACK, pend[i]->id, NULL);
+            trace_event("deliver", pend[i]->id, "\"by\":\"unsent\"");
+            ++ret;
+        }
+        else
+            connected = 0;  /* connection closed by smtp_send_mail() */
+
+        free_mail_object(&mail);
+
+        if (!connected || (cli & SMTP_CLI_LST)) {
+            connected = 0;
+            break;
+        }
+    }
+
+    if (connected) {
+        smtp_send_command(srvfd, QUIT, NULL);
+        close(srvfd);
+    }
+
+end_send:
+    stats_gauge(GAUGE_UNSENT_LOG, n - (ret > 0 ? ret : 0));
+    free(pend);
+    free(idx.ents);
+
+    return ret;  /* return number of sent mails */
+}
+
+/* queue_unprocessed - call 'fn' for each mail, which was received but *
+ *                     neither processed nor delivered (its session     *
+ *                     crashed), returns number of such mails           */
+int queue_unprocessed (queue_scan_fn *fn, void *arg)
+{
+    int n = 0;
+    size_t i;
+    struct qindex idx;
+    struct queue_rec rec;
+
+    bzero(&idx, sizeof(idx));
+    if (0 != queue_scan(q_index_rec, &idx) || idx.failed) {
+        free(idx.ents);
+        return -1;
+    }
+
+    bzero(&rec, sizeof(rec));
+    rec.type = QREC_MAIL;
+    for (i = 0; i < idx.size; ++i) {
+        if ((idx.ents[i].flags & (QE_MAIL | QE_DONE | QE_ACK)) == QE_MAIL) {
+            rec.id = idx.ents[i].id;
+            rec.segno = idx.ents[i].mail_seg;
+            rec.off = idx.ents[i].mail_off;
+            fn(&rec, arg);
+            ++n;
+        }
+    }
+
+    free(idx.ents);
+
+    return n;
+}
+
+/* q_copy_live - copy still needed record of compacted segment to the *
+ *               active segment (queue_scan() callback), queue lock is  *
+ *               held exclusively                                       */
+static void q_copy_live (const struct queue_rec *rec, void *arg)
+{
+    int live = 0;
+    struct qent *e;
+    struct mail_object mail;
+    struct qcompact *c = arg;
+
+    /* every record was indexed under the same lock, so a missing *
+     * entry means the index is wrong, not that the record is dead */
+    if (NULL == (e = qindex_get(c->idx, rec->id)) || 0 == e->flags) {
+        c->failed = 1;
+        return;
+    }
+
+    if (QREC_MAIL == rec->type) {
+        /* received, but neither processed nor delivered */
+        live = !(e->flags & (QE_DONE | QE_ACK))
+               && e->mail_seg == rec->segno && e->mail_off == rec->off;
+    }
+    else if (QREC_DONE == rec->type) {
+        /* processed, but not delivered */
+        live = !(e->flags & QE_ACK)
+               && e->done_seg == rec->segno && e->done_off == rec->off;
+    }
+    else if (QREC_ACK == rec->type) {
+        /* acknowledged records are still in some later segment */
+        live = e->last_seg > rec->segno;
+    }
+
+    if (!live)
+        return;
+
+    c->copied = 1;
+    if (QREC_ACK == rec->type) {
+        if (q_write(QREC_ACK, rec->id, NULL) < 0)
+            c->failed = 1;
+    }
+    else if (0 == parse_mail_buffer(rec->payload, rec->len, &mail)) {
+        if (q_write(rec->type, rec->id, &mail) < 0)
+            c->failed = 1;
+        mail.data = NULL;   /* body belongs to the segment mapping */
+        free_mail_object(&mail);
+    }
+    else
+        c->failed = 1;
+}
+
+/* queue_compact - copy live records of closed segments to the active *
+ *                 one and delete those segments (oldest first); queue  *
+ *                 lock is held exclusively, so no append is in flight  *
+ *                 to a segment being deleted                           */
+void queue_compact (void)
+{
+    int i, n;
+    uint32_t *segs;
+    struct qindex idx;
+    struct qcompact c;
+    char path[QSEG_FNMAXLEN];
+
+    if (0 != q_open())
+        return;
+
+    q_lock(LOCK_EX);
+
+    bzero(&idx, sizeof(idx));
+    if (0 != queue_scan(q_index_rec, &idx) || idx.failed) {
+        err_msg("cannot index queue, compaction skipped");
+        goto end_compact;
+    }
+    if ((n = q_segments(&segs)) < 0)
+        goto end_compact;
+
+    c.idx = &idx;
+    c.failed = c.copied = 0;
+
+    for (i = 0; i < n && segs[i] < qshm->segno; ++i) {
+        /* copies have to be durable before the segment is deleted */
+        if (0 != q_scan_segment(segs[i], q_copy_live, &c) || c.failed ||
+            (c.copied && 0 != durable_sync_fd(q_segfd)))
+        {
+            err_msg("cannot compact queue segment %u", (unsigned int) segs[i]);
+            break;  /* keep this segment and all following ones */
+        }
+
+        queue_segpath(path, segs[i]);
+        unlink(path);
+#ifdef DEBUG
+        printf(DPREF "queue segment %u compacted\n", (unsigned int) segs[i]);
+#endif
+    }
+
+    free(segs);
+
+end_compact:
+    q_lock(LOCK_UN);
+    free(idx.ents);
+}
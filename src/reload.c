@@ -0,0 +1,182 @@
+/**
+ * File:        src/reload.c
+ * Description: Live reload of configuration and rules. On SIGHUP a loader
+ *              process parses config and rules files and compiles rules
+ *              into snapshot, then new sessions are switched to it. Sessions
+ *              are forked, so every session keeps the generation it was
+ *              started with and the old one is gone with its last session.
+ * Author:      Tomasz Pieczerak (tphaster)
+ */
+
+#include <errno.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <sys/prctl.h>
+#include "config.h"
+#include "reload.h"
+#include "rules.h"
+#include "system.h"
+
+#define RELOAD_SNAPSHOT DEFAULT_WORKING_DIR "/rules.snap"   /* compiled rules */
+
+
+/** Typedefs **/
+
+/* struct reload_msg - loader's result, sent to parent after the snapshot *
+ *                     of new generation is written                       */
+struct reload_msg {
+    struct sockaddr_in mail_srv;    /* mail server address */
+    uint16_t smtp_port;             /* options, which need restart */
+    uint16_t metrics_port;
+    int spool;
+    int durability;
+    int stream_sign;
+    int pipelined;                  /* session options */
+    int rcpt_dedup;
+    unsigned int slow_log;
+};
+
+
+/** Global variables **/
+volatile sig_atomic_t reload_request = 0;   /* SIGHUP was received */
+
+
+/* sig_hup - request reload of configuration and rules */
+void sig_hup (int signo __attribute__((__unused__)))
+{
+    reload_request = 1;
+}
+
+/* loader - parse configuration and rules, compile rules into snapshot and *
+ *          send result to parent (failed loader exits without result)     */
+static void loader (int fd)
+{
+    struct reload_msg msg;
+
+    prctl(PR_SET_PDEATHSIG, SIGTERM);
+
+    /* load_config() fills in options from scratch, old rules are *
+     * left alone, they belong to parent's generation             */
+    bzero(&conf.mail_srv, sizeof(conf.mail_srv));
+    conf.smtp_port = 0;
+    conf.metrics_port = 0;
+    conf.spool = SPOOL_DIR;
+    conf.durability = DURABLE_NONE;
+    conf.stream_sign = 0;
+    conf.pipelined = 0;
+    conf.rcpt_dedup = 0;
+    conf.slow_log = 0;
+    conf.event_log = NULL;  /* parent's, it needs restart anyway */
+    conf.rules_map = NULL;
+    bzero(conf.rule_idx, sizeof(conf.rule_idx));
+
+    load_config();
+
+    if (0 != rules_snapshot_save(RELOAD_SNAPSHOT))
+        err_sys("loader: can't write rules snapshot");
+
+    bzero(&msg, sizeof(msg));
+    msg.mail_srv = conf.mail_srv;
+    msg.smtp_port = conf.smtp_port;
+    msg.metrics_port = conf.metrics_port;
+    msg.spool = conf.spool;
+    msg.durability = conf.durability;
+    msg.stream_sign = conf.stream_sign;
+    msg.pipelined = conf.pipelined;
+    msg.rcpt_dedup = conf.rcpt_dedup;
+    msg.slow_log = conf.slow_log;
+
+    if (writen(fd, &msg, sizeof(msg)) != sizeof(msg))
+        err_sys("loader: write error");
+}
+
+/* reload_start - start loader of new generation, returns descriptor, *
+ *                which becomes readable when the loader finishes      */
+int reload_start (void)
+{
+    int fds[2];
+    sigset_t mask, chld_mask;
+
+    if (pipe(fds) < 0) {
+        err_ret("reload: pipe error");
+        return -1;
+    }
+
+    err_msg("reloading configuration and rules");
+
+    sigemptyset(&chld_mask);
+    sigaddset(&chld_mask, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &chld_mask, &mask);
+
+    if (Fork() == 0) {
+        sigprocmask(SIG_SETMASK, &mask, NULL);
+        Close(fds[0]);
+        loader(fds[1]);
+        exit(0);
+    }
+    ++sproc_counter;
+    sigprocmask(SIG_SETMASK, &mask, NULL);
+
+    Close(fds[1]);
+    return fds[0];
+}
+
+/* reload_finish - switch new sessions to generation prepared by loader *
+ *                 (old rules are freed here, sessions have their own   *
+ *                 copies), see reload_finish() results                 */
+int reload_finish (int fd)
+{
+    struct reload_msg msg;
+    struct config cur, gen;
+    int ret = RELOAD_DONE;
+
+    if (readn(fd, &msg, sizeof(msg)) != sizeof(msg)) {
+        Close(fd);
+        err_msg("reload failed, keeping current configuration");
+        return RELOAD_FAIL;
+    }
+    Close(fd);
+
+    /* map new rules (snapshot is loaded in milliseconds) */
+    cur = conf;
+    conf.encr_rules = NULL;
+    conf.sign_rules = NULL;
+    conf.decr_rules = NULL;
+    conf.vrfy_rules = NULL;
+    conf.rules_map = NULL;
+    bzero(conf.rule_idx, sizeof(conf.rule_idx));
+
+    if (0 != rules_snapshot_load(RELOAD_SNAPSHOT)) {
+        conf = cur;
+        err_msg("reload failed, can't load '%s'", RELOAD_SNAPSHOT);
+        return RELOAD_FAIL;
+    }
+
+    /* free current generation */
+    gen = conf;
+    conf = cur;
+    free_rules();
+    conf = gen;
+
+    conf.pipelined = msg.pipelined;
+    conf.rcpt_dedup = msg.rcpt_dedup;
+    conf.slow_log = msg.slow_log;
+
+    if (0 != memcmp(&conf.mail_srv, &msg.mail_srv, sizeof(msg.mail_srv))) {
+        conf.mail_srv = msg.mail_srv;
+        ret = RELOAD_SRV;
+    }
+
+    if (msg.smtp_port != conf.smtp_port || msg.spool != conf.spool ||
+        msg.durability != conf.durability ||
+        msg.stream_sign != conf.stream_sign ||
+        msg.metrics_port != conf.metrics_port)
+        err_msg("changed smtp_port, spool, durability, stream_sign or "
+                "metrics_port needs restart");
+
+    err_msg("configuration and rules reloaded");
+    return ret;
+}
@@ -0,0 +1,910 @@
+/**
+ * File:        src/rules.c
+ * Description: Indexed lookup of encryption/signing rules. Rules with full
+ *              mail address are kept in hash table (exact, case-insensitive
+ *              match), partial addresses are matched as substrings by
+ *              Aho-Corasick automaton and domain rules (*@domain) are
+ *              kept in trie of reversed domain labels. Rules with their
+ *              indexes can be compiled into binary snapshot, which is
+ *              mapped at startup instead of parsing rules file.
+ * Author:      Tomasz Pieczerak (tphaster)
+ */
+
+#include <ctype.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "config.h"
+#include "rules.h"
+#include "system.h"
+
+#define SNAP_MAGIC      "SMGRULE1"      /* rules snapshot magic */
+#define SNAP_FIELDS     4               /* string fields per rule record */
+
+/** Typedefs **/
+
+/* struct snap_index - location of prebuilt index in snapshot */
+struct snap_index {
+    uint64_t slots, size, strtab, strtab_len;
+    uint64_t ac_nclass, ac_next, ac_out, ac_states;
+    uint64_t dom_edges, dom_size, dom_rule, dom_nodes;
+    unsigned char ac_class[256];
+};
+
+/* struct snap_hdr - rules snapshot header, all offsets are from the start *
+ *                   of file and sections are in native byte order/layout  */
+struct snap_hdr {
+    char magic[8];                  /* SNAP_MAGIC */
+    uint32_t word;                  /* sizeof(long) of compiling machine */
+    uint32_t nrules[RULE_TYPES];    /* number of rules of each type */
+    uint64_t rules[RULE_TYPES];     /* rule records (SNAP_FIELDS string  *
+                                     * offsets + 1, 0 means no string)   */
+    uint64_t strtab, strtab_len;    /* strings of all rules */
+    uint64_t size;                  /* snapshot size */
+    struct snap_index idx[RULE_TYPES];
+};
+
+
+/* rule_pattern - get address pattern of i-th rule of given type */
+static const char *rule_pattern (int type, size_t i)
+{
+    switch (type) {
+        case RULE_ENCR:
+            return conf.encr_rules[i].rcpt;
+        case RULE_SIGN:
+            return conf.sign_rules[i].sndr;
+        case RULE_DECR:
+            return conf.decr_rules[i].rcpt;
+        case RULE_VRFY:
+            return conf.vrfy_rules[i].sndr;
+    }
+
+    return NULL;
+}
+
+/* rules_count - get number of rules of given type */
+static size_t rules_count (int type)
+{
+    switch (type) {
+        case RULE_ENCR:
+            return conf.encr_rules_size;
+        case RULE_SIGN:
+            return conf.sign_rules_size;
+        case RULE_DECR:
+            return conf.decr_rules_size;
+        case RULE_VRFY:
+            return conf.vrfy_rules_size;
+    }
+
+    return 0;
+}
+
+/* r_hash - FNV-1a hash of string */
+static uint32_t r_hash (const char *s)
+{
+    uint32_t h = 2166136261u;
+
+    while ('\0' != *s) {
+        h ^= (unsigned char) *s++;
+        h *= 16777619u;
+    }
+
+    return h;
+}
+
+/* r_lower - copy lowercase address (without angle brackets) to buffer, *
+ *           returns -1 if it doesn't fit                               */
+static int r_lower (char *buf, size_t size, const char *addr)
+{
+    size_t i;
+
+    if ('<' == *addr)
+        ++addr;
+
+    for (i = 0; '\0' != addr[i] && '>' != addr[i]; ++i) {
+        if (i+1 == size)
+            return -1;
+        buf[i] = tolower((unsigned char) addr[i]);
+    }
+    buf[i] = '\0';
+
+    return 0;
+}
+
+/* r_is_domain - is pattern domain rule (*@domain)? */
+static int r_is_domain (const char *pat)
+{
+    return '*' == pat[0] && '@' == pat[1] && '\0' != pat[2];
+}
+
+/* r_is_exact - is pattern full mail address (local part and domain)? */
+static int r_is_exact (const char *pat)
+{
+    const char *at = strchr(pat, '@');
+
+    return NULL != at && at != pat && '\0' != at[1] && !r_is_domain(pat);
+}
+
+/* r_is_partial - is pattern partial address (matched as substring)? */
+static int r_is_partial (const char *pat)
+{
+    return !r_is_exact(pat) && !r_is_domain(pat);
+}
+
+/* r_find - find slot of exact address in hash table */
+static struct rule_slot *r_find (const struct rule_index *idx, const char *addr,
+                                 uint32_t h)
+{
+    size_t i, mask = idx->size-1;
+
+    for (i = h & mask; 0 != idx->slots[i].off; i = (i+1) & mask) {
+        if (idx->slots[i].hash == h &&
+            0 == strcmp(idx->strtab + idx->slots[i].off-1, addr))
+            return idx->slots+i;
+    }
+
+    return idx->slots+i;    /* empty slot */
+}
+
+/* r_build_ac - build Aho-Corasick automaton of partial addresses, each *
+ *              state outputs the lowest rule index matching in it       */
+static void r_build_ac (int type, struct rule_index *idx)
+{
+    size_t i, n = rules_count(type), len, max, c, nc, head, tail, s, t;
+    int32_t *fail, *queue;
+    const char *pat;
+    unsigned char ch;
+
+    /* character classes and upper bound of number of states */
+    max = 1;
+    nc = 1;
+    for (i = 0; i < n; ++i) {
+        if (NULL == (pat = rule_pattern(type, i)) || !r_is_partial(pat))
+            continue;
+
+        for (len = 0; '\0' != pat[len]; ++len) {
+            ch = tolower((unsigned char) pat[len]);
+            if (0 == idx->ac_class[ch])
+                idx->ac_class[ch] = nc++;
+        }
+        max += len;
+    }
+    idx->ac_nclass = nc;
+
+    idx->ac_next = Calloc(max * nc, sizeof(int32_t));
+    idx->ac_out = Malloc(max * sizeof(long));
+    idx->ac_out[0] = -1;
+    idx->ac_states = 1;
+
+    /* trie of patterns (transition to root 0 means no edge yet) */
+    for (i = 0; i < n; ++i) {
+        if (NULL == (pat = rule_pattern(type, i)) || !r_is_partial(pat))
+            continue;
+
+        for (s = 0; '\0' != *pat; ++pat) {
+            c = idx->ac_class[(unsigned char) tolower((unsigned char) *pat)];
+            if (0 == idx->ac_next[s*nc + c]) {
+                idx->ac_out[idx->ac_states] = -1;
+                idx->ac_next[s*nc + c] = idx->ac_states++;
+            }
+            s = idx->ac_next[s*nc + c];
+        }
+
+        if (idx->ac_out[s] < 0)
+            idx->ac_out[s] = i;     /* first rule with this pattern wins */
+    }
+
+    /* failure links in breadth-first order, missing transitions are *
+     * replaced with transitions of failure state (complete DFA)     */
+    fail = Calloc(idx->ac_states, sizeof(int32_t));
+    queue = Malloc(idx->ac_states * sizeof(int32_t));
+    head = tail = 0;
+
+    for (c = 0; c < nc; ++c) {
+        if (0 != (t = idx->ac_next[c]))
+            queue[tail++] = t;  /* fail[t] = 0 */
+    }
+
+    while (head < tail) {
+        s = queue[head++];
+        for (c = 0; c < nc; ++c) {
+            t = idx->ac_next[s*nc + c];
+            if (0 != t) {
+                fail[t] = idx->ac_next[fail[s]*nc + c];
+                /* pattern ending here may be suffix of longer one */
+                if (idx->ac_out[fail[t]] >= 0 && (idx->ac_out[t] < 0 ||
+                        idx->ac_out[fail[t]] < idx->ac_out[t]))
+                    idx->ac_out[t] = idx->ac_out[fail[t]];
+                queue[tail++] = t;
+            }
+            else
+                idx->ac_next[s*nc + c] = idx->ac_next[fail[s]*nc + c];
+        }
+    }
+
+    free(fail);
+    free(queue);
+}
+
+/* r_edge_hash - hash of trie edge (parent node and label) */
+static uint32_t r_edge_hash (uint32_t parent, const char *label, size_t len)
+{
+    size_t i;
+    uint32_t h = 2166136261u ^ parent;
+
+    for (i = 0; i < len; ++i) {
+        h ^= (unsigned char) label[i];
+        h *= 16777619u;
+    }
+
+    return h;
+}
+
+/* r_edge - find edge of trie node labeled with 'label' (or empty slot) */
+static struct rule_edge *r_edge (const struct rule_index *idx, uint32_t parent,
+                                 const char *label, size_t len)
+{
+    size_t i, mask = idx->dom_size-1;
+    uint32_t h = r_edge_hash(parent, label, len);
+    const char *l;
+
+    for (i = h & mask; 0 != idx->dom_edges[i].off; i = (i+1) & mask) {
+        l = idx->strtab + idx->dom_edges[i].off-1;
+        if (idx->dom_edges[i].hash == h && idx->dom_edges[i].parent == parent
+            && 0 == strncmp(l, label, len) && '\0' == l[len])
+            return idx->dom_edges+i;
+    }
+
+    return idx->dom_edges+i;    /* empty slot */
+}
+
+/* r_build_domains - build trie of domain rules, labels are inserted from *
+ *                   the last one (i.e. "*@a.example.org": org, example, a) */
+static void r_build_domains (int type, struct rule_index *idx)
+{
+    size_t i, n = rules_count(type), max, len;
+    uint32_t node;
+    const char *pat, *end, *dot;
+    char buf[CONF_MAXLEN];
+    struct rule_edge *e;
+
+    /* upper bound of number of nodes */
+    max = 1;
+    for (i = 0; i < n; ++i) {
+        if (NULL == (pat = rule_pattern(type, i)) || !r_is_domain(pat))
+            continue;
+        for (max += 1, pat += 2; '\0' != *pat; ++pat)
+            max += ('.' == *pat);
+    }
+
+    for (idx->dom_size = 16; idx->dom_size < 2 * max; idx->dom_size *= 2)
+        ;
+    idx->dom_edges = Calloc(idx->dom_size, sizeof(struct rule_edge));
+    idx->dom_rule = Malloc(max * sizeof(long));
+    idx->dom_rule[0] = -1;
+    idx->dom_nodes = 1;
+
+    for (i = 0; i < n; ++i) {
+        if (NULL == (pat = rule_pattern(type, i)) || !r_is_domain(pat))
+            continue;
+        if (0 != r_lower(buf, CONF_MAXLEN, pat+2))
+            continue;   /* can't match any address */
+
+        node = 0;
+        for (end = buf + strlen(buf); end > buf; end = dot) {
+            for (dot = end; dot > buf && '.' != dot[-1]; --dot)
+                ;
+            len = end - dot;
+            if (dot > buf)
+                --dot;  /* skip the dot itself */
+            if (0 == len)
+                continue;
+
+            e = r_edge(idx, node, end-len, len);
+            if (0 == e->off) {
+                memcpy(idx->strtab + idx->strtab_len, end-len, len);
+                idx->strtab[idx->strtab_len + len] = '\0';
+                e->hash = r_edge_hash(node, end-len, len);
+                e->off = idx->strtab_len+1;
+                e->parent = node;
+                e->child = idx->dom_nodes;
+                idx->dom_rule[idx->dom_nodes++] = -1;
+                idx->strtab_len += len+1;
+            }
+            node = e->child;
+        }
+
+        if (node > 0 && idx->dom_rule[node] < 0)
+            idx->dom_rule[node] = i;    /* first rule for the domain wins */
+    }
+}
+
+/* r_build_index - index rules of one type */
+static void r_build_index (int type, struct rule_index *idx)
+{
+    size_t i, n = rules_count(type), no_exact = 0, len;
+    uint32_t h;
+    const char *pat;
+    char buf[CONF_MAXLEN];
+    struct rule_slot *slot;
+
+    bzero(idx, sizeof(struct rule_index));
+
+    /* count exact addresses and size string table */
+    len = 0;
+    for (i = 0; i < n; ++i) {
+        if (NULL != (pat = rule_pattern(type, i)) && r_is_exact(pat)) {
+            ++no_exact;
+            len += strlen(pat)+1;
+        }
+        else if (NULL != pat && r_is_domain(pat))
+            len += strlen(pat)+1;   /* domain labels */
+    }
+
+    /* keep load factor at most 1/2 */
+    for (idx->size = 16; idx->size < 2 * no_exact; idx->size *= 2)
+        ;
+    idx->slots = Calloc(idx->size, sizeof(struct rule_slot));
+    idx->strtab = Malloc(len+1);
+
+    for (i = 0; i < n; ++i) {
+        if (NULL == (pat = rule_pattern(type, i)) || !r_is_exact(pat))
+            continue;
+        if (0 != r_lower(buf, CONF_MAXLEN, pat))
+            continue;   /* can't match any address */
+
+        h = r_hash(buf);
+        slot = r_find(idx, buf, h);
+        if (0 != slot->off)
+            continue;   /* duplicate address, first rule wins */
+
+        strcpy(idx->strtab + idx->strtab_len, buf);
+        slot->hash = h;
+        slot->off = idx->strtab_len+1;
+        slot->rule = i;
+        idx->strtab_len += strlen(buf)+1;
+    }
+
+    r_build_ac(type, idx);
+    r_build_domains(type, idx);
+    idx->strtab[idx->strtab_len] = '\0';   /* (snapshot has it too) */
+}
+
+/* rules_build - build lookup indexes of all loaded rules */
+void rules_build (void)
+{
+    int t;
+
+    for (t = 0; t < RULE_TYPES; ++t)
+        r_build_index(t, conf.rule_idx+t);
+}
+
+/* r_lookup_domain - find rule of the most specific domain of address *
+ *                   (lowercase), returns its index or -1              */
+static long r_lookup_domain (const struct rule_index *idx, const char *addr)
+{
+    long best = -1;
+    uint32_t node = 0;
+    const char *dom, *end, *dot;
+    struct rule_edge *e;
+
+    if (NULL == (dom = strrchr(addr, '@')))
+        return -1;
+    ++dom;
+
+    for (end = dom + strlen(dom); end > dom; end = dot) {
+        for (dot = end; dot > dom && '.' != dot[-1]; --dot)
+            ;
+        e = r_edge(idx, node, dot, end-dot);
+        if (0 == e->off)
+            break;  /* no deeper domain rule */
+
+        node = e->child;
+        if (idx->dom_rule[node] >= 0)
+            best = idx->dom_rule[node];
+
+        if (dot > dom)
+            --dot;  /* skip the dot itself */
+    }
+
+    return best;
+}
+
+/* rules_lookup - find first rule (in rules file order) of given type, *
+ *                which matches address, returns its index or -1;      *
+ *                domain rules are used only if no other rule matches  */
+long rules_lookup (int type, const char *addr)
+{
+    int lower;
+    long best = -1;
+    size_t s, nc;
+    char buf[CONF_MAXLEN];
+    struct rule_slot *slot;
+    const struct rule_index *idx = conf.rule_idx+type;
+
+    if (NULL == idx->slots)
+        return -1;  /* rules_build() was not called */
+
+    if ((lower = (0 == r_lower(buf, CONF_MAXLEN, addr)))) {
+        slot = r_find(idx, buf, r_hash(buf));
+        if (0 != slot->off)
+            best = slot->rule;
+    }
+
+    /* partial addresses, one pass over address */
+    nc = idx->ac_nclass;
+    for (s = 0; '\0' != *addr; ++addr) {
+        s = idx->ac_next[s*nc + idx->ac_class[tolower((unsigned char) *addr)]];
+        if (idx->ac_out[s] >= 0 && (best < 0 || idx->ac_out[s] < best))
+            best = idx->ac_out[s];
+    }
+
+    if (best < 0 && lower)
+        best = r_lookup_domain(idx, buf);
+
+    return best;
+}
+
+/* rules_free - free lookup indexes (and rules snapshot mapping) */
+void rules_free (void)
+{
+    int t;
+
+    for (t = 0; t < RULE_TYPES; ++t) {
+        /* indexes of snapshot point into its mapping */
+        if (NULL == conf.rules_map) {
+            free(conf.rule_idx[t].slots);
+            free(conf.rule_idx[t].strtab);
+            free(conf.rule_idx[t].ac_next);
+            free(conf.rule_idx[t].ac_out);
+            free(conf.rule_idx[t].dom_edges);
+            free(conf.rule_idx[t].dom_rule);
+        }
+        bzero(conf.rule_idx+t, sizeof(struct rule_index));
+    }
+
+    if (NULL != conf.rules_map) {
+        munmap(conf.rules_map, conf.rules_map_size);
+        conf.rules_map = NULL;
+        conf.rules_map_size = 0;
+    }
+}
+
+
+/** Rules snapshot **/
+
+/* struct snap_strtab - deduplicated string table being written */
+struct snap_strtab {
+    char *buf;
+    size_t len, cap;
+    uint32_t *slots;        /* hash table of string offsets + 1 */
+    size_t size;
+};
+
+/* snap_str - add string to string table, returns its offset + 1 *
+ *            (0 for NULL string)                                */
+static uint32_t snap_str (struct snap_strtab *st, const char *str)
+{
+    size_t i, len;
+    uint32_t off, *slots;
+
+    if (NULL == str)
+        return 0;
+
+    /* keep load factor below 1/2 */
+    if (NULL == st->slots || 2 * st->len > st->size) {
+        size_t size = st->size ? 2 * st->size : 1024;
+
+        slots = Calloc(size, sizeof(uint32_t));
+        for (i = 0; i < st->size; ++i) {
+            size_t j;
+
+            if (0 == st->slots[i])
+                continue;
+            j = r_hash(st->buf + st->slots[i]-1) & (size-1);
+            while (0 != slots[j])
+                j = (j+1) & (size-1);
+            slots[j] = st->slots[i];
+        }
+        free(st->slots);
+        st->slots = slots;
+        st->size = size;
+    }
+
+    for (i = r_hash(str) & (st->size-1); 0 != (off = st->slots[i]);
+         i = (i+1) & (st->size-1))
+    {
+        if (0 == strcmp(st->buf + off-1, str))
+            return off;     /* certificates are shared by many rules */
+    }
+
+    len = strlen(str)+1;
+    if (st->len + len > st->cap) {
+        st->cap = 2 * (st->len + len);
+        if (NULL == (st->buf = realloc(st->buf, st->cap)))
+            err_sys("realloc error");
+    }
+    memcpy(st->buf + st->len, str, len);
+    st->slots[i] = st->len+1;
+    st->len += len;
+
+    return st->slots[i];
+}
+
+/* snap_write - write (8-byte aligned) section, returns its offset */
+static uint64_t snap_write (FILE *fp, const void *data, size_t len)
+{
+    long pos = ftell(fp);
+    static const char pad[8];
+
+    if (pos % 8) {
+        fwrite(pad, 1, 8 - pos % 8, fp);
+        pos += 8 - pos % 8;
+    }
+    if (len > 0)
+        fwrite(data, 1, len, fp);
+
+    return pos;
+}
+
+/* rules_snapshot_save - compile loaded rules (with their indexes) into *
+ *                       binary snapshot file, returns 0 on success     */
+int rules_snapshot_save (const char *filename)
+{
+    int t, fd;
+    size_t i, n;
+    char *tmp;
+    FILE *fp;
+    uint32_t *recs;
+    struct snap_hdr hdr;
+    struct snap_strtab st;
+    const struct rule_index *idx;
+
+    bzero(&hdr, sizeof(hdr));
+    bzero(&st, sizeof(st));
+    memcpy(hdr.magic, SNAP_MAGIC, sizeof(hdr.magic));
+    hdr.word = sizeof(long);
+
+    /* snapshot holds key passphrases, only owner may access it */
+    tmp = Malloc(strlen(filename)+5);
+    sprintf(tmp, "%s.tmp", filename);
+    remove(tmp);
+    if ((fd = open(tmp, O_CREAT | O_EXCL | O_WRONLY, 0600)) < 0) {
+        free(tmp);
+        return -1;
+    }
+    if (NULL == (fp = fdopen(fd, "w"))) {
+        close(fd);
+        remove(tmp);
+        free(tmp);
+        return -1;
+    }
+    fwrite(&hdr, sizeof(hdr), 1, fp);   /* rewritten at the end */
+
+    /* rules: string offsets of their fields */
+    for (t = 0; t < RULE_TYPES; ++t) {
+        n = rules_count(t);
+        recs = Calloc(n+1, SNAP_FIELDS * sizeof(uint32_t));
+
+        for (i = 0; i < n; ++i) {
+            uint32_t *f = recs + i*SNAP_FIELDS;
+
+            switch (t) {
+                case RULE_ENCR:
+                    f[0] = snap_str(&st, conf.encr_rules[i].rcpt);
+                    f[1] = snap_str(&st, conf.encr_rules[i].cert_path);
+                    break;
+                case RULE_SIGN:
+                    f[0] = snap_str(&st, conf.sign_rules[i].sndr);
+                    f[1] = snap_str(&st, conf.sign_rules[i].cert_path);
+                    f[2] = snap_str(&st, conf.sign_rules[i].key_path);
+                    f[3] = snap_str(&st, conf.sign_rules[i].key_pass);
+                    break;
+                case RULE_DECR:
+                    f[0] = snap_str(&st, conf.decr_rules[i].rcpt);
+                    f[1] = snap_str(&st, conf.decr_rules[i].cert_path);
+                    f[2] = snap_str(&st, conf.decr_rules[i].key_path);
+                    f[3] = snap_str(&st, conf.decr_rules[i].key_pass);
+                    break;
+                case RULE_VRFY:
+                    f[0] = snap_str(&st, conf.vrfy_rules[i].sndr);
+                    f[1] = snap_str(&st, conf.vrfy_rules[i].cert_path);
+                    f[2] = snap_str(&st, conf.vrfy_rules[i].cacert_path);
+                    break;
+            }
+        }
+
+        hdr.nrules[t] = n;
+        hdr.rules[t] = snap_write(fp, recs, n * SNAP_FIELDS * sizeof(uint32_t));
+        free(recs);
+    }
+
+    hdr.strtab = snap_write(fp, st.buf, st.len);
+    hdr.strtab_len = st.len;
+    free(st.buf);
+    free(st.slots);
+
+    /* prebuilt indexes */
+    for (t = 0; t < RULE_TYPES; ++t) {
+        struct snap_index *si = hdr.idx+t;
+
+        idx = conf.rule_idx+t;
+        memcpy(si->ac_class, idx->ac_class, sizeof(si->ac_class));
+
+        si->size = idx->size;
+        si->slots = snap_write(fp, idx->slots,
+                               idx->size * sizeof(struct rule_slot));
+        si->strtab_len = idx->strtab_len;
+        si->strtab = snap_write(fp, idx->strtab, idx->strtab_len+1);
+
+        si->ac_nclass = idx->ac_nclass;
+        si->ac_states = idx->ac_states;
+        si->ac_next = snap_write(fp, idx->ac_next,
+                         idx->ac_states * idx->ac_nclass * sizeof(int32_t));
+        si->ac_out = snap_write(fp, idx->ac_out, idx->ac_states * sizeof(long));
+
+        si->dom_size = idx->dom_size;
+        si->dom_nodes = idx->dom_nodes;
+        si->dom_edges = snap_write(fp, idx->dom_edges,
+                                   idx->dom_size * sizeof(struct rule_edge));
+        si->dom_rule = snap_write(fp, idx->dom_rule,
+                                  idx->dom_nodes * sizeof(long));
+    }
+
+    hdr.size = snap_write(fp, NULL, 0);
+    rewind(fp);
+    fwrite(&hdr, sizeof(hdr), 1, fp);
+
+    n = ferror(fp);
+    if (0 != fclose(fp) || 0 != n || 0 != rename(tmp, filename)) {
+        remove(tmp);
+        free(tmp);
+        return -1;
+    }
+    free(tmp);
+
+    return 0;
+}
+
+/* snap_ptr - get pointer to section of mapped snapshot, NULL if it *
+ *            doesn't fit in the snapshot                           */
+static void *snap_ptr (char *map, const struct snap_hdr *hdr, uint64_t off,
+                       uint64_t len)
+{
+    if (off > hdr->size || len > hdr->size - off)
+        return NULL;
+
+    return map + off;
+}
+
+/* snap_array - get pointer to array of 'n' elements of 'size' bytes in *
+ *              mapped snapshot, NULL if it doesn't fit in the snapshot  */
+static void *snap_array (char *map, const struct snap_hdr *hdr, uint64_t off,
+                         uint64_t n, uint64_t size)
+{
+    if (0 == size || n > hdr->size / size)
+        return NULL;    /* (also prevents overflow of n*size) */
+
+    return snap_ptr(map, hdr, off, n * size);
+}
+
+/* snap_check_counts - check sizes of index arrays before they are mapped, *
+ *                     returns 0 if they are valid                          */
+static int snap_check_counts (const struct snap_index *si,
+                              const struct snap_hdr *hdr)
+{
+    /* hash tables are masked with size-1 */
+    if (0 == si->size || 0 != (si->size & (si->size-1)) ||
+        0 == si->dom_size || 0 != (si->dom_size & (si->dom_size-1)))
+        return -1;
+
+    /* (byte classes are unsigned char) */
+    if (0 == si->ac_nclass || si->ac_nclass > 256 || 0 == si->ac_states ||
+        0 == si->dom_nodes || si->strtab_len >= hdr->size)
+        return -1;
+
+    return 0;
+}
+
+/* snap_check_index - check that mapped index of rules of one type refers *
+ *                    only to its own arrays and to existing rules (there  *
+ *                    are 'nrules' of them), returns 0 if it is valid      */
+static int snap_check_index (const struct rule_index *idx, uint64_t nrules)
+{
+    size_t i, used;
+
+    if (idx->strtab_len > 0 && '\0' != idx->strtab[idx->strtab_len-1])
+        return -1;
+
+    for (i = used = 0; i < idx->size; ++i) {
+        if (0 == idx->slots[i].off)
+            continue;
+        if (idx->slots[i].off-1 >= idx->strtab_len ||
+            idx->slots[i].rule >= nrules)
+            return -1;
+        ++used;
+    }
+    if (used == idx->size)
+        return -1;      /* (hash table needs an empty slot) */
+
+    /* Aho-Corasick automaton */
+    for (i = 0; i < 256; ++i) {
+        if (idx->ac_class[i] >= idx->ac_nclass)
+            return -1;
+    }
+    for (i = 0; i < idx->ac_states * idx->ac_nclass; ++i) {
+        if (idx->ac_next[i] < 0 || (size_t) idx->ac_next[i] >= idx->ac_states)
+            return -1;
+    }
+    for (i = 0; i < idx->ac_states; ++i) {
+        if (idx->ac_out[i] < -1 || (idx->ac_out[i] >= 0 &&
+                                    (uint64_t) idx->ac_out[i] >= nrules))
+            return -1;
+    }
+
+    /* domain trie */
+    for (i = used = 0; i < idx->dom_size; ++i) {
+        if (0 == idx->dom_edges[i].off)
+            continue;
+        if (idx->dom_edges[i].off-1 >= idx->strtab_len ||
+            idx->dom_edges[i].parent >= idx->dom_nodes ||
+            idx->dom_edges[i].child >= idx->dom_nodes)
+            return -1;
+        ++used;
+    }
+    if (used == idx->dom_size)
+        return -1;
+    for (i = 0; i < idx->dom_nodes; ++i) {
+        if (idx->dom_rule[i] < -1 || (idx->dom_rule[i] >= 0 &&
+                                      (uint64_t) idx->dom_rule[i] >= nrules))
+            return -1;
+    }
+
+    return 0;
+}
+
+/* snap_field - get string field of rule from snapshot string table */
+static char *snap_field (char *strtab, const uint32_t *f, int i)
+{
+    return (0 == f[i]) ? NULL : strtab + f[i]-1;
+}
+
+/* rules_snapshot_load - map binary rules snapshot (read-only, shared by *
+ *                       all processes), returns 0 on success, 1 if file *
+ *                       is not a snapshot and -1 on error               */
+int rules_snapshot_load (const char *filename)
+{
+    int fd, t;
+    size_t i;
+    char *map, *strtab;
+    uint32_t *recs, *f;
+    struct stat st;
+    struct snap_hdr hdr;
+    struct rule_index *idx;
+
+    if ((fd = open(filename, O_RDONLY)) < 0)
+        return 1;   /* reported by rules file parser */
+
+    if ((ssize_t) sizeof(hdr) != read(fd, &hdr, sizeof(hdr)) ||
+        0 != memcmp(hdr.magic, SNAP_MAGIC, sizeof(hdr.magic)))
+    {
+        close(fd);
+        return 1;   /* plain rules file */
+    }
+
+    if (fstat(fd, &st) < 0 || (uint64_t) st.st_size != hdr.size ||
+        sizeof(long) != hdr.word)
+    {
+        close(fd);
+        return -1;  /* truncated or compiled on different architecture */
+    }
+
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (MAP_FAILED == map)
+        return -1;
+
+    strtab = snap_ptr(map, &hdr, hdr.strtab, hdr.strtab_len);
+    if (NULL == strtab || (hdr.strtab_len > 0 &&
+                           '\0' != strtab[hdr.strtab_len-1]))
+        goto bad_snapshot;
+
+    /* rules: check string offsets */
+    for (t = 0; t < RULE_TYPES; ++t) {
+        recs = snap_ptr(map, &hdr, hdr.rules[t],
+                        (uint64_t) hdr.nrules[t] * SNAP_FIELDS * sizeof(uint32_t));
+        if (NULL == recs)
+            goto bad_snapshot;
+        for (i = 0; i < hdr.nrules[t] * SNAP_FIELDS; ++i) {
+            if (recs[i] > hdr.strtab_len)
+                goto bad_snapshot;
+        }
+    }
+
+    /* indexes are used in place (after they are checked) */
+    for (t = 0; t < RULE_TYPES; ++t) {
+        struct snap_index *si = hdr.idx+t;
+
+        idx = conf.rule_idx+t;
+        if (0 != snap_check_counts(si, &hdr)) {
+            bzero(conf.rule_idx, sizeof(conf.rule_idx));
+            goto bad_snapshot;
+        }
+
+        memcpy(idx->ac_class, si->ac_class, sizeof(idx->ac_class));
+        idx->size = si->size;
+        idx->slots = snap_array(map, &hdr, si->slots, si->size,
+                                sizeof(struct rule_slot));
+        idx->strtab_len = si->strtab_len;
+        idx->strtab = snap_ptr(map, &hdr, si->strtab, si->strtab_len+1);
+        idx->ac_nclass = si->ac_nclass;
+        idx->ac_states = si->ac_states;
+        idx->ac_next = snap_array(map, &hdr, si->ac_next, si->ac_states,
+                                  si->ac_nclass * sizeof(int32_t));
+        idx->ac_out = snap_array(map, &hdr, si->ac_out, si->ac_states,
+                                 sizeof(long));
+        idx->dom_size = si->dom_size;
+        idx->dom_nodes = si->dom_nodes;
+        idx->dom_edges = snap_array(map, &hdr, si->dom_edges, si->dom_size,
+                                    sizeof(struct rule_edge));
+        idx->dom_rule = snap_array(map, &hdr, si->dom_rule, si->dom_nodes,
+                                   sizeof(long));
+
+        if (NULL == idx->slots || NULL == idx->strtab || NULL == idx->ac_next
+            || NULL == idx->ac_out || NULL == idx->dom_edges
+            || NULL == idx->dom_rule || 0 != snap_check_index(idx, hdr.nrules[t]))
+        {
+            bzero(conf.rule_idx, sizeof(conf.rule_idx));
+            goto bad_snapshot;
+        }
+    }
+
+    /* rules: point their strings into string table */
+    conf.encr_rules_size = hdr.nrules[RULE_ENCR];
+    conf.sign_rules_size = hdr.nrules[RULE_SIGN];
+    conf.decr_rules_size = hdr.nrules[RULE_DECR];
+    conf.vrfy_rules_size = hdr.nrules[RULE_VRFY];
+    conf.encr_rules = Calloc(conf.encr_rules_size, sizeof(struct encr_rule));
+    conf.sign_rules = Calloc(conf.sign_rules_size, sizeof(struct sign_rule));
+    conf.decr_rules = Calloc(conf.decr_rules_size, sizeof(struct decr_rule));
+    conf.vrfy_rules = Calloc(conf.vrfy_rules_size, sizeof(struct vrfy_rule));
+
+    for (i = 0; i < conf.encr_rules_size; ++i) {
+        f = (uint32_t *) (map + hdr.rules[RULE_ENCR]) + i*SNAP_FIELDS;
+        conf.encr_rules[i].rcpt = snap_field(strtab, f, 0);
+        conf.encr_rules[i].cert_path = snap_field(strtab, f, 1);
+    }
+    for (i = 0; i < conf.sign_rules_size; ++i) {
+        f = (uint32_t *) (map + hdr.rules[RULE_SIGN]) + i*SNAP_FIELDS;
+        conf.sign_rules[i].sndr = snap_field(strtab, f, 0);
+        conf.sign_rules[i].cert_path = snap_field(strtab, f, 1);
+        conf.sign_rules[i].key_path = snap_field(strtab, f, 2);
+        conf.sign_rules[i].key_pass = snap_field(strtab, f, 3);
+    }
+    for (i = 0; i < conf.decr_rules_size; ++i) {
+        f = (uint32_t *) (map + hdr.rules[RULE_DECR]) + i*SNAP_FIELDS;
+        conf.decr_rules[i].rcpt = snap_field(strtab, f, 0);
+        conf.decr_rules[i].cert_path = snap_field(strtab, f, 1);
+        conf.decr_rules[i].key_path = snap_field(strtab, f, 2);
+        conf.decr_rules[i].key_pass = snap_field(strtab, f, 3);
+    }
+    for (i = 0; i < conf.vrfy_rules_size; ++i) {
+        f = (uint32_t *) (map + hdr.rules[RULE_VRFY]) + i*SNAP_FIELDS;
+        conf.vrfy_rules[i].sndr = snap_field(strtab, f, 0);
+        conf.vrfy_rules[i].cert_path = snap_field(strtab, f, 1);
+        conf.vrfy_rules[i].cacert_path = snap_field(strtab, f, 2);
+    }
+
+    conf.rules_map = map;
+    conf.rules_map_size = st.st_size;
+
+    return 0;
+
+bad_snapshot:
+    munmap(map, st.st_size);
+    return -1;
+}
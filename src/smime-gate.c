@@ -4,44 +4,156 @@
  * Author:      Tomasz Pieczerak (tphaster)
  */
 
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
 #include <unistd.h>
 #include <time.h>
+#include <sys/mman.h>
 #include <sys/types.h>
 #include <sys/prctl.h>
-#define _GNU_SOURCE
+#include <sys/wait.h>
+#include <dirent.h>
 #include <libgen.h>
 
+#include "arena.h"
 #include "config.h"
+#include "durable.h"
+#include "probes.h"
+#include "queue.h"
+#include "rules.h"
 #include "smtp.h"
+#include "smtp-lib.h"
+#include "stats.h"
 #include "system.h"
+#include "trace.h"
+
+/* Working directory file suffixes */
+#define PRCS_SUFFIX     ".prcs"     /* partially written result */
+#define RDY_SUFFIX      ".rdy"      /* processed mail object */
+
+/* maximum path of any file found in working directory */
+#define RCV_PATHLEN     (sizeof(DEFAULT_UNSENT_DIR "/" RDY_SUFFIX) + 256)
+
+/* sign streams (memfd and smime-tool each) of session at once, further *
+ * mails are signed after receipt                                       */
+#define MAX_STREAMS     8
+
+
+/** Typedefs **/
+
+/* struct sign_stream - signing started while mail data are received */
+struct sign_stream {
+    pid_t pid;          /* smime-tool process */
+    int in;             /* its input (-1 when closed) */
+    int out;            /* its output (memfd) */
+    int failed;         /* some data weren't passed to smime-tool */
+    int end;            /* all data were passed */
+};
+
+/* struct mail_times - way of mail object through the gateway (slow log) */
+struct mail_times {
+    uint64_t start;             /* MAIL command accepted (see stats_now()) */
+    uint64_t usec[STAGES];      /* time spent in pipeline stages */
+    size_t size;                /* received data size */
+    size_t no_rcpt;             /* number of recipients */
+    long rules[RULE_TYPES];     /* matched rules (-1: none) */
+};
+
+/* struct pipe_msg - mail object handed over to forwarder (pipelined mode), *
+ *                   descriptors are passed along with it (mail first)     */
+struct pipe_msg {
+    char fn[FNMAXLEN];          /* spooled file (message identifier) */
+    int rules_set;              /* processing rules resolved during receipt */
+    long rules[RULE_TYPES];
+    int has_mail;               /* mail object is passed in memfd (log spool) */
+    int has_signed;             /* memfd with mail signed during receipt */
+    struct mail_times times;    /* stages of receipt */
+};
+
+/* struct recovery - mails to be recovered after crash */
+struct recovery {
+    char **ids;         /* file names (message identifiers for log spool) */
+    uint32_t *segs;     /* location of mail in log spool */
+    size_t *offs;
+    size_t n;           /* number of mails */
+    size_t size;        /* arrays size */
+};
+
+
+/** Local variables **/
+static struct arena session_arena;  /* mail objects of client session */
+static const char *recv_fn;         /* file of mail object being received */
+static struct mail_times *recv_times;   /* and its stages (or NULL) */
+static int sign_streams;            /* sign streams not finished yet */
+static int stream_skip;             /* data of mail aren't streamed */
+
 
 /** Local functions **/
-static char *generate_filename (unsigned int nr);
-int smime_process_mails (struct mail_object **mails, char **fns, int no_mails);
-char *strcasestr(const char *haystack, const char *needle);
+static char *generate_filename (void);
+static int recv_mail (int sockfd, struct mail_object *mail, char *filename,
+                      int srv, struct mail_times *times);
+static void mail_delivered (struct mail_object *mail, char *fn);
+static void mail_unsent (struct mail_object *mail, char *fn);
+static void slow_log (struct mail_times *times, const char *fn, int unsent);
+static void forward_mails (struct mail_object **mails, char **fns,
+                           struct mail_times *times, int no_mails);
+static void pipelined_service (int sockfd);
+int smime_process_mails (struct mail_object **mails, char **fns,
+                         struct mail_times *times, int no_mails);
 
 
 /* smime_gate_service - receive mails from client, process them and *
  *                      send to mail server <forward-path>          */
 void smime_gate_service (int sockfd)
 {
-    int i, srvfd;
     int srv = SMTP_SRV_NEW;
     int no_mails = 0;       /* number of mails */
-    char **fns = Calloc(MAILBUF, sizeof(char *));
+    int size = MAILBUF;     /* size of mail arrays */
+    char **fns, **temp_fns;
     char *filename;
-    char *unsent = Malloc(FNMAXLEN);
-    struct mail_object **mails = Calloc(MAILBUF, sizeof(struct mail_object *));
-    struct mail_object *mail = Malloc(sizeof(struct mail_object));
+    struct mail_object **mails, **temp_mails;
+    struct mail_object *mail;
+    struct mail_times *times, *temp_times;
+    struct mail_times spare_times;  /* for mail refused when arrays are full */
+    struct sockaddr_in cliaddr;
+    socklen_t len = sizeof(cliaddr);
+    char addr[INET_ADDRSTRLEN] = "?";
+
+    /* smime-tool processes of this session are waited for explicitly */
+    Signal(SIGCHLD, SIG_DFL);
+    PROBE1(session__start, sockfd);
 
-    if (NULL == (filename = generate_filename(no_mails)))
+    bzero(&cliaddr, sizeof(cliaddr));
+    if (0 == getpeername(sockfd, (SA *) &cliaddr, &len))
+        inet_ntop(AF_INET, &(cliaddr.sin_addr), addr, sizeof(addr));
+    trace_event("accept", NULL, "\"client\":\"%s:%d\"", addr,
+                ntohs(cliaddr.sin_port));
+
+    /* mail objects, their envelopes and filenames live in session arena */
+    arena_init(&session_arena);
+    smtp_arena = &session_arena;
+    smtp_rcpt_dedup = conf.rcpt_dedup;
+
+    if (conf.pipelined) {
+        pipelined_service(sockfd);
+        goto end_session;
+    }
+
+    fns = Calloc(size, sizeof(char *));
+    mails = Calloc(size, sizeof(struct mail_object *));
+    times = Calloc(size, sizeof(struct mail_times));
+
+    mail = arena_alloc(&session_arena, sizeof(struct mail_object));
+    if (NULL == mail || NULL == (filename = generate_filename()))
         err_sys("malloc error");
 
     /* receive mail objects from client */
-    while (0 == smtp_recv_mail(sockfd, mail, filename, srv)) {
+    while (0 == recv_mail(sockfd, mail, filename, srv,
+                          (no_mails < size) ? times+no_mails : &spare_times)) {
         mails[no_mails] = mail;
         fns[no_mails] = filename;
         ++no_mails;
@@ -49,28 +161,41 @@ void smime_gate_service (int sockfd)
         printf(DPREF "received mail, saved in %s\n", filename);
 #endif
 
-        if (NULL == (filename = generate_filename(no_mails))) {
+        /* make room for next mail */
+        if (no_mails == size) {
+            temp_fns = realloc(fns, 2 * size * sizeof(char *));
+            if (NULL != temp_fns)
+                fns = temp_fns;
+            temp_mails = realloc(mails, 2 * size * sizeof(struct mail_object *));
+            if (NULL != temp_mails)
+                mails = temp_mails;
+            temp_times = realloc(times, 2 * size * sizeof(struct mail_times));
+            if (NULL != temp_times)
+                times = temp_times;
+
+            if (NULL != temp_fns && NULL != temp_mails && NULL != temp_times)
+                size *= 2;
+        }
+
+        if (NULL == (filename = generate_filename())) {
             srv = SMTP_SRV_ERR;
             filename = NULL;
             mail = NULL;
             continue;
         }
 
-        if (NULL == (mail = malloc(sizeof(struct mail_object)))) {
+        mail = arena_alloc(&session_arena, sizeof(struct mail_object));
+        if (NULL == mail) {
             srv = SMTP_SRV_ERR;
-            free(filename);
             filename = NULL;
-            mail = NULL;
             continue;
         }
 
-        if (MAILBUF == no_mails)
-            srv = SMTP_SRV_ERR;
+        if (size == no_mails)
+            srv = SMTP_SRV_ERR;     /* no memory for more mails */
         else
             srv = SMTP_SRV_NXT;
     }
-    free(filename);
-    free(mail);
     filename = NULL;
     mail = NULL;
 
@@ -80,25 +205,91 @@ void smime_gate_service (int sockfd)
 #ifdef DEBUG
         printf(DPREF "processing %d mails\n", no_mails);
 #endif
-    smime_process_mails(mails, fns, no_mails);
+    smime_process_mails(mails, fns, times, no_mails);
+    forward_mails(mails, fns, times, no_mails);
+
+end_service:
+    free(mails);
+    free(fns);
+    free(times);
+
+end_session:
+    PROBE0(session__end);
+    stats_count(CNT_CLOSED, 1);
+    smtp_arena = NULL;
+    arena_free(&session_arena);
+    free_config();
+}
+
+/* recv_mail - receive mail object from client, time of successful *
+ *             receipt is recorded (see smtp_recv_mail()), stages  *
+ *             of the mail are started in 'times'                  */
+static int recv_mail (int sockfd, struct mail_object *mail, char *filename,
+                      int srv, struct mail_times *times)
+{
+    int ret;
+    uint64_t t = stats_now();
+
+    /* for envelope events and stages (smime_envelope()) */
+    recv_fn = filename;
+    recv_times = times;
+    bzero(times, sizeof(struct mail_times));
+    times->start = t;
+    memset(times->rules, -1, sizeof(times->rules));
+    stats_stages = times->usec;
+
+    ret = smtp_recv_mail(sockfd, mail, filename, srv);
+    stats_stages = NULL;
+    recv_times = NULL;
+
+    if (0 == ret) {
+        stats_record(STAGE_RECV, stats_now() - t);
+        stats_count(CNT_RECEIVED, 1);
+        stats_count(CNT_BYTES_IN, mail->data_size);
+
+        /* receipt of mail itself (not waiting for the client) */
+        times->usec[STAGE_RECV] = stats_now() - times->start;
+        times->size = mail->data_size;
+        times->no_rcpt = mail->no_rcpt;
+    }
+
+    return ret;
+}
+
+/* forward_mails - send processed mail objects to mail server, undelivered *
+ *                 ones are kept for unsent service (mail objects are     *
+ *                 freed, their structures and filenames are left to      *
+ *                 the caller), 'times' of mails may be NULL              */
+static void forward_mails (struct mail_object **mails, char **fns,
+                           struct mail_times *times, int no_mails)
+{
+    int i, srvfd, srv, ret;
+    uint64_t t;
 
-    /* forward all received mail objects */
     srvfd = Socket(AF_INET, SOCK_STREAM, 0);
+    t = stats_now();
     if (connect(srvfd, (SA *) &(conf.mail_srv), sizeof(conf.mail_srv)) < 0) {
         /* mails cannot be sent now, move it to unsent directory */
 #ifdef DEBUG
         printf(DPREF "cannot forward mails to server (connection error)\n");
 #endif
         for (i = 0; i < no_mails; ++i) {
-            snprintf(unsent, FNMAXLEN, DEFAULT_UNSENT_DIR "/%s", basename(fns[i]));
-            rename(fns[i], unsent);
+            mail_unsent(mails[i], fns[i]);
+            if (NULL != times)
+                slow_log(times+i, fns[i], 1);
 
             free_mail_object(mails[i]);
-            free(mails[i]);
-            free(fns[i]);
         }
-        err_sys("connect error");
+        close(srvfd);
+        err_ret("connect error");
+        return;
     }
+    t = stats_now() - t;
+    stats_record(STAGE_CONNECT, t);
+
+    /* connection is shared by all mails */
+    for (i = 0; NULL != times && i < no_mails; ++i)
+        times[i].usec[STAGE_CONNECT] += t;
 
     if (1 == no_mails)
         srv = SMTP_CLI_NEW | SMTP_CLI_LST;
@@ -106,215 +297,1169 @@ void smime_gate_service (int sockfd)
         srv = SMTP_CLI_NEW | SMTP_CLI_CON;
 
     for (i = 0; i < no_mails; ++i) {
-        if (0 == smtp_send_mail(srvfd, mails[i], srv)) {
+        PROBE1(send__start, mails[i]->data_size);
+        t = stats_now();
+        ret = smtp_send_mail(srvfd, mails[i], srv);
+        t = stats_now() - t;
+        PROBE1(send__done, ret);
+        stats_record(STAGE_SEND, t);
+        trace_event("forward", fns[i], "\"ok\":%s,\"usec\":%llu",
+                    0 == ret ? "true" : "false", (unsigned long long) t);
+
+        if (0 == ret) {
 #ifdef DEBUG
             printf(DPREF "sent mail %s to server %s\n", fns[i], inet_ntoa(conf.mail_srv.sin_addr));
 #endif
-            remove(fns[i]);
+            mail_delivered(mails[i], fns[i]);
         }
-        else {  /* mail cannot be sent now, move it to unsent directory */
-            snprintf(unsent, FNMAXLEN, DEFAULT_UNSENT_DIR "/%s", basename(fns[i]));
-            rename(fns[i], unsent);
+        else    /* mail cannot be sent now, move it to unsent directory */
+            mail_unsent(mails[i], fns[i]);
+
+        if (NULL != times) {
+            times[i].usec[STAGE_SEND] += t;
+            slow_log(times+i, fns[i], 0 != ret);
         }
 
         free_mail_object(mails[i]);
-        free(mails[i]);
-        free(fns[i]);
 
         if (no_mails-2 == i)
             srv = SMTP_CLI_NXT | SMTP_CLI_LST;
         else
             srv = SMTP_CLI_NXT | SMTP_CLI_CON;
     }
-
-end_service:
-    free(unsent);
-    free(mails);
-    free(fns);
-    free_config();
 }
 
-/* generate_filename - generate unique filename for mail, returns allocated *
- *                     pointer (behaves like malloc())                      */
-static char *generate_filename (unsigned int nr)
+/* generate_filename - generate filename for mail, named by its unique *
+ *                     identifier (see trace_id()), it is allocated from *
+ *                     session arena (NULL if there is no memory)        */
+static char *generate_filename (void)
 {
-    char *fn = malloc(FNMAXLEN);
-    unsigned int t, p;
+    char *fn = arena_alloc(&session_arena, FNMAXLEN);
+    char id[TRACE_IDLEN];
 
     if (NULL != fn) {
-        t = time(NULL);
-        p = getpid();
-
-        snprintf(fn, FNMAXLEN, DEFAULT_WORKING_DIR "/mail%d_%d-%d", t, p, nr);
+        trace_id(id);
+        snprintf(fn, FNMAXLEN, DEFAULT_WORKING_DIR "/" TRACE_PREFIX "%s", id);
     }
 
     return fn;
 }
 
-/* smime_process_mails - process mail objects, according to rules in config */
-int smime_process_mails (struct mail_object **mails, char **fns, int no_mails)
+/* mail_delivered - drop spooled mail object, it was sent to mail server */
+static void mail_delivered (struct mail_object *mail, char *fn)
+{
+    stats_count(CNT_FORWARDED, 1);
+    stats_count(CNT_BYTES_OUT, mail->data_size);
+    trace_event("deliver", fn, "\"by\":\"session\"");
+
+    if (SPOOL_LOG == conf.spool)
+        queue_append(QREC_ACK, basename(fn), NULL);
+    else
+        remove(fn);
+}
+
+/* mail_unsent - keep processed mail object for unsent service */
+static void mail_unsent (struct mail_object *mail, char *fn)
+{
+    char unsent[FNMAXLEN];
+
+    stats_count(CNT_UNSENT, 1);
+    trace_event("requeue", fn, NULL);
+
+    if (SPOOL_LOG == conf.spool) {
+        if (0 != queue_append(QREC_DONE, basename(fn), mail))
+            err_msg("cannot requeue mail %s", basename(fn));
+    }
+    else {
+        snprintf(unsent, FNMAXLEN, DEFAULT_UNSENT_DIR "/%s", basename(fn));
+        rename(fn, unsent);
+    }
+}
+
+/* slow_log - log mail object, which was forwarded (or left for unsent *
+ *            service) later than 'slow_log' milliseconds after its    *
+ *            MAIL command, with its stages and matched rules          */
+static void slow_log (struct mail_times *times, const char *fn, int unsent)
+{
+    int i, n;
+    uint64_t total;
+    char id[TRACE_IDLEN], stages[STAGES*24], rules[MAXLINE/2];
+    const char *addr;
+
+    if (0 == conf.slow_log)
+        return;
+    total = stats_now() - times->start;
+    if (total < (uint64_t) conf.slow_log * 1000)
+        return;
+
+    for (i = n = 0; i < STAGES; ++i) {
+        if (times->usec[i] > 0)
+            n += snprintf(stages+n, sizeof(stages)-n, "%s %s %.1f",
+                          n > 0 ? "," : "", stats_stage_name(i),
+                          times->usec[i] / 1000.0);
+    }
+    if (0 == n)
+        strcpy(stages, " none");
+
+    for (i = n = 0; i < RULE_TYPES && n < (int) sizeof(rules); ++i) {
+        if (times->rules[i] < 0)
+            continue;
+        else if (RULE_ENCR == i)
+            addr = conf.encr_rules[times->rules[i]].rcpt;
+        else if (RULE_SIGN == i)
+            addr = conf.sign_rules[times->rules[i]].sndr;
+        else if (RULE_DECR == i)
+            addr = conf.decr_rules[times->rules[i]].rcpt;
+        else
+            addr = conf.vrfy_rules[times->rules[i]].sndr;
+
+        n += snprintf(rules+n, sizeof(rules)-n, "%s %s %s", n > 0 ? "," : "",
+                      stats_stage_name(STAGE_CRYPTO(i)), addr);
+    }
+    if (0 == n)
+        strcpy(rules, " none");
+
+    trace_fn_id(fn, id);
+    err_msg("slow mail %s: %.1f ms (stages in ms:%s), %zu bytes, %zu rcpts, "
+            "%s, rules:%s", id, total / 1000.0, stages, times->size,
+            times->no_rcpt, unsent ? "left for unsent service" : "forwarded",
+            rules);
+}
+
+/* mail_memfd - write mail object (in mail file format) to new memfd, *
+ *              returns its descriptor or -1 on failure                */
+static int mail_memfd (struct mail_object *mail)
+{
+    int fd;
+    size_t i;
+
+    if ((fd = memfd_create("smime-gate", MFD_CLOEXEC)) < 0)
+        return -1;
+
+    dprintf(fd, "%s\n%u\n", mail->mail_from, (unsigned int) mail->no_rcpt);
+    for (i = 0; i < mail->no_rcpt; ++i)
+        dprintf(fd, "%s\n", mail->rcpt_to[i]);
+
+    if (writen(fd, mail->data, mail->data_size) != (ssize_t) mail->data_size) {
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+/* smime_exec - start smime-tool (without shell) reading from 'infd' and *
+ *              writing to 'outfd', returns its pid or -1 on failure     */
+static pid_t smime_exec (char *const argv[], int infd, int outfd,
+                         const sigset_t *mask)
+{
+    pid_t pid;
+
+    if ((pid = fork()) == 0) {
+        sigprocmask(SIG_SETMASK, mask, NULL);
+        dup2(infd, STDIN_FILENO);
+        dup2(outfd, STDOUT_FILENO);
+        execvp("smime-tool", argv);
+        _exit(127);
+    }
+
+    return pid;
+}
+
+/* smime_tool - run smime-tool on mail object read from 'infd', returns *
+ *              memfd with result or -1 on failure                      */
+static int smime_tool (char *const argv[], int infd)
+{
+    int outfd, status = -1;
+    pid_t pid;
+    sigset_t mask, chld_mask;
+
+    if ((outfd = memfd_create("smime-gate", MFD_CLOEXEC)) < 0)
+        return -1;
+    lseek(infd, 0, SEEK_SET);
+
+    /* don't let sig_chld() reap smime-tool before us */
+    sigemptyset(&chld_mask);
+    sigaddset(&chld_mask, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &chld_mask, &mask);
+
+    if ((pid = smime_exec(argv, infd, outfd, &mask)) > 0) {
+        while (waitpid(pid, &status, 0) < 0 && EINTR == errno)
+            ;
+    }
+
+    sigprocmask(SIG_SETMASK, &mask, NULL);
+
+    if (pid < 0 || !WIFEXITED(status) || 0 != WEXITSTATUS(status)) {
+        close(outfd);
+        return -1;
+    }
+
+    return outfd;
+}
+
+/* smime_result - replace mail object with result of smime-tool in memfd *
+ *                'outfd', which becomes 'cur', returns 0 on success     */
+static int smime_result (struct mail_object *mail, int *cur, int outfd)
+{
+    struct mail_object res;
+
+    if (outfd < 0)
+        return -1;
+
+    if (0 != map_mail_from_fd(outfd, &res)) {
+        close(outfd);
+        return -1;
+    }
+
+    free_mail_object(mail);
+    *mail = res;
+    if (*cur >= 0)
+        close(*cur);
+    *cur = outfd;
+
+    return 0;
+}
+
+/* smime_step - process mail object with smime-tool, intermediate results  *
+ *              are kept in memfd 'cur' (-1 before first step), on success *
+ *              mail object is replaced with result, returns 0 on success  */
+static int smime_step (struct mail_object *mail, char *fn, int *cur,
+                       char *const argv[])
+{
+    int infd, outfd;
+
+    /* first step reads spooled file, next ones result of previous step */
+    if (*cur >= 0)
+        infd = *cur;
+    else if (SPOOL_DIR == conf.spool)
+        infd = open(fn, O_RDONLY);
+    else
+        infd = mail_memfd(mail);
+
+    if (infd < 0)
+        return -1;
+
+    outfd = smime_tool(argv, infd);
+    if (infd != *cur)
+        close(infd);
+
+    return smime_result(mail, cur, outfd);
+}
+
+/* smime_store - mark mail object as processed: spooled file is replaced *
+ *               with its '.rdy' version, containing result of all steps *
+ *               (it is written only once), 'fn' is updated              */
+static void smime_store (struct mail_object *mail, char *fn, int cur)
+{
+    int fd;
+    char prcs[FNMAXLEN], rdy[FNMAXLEN];
+
+    /* log spool keeps processed mail in memory until it is delivered */
+    if (SPOOL_LOG == conf.spool)
+        return;
+
+    if (snprintf(rdy, FNMAXLEN, "%s" RDY_SUFFIX, fn) >= FNMAXLEN)
+        return;
+
+    /* nothing was done to mail object, only mark it */
+    if (cur < 0) {
+        if (0 == rename(fn, rdy))
+            strcpy(fn, rdy);
+        return;
+    }
+
+    snprintf(prcs, FNMAXLEN, "%s" PRCS_SUFFIX, fn);
+    if ((fd = open(prcs, O_WRONLY | O_CREAT | O_TRUNC, 0600)) < 0)
+        return;
+
+    if (writen(fd, mail->map_addr, mail->map_size) ==
+            (ssize_t) mail->map_size && 0 == durable_sync_fd(fd)) {
+        close(fd);
+        /* crash between these two leaves both files, '.rdy' wins */
+        if (0 == rename(prcs, rdy)) {
+            remove(fn);
+            strcpy(fn, rdy);
+        }
+    }
+    else {
+        close(fd);
+        remove(prcs);
+    }
+}
+
+/* prefetch - start reading file into page cache in background */
+static void prefetch (const char *path)
+{
+    int fd;
+
+    if (NULL == path || (fd = open(path, O_RDONLY | O_CLOEXEC)) < 0)
+        return;
+
+    posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+    close(fd);
+}
+
+/* mail_rules - resolve processing rules of mail object by its envelope, *
+ *              returns bitmask of rule types, which were looked up       */
+static int mail_rules (struct mail_object *mail)
+{
+    int types = 0;
+
+    if (!mail->rules_set) {
+        mail->rules[RULE_SIGN] = rules_lookup(RULE_SIGN, mail->mail_from);
+        mail->rules[RULE_VRFY] = rules_lookup(RULE_VRFY, mail->mail_from);
+        mail->rules[RULE_ENCR] = mail->rules[RULE_DECR] = -1;
+        mail->rules_set = 1;
+        types |= (1 << RULE_SIGN) | (1 << RULE_VRFY);
+    }
+
+    /* when there is only one recipient, encryption/decryption makes sense */
+    if (1 == mail->no_rcpt) {
+        mail->rules[RULE_ENCR] = rules_lookup(RULE_ENCR, mail->rcpt_to[0]);
+        mail->rules[RULE_DECR] = rules_lookup(RULE_DECR, mail->rcpt_to[0]);
+        types |= (1 << RULE_ENCR) | (1 << RULE_DECR);
+    }
+    else
+        mail->rules[RULE_ENCR] = mail->rules[RULE_DECR] = -1;
+
+    return types;
+}
+
+/* smime_envelope - resolve processing rules as soon as MAIL or RCPT is *
+ *                  accepted and prefetch certificates and keys they    *
+ *                  need, while DATA is still coming (SMTP Server hook) */
+void smime_envelope (struct mail_object *mail)
+{
+    long r;
+    int types = mail_rules(mail);
+
+    if (0 == mail->no_rcpt) {
+        trace_addr("mail", recv_fn, "from", mail->mail_from);
+
+        /* the way of mail starts (again, after RSET) */
+        if (NULL != recv_times) {
+            bzero(recv_times->usec, sizeof(recv_times->usec));
+            recv_times->start = stats_now();
+        }
+    }
+    else
+        trace_addr("rcpt", recv_fn, "to", mail->rcpt_to[mail->no_rcpt-1]);
+
+    if ((types & (1 << RULE_SIGN)) && (r = mail->rules[RULE_SIGN]) >= 0) {
+        prefetch(conf.sign_rules[r].cert_path);
+        prefetch(conf.sign_rules[r].key_path);
+    }
+    if ((types & (1 << RULE_VRFY)) && (r = mail->rules[RULE_VRFY]) >= 0) {
+        prefetch(conf.vrfy_rules[r].cert_path);
+        prefetch(conf.vrfy_rules[r].cacert_path);
+    }
+    if ((types & (1 << RULE_ENCR)) && (r = mail->rules[RULE_ENCR]) >= 0)
+        prefetch(conf.encr_rules[r].cert_path);
+    if ((types & (1 << RULE_DECR)) && (r = mail->rules[RULE_DECR]) >= 0) {
+        prefetch(conf.decr_rules[r].cert_path);
+        prefetch(conf.decr_rules[r].key_path);
+    }
+}
+
+/* stream_send - pass data to smime-tool of sign stream */
+static void stream_send (struct sign_stream *ss, const char *buf, size_t len)
+{
+    ssize_t n;
+
+    while (ss->in >= 0 && len > 0) {
+        /* smime-tool may be gone, it mustn't kill the session */
+        if ((n = send(ss->in, buf, len, MSG_NOSIGNAL)) < 0) {
+            if (EINTR == errno)
+                continue;
+            close(ss->in);
+            ss->in = -1;
+            ss->failed = 1;
+        }
+        else {
+            buf += n;
+            len -= n;
+        }
+    }
+}
+
+/* stream_start - start signing of mail object, its data will be passed *
+ *                to smime-tool as they are received                    */
+static struct sign_stream *stream_start (struct mail_object *mail, long r)
+{
+    int sv[2];
+    size_t i;
+    char num[32];
+    sigset_t mask;
+    struct sign_stream *ss;
+    char *argv[] = { "smime-tool", "-sign",
+                     "-cert", conf.sign_rules[r].cert_path,
+                     "-key", conf.sign_rules[r].key_path,
+                     "-pass", conf.sign_rules[r].key_pass,
+                     "-", NULL };
+
+    if (NULL == (ss = calloc(1, sizeof(struct sign_stream))))
+        return NULL;
+
+    if ((ss->out = memfd_create("smime-gate", MFD_CLOEXEC)) < 0) {
+        free(ss);
+        return NULL;
+    }
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) < 0) {
+        close(ss->out);
+        free(ss);
+        return NULL;
+    }
+
+    sigprocmask(SIG_SETMASK, NULL, &mask);
+    ss->pid = smime_exec(argv, sv[1], ss->out, &mask);
+    close(sv[1]);
+    ss->in = sv[0];
+    if (ss->pid < 0) {
+        close(ss->in);
+        close(ss->out);
+        free(ss);
+        return NULL;
+    }
+    ++sign_streams;
+
+    /* envelope goes first, as in spooled mail file */
+    snprintf(num, sizeof(num), "\n%u\n", (unsigned int) mail->no_rcpt);
+    stream_send(ss, mail->mail_from, strlen(mail->mail_from));
+    stream_send(ss, num, strlen(num));
+    for (i = 0; i < mail->no_rcpt; ++i) {
+        stream_send(ss, mail->rcpt_to[i], strlen(mail->rcpt_to[i]));
+        stream_send(ss, "\n", 1);
+    }
+
+    return ss;
+}
+
+/* stream_finish - wait for smime-tool of sign stream, returns memfd with *
+ *                 signed mail object or -1 on failure (stream is freed)  */
+static int stream_finish (struct sign_stream *ss)
+{
+    int status = 0, outfd = ss->out;
+
+    if (ss->in >= 0)
+        close(ss->in);      /* unfinished stream, smime-tool gets EOF */
+
+    /* stream may have been finished by another process (pid is 0) */
+    if (ss->pid > 0) {
+        status = -1;
+        while (waitpid(ss->pid, &status, 0) < 0 && EINTR == errno)
+            ;
+        --sign_streams;
+    }
+
+    if (ss->failed || !ss->end || !WIFEXITED(status) ||
+        0 != WEXITSTATUS(status)) {
+        close(outfd);
+        outfd = -1;
+    }
+    free(ss);
+
+    return outfd;
+}
+
+/* smime_data - sign mail object while its data are received, if it has *
+ *              signing rule (SMTP Server hook, 'stream_sign' option)    */
+void smime_data (struct mail_object *mail, const char *chunk, size_t len,
+                 int end)
+{
+    int fd;
+    long r;
+    struct sign_stream *ss = mail->priv;
+
+    /* data are received again (previous ones were rejected) */
+    if (NULL != ss && ss->end) {
+        if ((fd = stream_finish(ss)) >= 0)
+            close(fd);
+        mail->priv = ss = NULL;
+    }
+
+    /* stream can't start in the middle of data */
+    if (stream_skip) {
+        stream_skip = !end;
+        return;
+    }
+
+    if (NULL == ss) {
+        if (!mail->rules_set)
+            mail_rules(mail);
+        if ((r = mail->rules[RULE_SIGN]) < 0)
+            return;
+        if (sign_streams >= MAX_STREAMS ||
+            NULL == (ss = stream_start(mail, r))) {
+            stream_skip = !end;
+            return;     /* mail will be signed after receipt */
+        }
+        mail->priv = ss;
+    }
+
+    stream_send(ss, chunk, len);
+
+    if (end) {
+        if (ss->in >= 0)
+            close(ss->in);
+        ss->in = -1;
+        ss->end = 1;
+    }
+}
+
+/* smime_drop - stop signing of mail object, whose receipt was abandoned *
+ *              (SMTP Server hook, 'stream_sign' option)                 */
+void smime_drop (struct mail_object *mail)
+{
+    int fd;
+    struct sign_stream *ss = mail->priv;
+
+    if (NULL == ss)
+        return;
+
+    if (ss->pid > 0)
+        kill(ss->pid, SIGTERM);     /* its result isn't needed */
+    if ((fd = stream_finish(ss)) >= 0)
+        close(fd);
+    mail->priv = NULL;
+}
+
+/* crypto_start - S/MIME step of mail object begins, returns its start *
+ *                time (see stats_now())                               */
+static uint64_t crypto_start (struct mail_object *mail, int type)
+{
+    PROBE2(crypto__start, type, mail->data_size);
+    return stats_now();
+}
+
+/* crypto_done - account S/MIME step of mail object, which was started *
+ *               at 't' (see crypto_start())                           */
+static void crypto_done (struct mail_object *mail, const char *fn, int type,
+                         int ok, uint64_t t)
 {
-    int m, toprcs, sign_encr, ret;
-    unsigned int r;
-    char cmd[CMDMAXLEN];
+    t = stats_now() - t;
+    PROBE3(crypto__done, type, mail->data_size, ok);
+
+    stats_record(STAGE_CRYPTO(type), t);
+    stats_count(ok ? CNT_PROCESSED(type) : CNT_CRYPTO_FAIL, 1);
+    trace_event("crypto", fn, "\"step\":\"%s\",\"ok\":%s,\"usec\":%llu",
+                stats_stage_name(STAGE_CRYPTO(type)), ok ? "true" : "false",
+                (unsigned long long) t);
+}
+
+int smime_process_mails (struct mail_object **mails, char **fns,
+                         struct mail_times *times, int no_mails)
+{
+    int m, sign_encr, cur, ret;
+    long r, rules[RULE_TYPES];
+    uint64_t t;
 
     for (m = 0; m < no_mails; ++m) {
+        cur = -1;
+
+        /* rules are usually resolved during receipt (smime_envelope()), *
+         * mails are replaced by processing, so keep them aside          */
+        if (!mails[m]->rules_set)
+            mail_rules(mails[m]);
+        memcpy(rules, mails[m]->rules, sizeof(rules));
+
+        /* steps of the mail are added to its stages (slow log) */
+        if (NULL != times) {
+            memcpy(times[m].rules, rules, sizeof(rules));
+            stats_stages = times[m].usec;
+        }
 
         /** signing rules **/
-        toprcs = 0;
         sign_encr = 0;
-        for (r = 0; r < conf.sign_rules_size; ++r) {
-            if (NULL != conf.sign_rules[r].sndr) {
-                if (strcasestr(mails[m]->mail_from, conf.sign_rules[r].sndr)) {
-                    toprcs = 1;
-                    break;
-                }
-            }
-        }
+        r = rules[RULE_SIGN];
         /* did we find matching rule? */
-        if (toprcs) {
-            snprintf(cmd, CMDMAXLEN,
-                "smime-tool -sign -cert %s -key %s -pass %s %s > %s.prcs",
-                conf.sign_rules[r].cert_path, conf.sign_rules[r].key_path,
-                conf.sign_rules[r].key_pass, fns[m], fns[m]);
-
-            ret = system(cmd);
-            snprintf(cmd, CMDMAXLEN, "%s.prcs", fns[m]);
-
-            if (0 == ret) {
-                if (0 == rename(cmd, fns[m])) {
-                    free_mail_object(mails[m]);
-                    load_mail_from_file(fns[m], mails[m]);
-                    sign_encr = 1;
-                    /* signing successful */
-                }
-            }
-            remove(cmd);
+        if (r >= 0) {
+            char *argv[] = { "smime-tool", "-sign",
+                             "-cert", conf.sign_rules[r].cert_path,
+                             "-key", conf.sign_rules[r].key_path,
+                             "-pass", conf.sign_rules[r].key_pass,
+                             "-", NULL };
+            struct sign_stream *ss = mails[m]->priv;
+
+            /* signing might have been done during receipt */
+            t = crypto_start(mails[m], RULE_SIGN);
+            mails[m]->priv = NULL;
+            if (NULL != ss &&
+                0 == smime_result(mails[m], &cur, stream_finish(ss)))
+                sign_encr = 1;
+            else if (0 == smime_step(mails[m], fns[m], &cur, argv))
+                sign_encr = 1;  /* signing successful */
+            crypto_done(mails[m], fns[m], RULE_SIGN, sign_encr, t);
         }
         /** end of signing rules **/
 
         /** encryption rules **/
-        toprcs = 0;
-        for (r = 0; r < conf.encr_rules_size; ++r) {
-            if (NULL != conf.encr_rules[r].rcpt) {
-                /* when there is only one recipient, encryption makes sense */
-                if (1 == mails[m]->no_rcpt) {
-                    if (strcasestr(mails[m]->rcpt_to[0],
-                                conf.encr_rules[r].rcpt))
-                    {
-                        toprcs = 1;
-                        break;
-                    }
-                }
-            }
-        }
+        r = rules[RULE_ENCR];
         /* did we find matching rule? */
-        if (toprcs) {
-            snprintf(cmd, CMDMAXLEN,
-                    "smime-tool -encrypt -cert %s %s > %s.prcs",
-                    conf.encr_rules[r].cert_path, fns[m], fns[m]);
-
-            ret = system(cmd);
-            snprintf(cmd, CMDMAXLEN, "%s.prcs", fns[m]);
-
-            if (0 == ret) {
-                if (0 == rename(cmd, fns[m])) {
-                    free_mail_object(mails[m]);
-                    load_mail_from_file(fns[m], mails[m]);
-                    sign_encr = 1;
-                    /* encryption successful */
-                }
-            }
-            remove(cmd);
+        if (r >= 0) {
+            char *argv[] = { "smime-tool", "-encrypt",
+                             "-cert", conf.encr_rules[r].cert_path,
+                             "-", NULL };
+
+            t = crypto_start(mails[m], RULE_ENCR);
+            ret = smime_step(mails[m], fns[m], &cur, argv);
+            if (0 == ret)
+                sign_encr = 1;  /* encryption successful */
+            crypto_done(mails[m], fns[m], RULE_ENCR, 0 == ret, t);
         }
         /** end of encryption rules **/
 
-        if (sign_encr)  /* there is no sense in decrypting/verifying mails, */
-            continue;   /* which has just been encrypted/signed.            */
+        if (sign_encr)      /* there is no sense in decrypting/verifying  */
+            goto mail_done; /* mails, which has just been encrypted/signed */
 
         /** decryption rules **/
-        toprcs = 0;
-        for (r = 0; r < conf.decr_rules_size; ++r) {
-            if (NULL != conf.decr_rules[r].rcpt) {
-                /* when there is only one recipient, decryption makes sense */
-                if (1 == mails[m]->no_rcpt) {
-                    if (strcasestr(mails[m]->rcpt_to[0],
-                                conf.decr_rules[r].rcpt))
-                    {
-                        toprcs = 1;
-                        break;
-                    }
-                }
-            }
-        }
+        r = rules[RULE_DECR];
         /* did we find matching rule? */
-        if (toprcs) {
-            snprintf(cmd, CMDMAXLEN,
-                "smime-tool -decrypt -cert %s -key %s -pass %s %s > %s.prcs",
-                conf.decr_rules[r].cert_path, conf.decr_rules[r].key_path,
-                conf.decr_rules[r].key_pass, fns[m], fns[m]);
-
-            ret = system(cmd);
-            snprintf(cmd, CMDMAXLEN, "%s.prcs", fns[m]);
-            if (0 == ret) {
-                if (0 == rename(cmd, fns[m])) {
-                    free_mail_object(mails[m]);
-                    load_mail_from_file(fns[m], mails[m]);
-                    /* decryption successful */
-                }
-            }
-            remove(cmd);
+        if (r >= 0) {
+            char *argv[] = { "smime-tool", "-decrypt",
+                             "-cert", conf.decr_rules[r].cert_path,
+                             "-key", conf.decr_rules[r].key_path,
+                             "-pass", conf.decr_rules[r].key_pass,
+                             "-", NULL };
+
+            t = crypto_start(mails[m], RULE_DECR);
+            ret = smime_step(mails[m], fns[m], &cur, argv);
+            crypto_done(mails[m], fns[m], RULE_DECR, 0 == ret, t);
         }
         /** end of decryption rules **/
 
         /** verification rules **/
-        toprcs = 0;
-        for (r = 0; r < conf.vrfy_rules_size; ++r) {
-            if (NULL != conf.vrfy_rules[r].sndr) {
-                if (strcasestr(mails[m]->mail_from, conf.vrfy_rules[r].sndr)) {
-                    toprcs = 1;
-                    break;
-                }
-            }
-        }
+        r = rules[RULE_VRFY];
         /* did we find matching rule? */
-        if (toprcs) {
-            snprintf(cmd, CMDMAXLEN,
-                "smime-tool -verify -cert %s -ca %s %s > %s.prcs",
-                conf.vrfy_rules[r].cert_path, conf.vrfy_rules[r].cacert_path,
-                fns[m], fns[m]);
-
-            ret = system(cmd);
-            snprintf(cmd, CMDMAXLEN, "%s.prcs", fns[m]);
-
-            if (0 == ret) {
-                if (0 == rename(cmd, fns[m])) {
-                    free_mail_object(mails[m]);
-                    load_mail_from_file(fns[m], mails[m]);
-                    /* verification successful */
-                }
-            }
-            remove(cmd);
+        if (r >= 0) {
+            char *argv[] = { "smime-tool", "-verify",
+                             "-cert", conf.vrfy_rules[r].cert_path,
+                             "-ca", conf.vrfy_rules[r].cacert_path,
+                             "-", NULL };
+
+            t = crypto_start(mails[m], RULE_VRFY);
+            ret = smime_step(mails[m], fns[m], &cur, argv);
+            crypto_done(mails[m], fns[m], RULE_VRFY, 0 == ret, t);
         }
         /** end of verification rules **/
+
+mail_done:
+        /* write result of all steps at once */
+        smime_store(mails[m], fns[m], cur);
+        if (cur >= 0)
+            close(cur);     /* mail object keeps its mapping */
+        stats_stages = NULL;
+    }
+
+    return 0;
+}
+
+/* pipe_send - hand mail object over to forwarder, returns 0 on success */
+static int pipe_send (int fd, struct mail_object *mail, const char *fn,
+                      const struct mail_times *times)
+{
+    int i, nfds = 0, fds[2], ret;
+    struct pipe_msg msg;
+    struct msghdr mh;
+    struct iovec iov;
+    struct cmsghdr *cmsg;
+    union {
+        struct cmsghdr align;
+        char buf[CMSG_SPACE(2 * sizeof(int))];
+    } ctl;
+
+    bzero(&msg, sizeof(msg));
+    snprintf(msg.fn, FNMAXLEN, "%s", fn);
+    msg.rules_set = mail->rules_set;
+    memcpy(msg.rules, mail->rules, sizeof(msg.rules));
+    msg.times = *times;
+
+    /* directory spool: forwarder maps spooled file on its own */
+    if (SPOOL_LOG == conf.spool) {
+        if ((fds[nfds] = mail_memfd(mail)) < 0)
+            return -1;
+        ++nfds;
+        msg.has_mail = 1;
+    }
+
+    /* only the key operation is left to smime-tool by now */
+    if (NULL != mail->priv) {
+        fds[nfds] = stream_finish(mail->priv);
+        mail->priv = NULL;
+        if (fds[nfds] >= 0) {
+            ++nfds;
+            msg.has_signed = 1;
+        }
+    }
+
+    bzero(&mh, sizeof(mh));
+    iov.iov_base = &msg;
+    iov.iov_len = sizeof(msg);
+    mh.msg_iov = &iov;
+    mh.msg_iovlen = 1;
+
+    if (nfds > 0) {
+        mh.msg_control = ctl.buf;
+        mh.msg_controllen = CMSG_SPACE(nfds * sizeof(int));
+        cmsg = CMSG_FIRSTHDR(&mh);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(nfds * sizeof(int));
+        memcpy(CMSG_DATA(cmsg), fds, nfds * sizeof(int));
+    }
+
+    ret = (sendmsg(fd, &mh, MSG_NOSIGNAL) == sizeof(msg)) ? 0 : -1;
+
+    for (i = 0; i < nfds; ++i)
+        close(fds[i]);
+
+    return ret;
+}
+
+/* pipe_recv - receive mail object from session, returns 0 on success, 1 *
+ *             when session is over and -1 if mail object can't be used   *
+ *             (it stays spooled, for recovery)                           */
+static int pipe_recv (int fd, struct mail_object *mail, char *fn, int *signedfd,
+                      struct mail_times *times)
+{
+    int i, nfds = 0, fds[2], ret;
+    ssize_t n;
+    struct pipe_msg msg;
+    struct msghdr mh;
+    struct iovec iov;
+    struct cmsghdr *cmsg;
+    union {
+        struct cmsghdr align;
+        char buf[CMSG_SPACE(2 * sizeof(int))];
+    } ctl;
+
+    bzero(&mh, sizeof(mh));
+    iov.iov_base = &msg;
+    iov.iov_len = sizeof(msg);
+    mh.msg_iov = &iov;
+    mh.msg_iovlen = 1;
+    mh.msg_control = ctl.buf;
+    mh.msg_controllen = sizeof(ctl.buf);
+
+    while ((n = recvmsg(fd, &mh, MSG_CMSG_CLOEXEC)) < 0 && EINTR == errno)
+        ;
+    if (n <= 0)
+        return 1;
+
+    cmsg = CMSG_FIRSTHDR(&mh);
+    if (NULL != cmsg && SOL_SOCKET == cmsg->cmsg_level &&
+        SCM_RIGHTS == cmsg->cmsg_type) {
+        nfds = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        memcpy(fds, CMSG_DATA(cmsg), nfds * sizeof(int));
+    }
+
+    *signedfd = -1;
+    if (sizeof(msg) != n || msg.has_mail + msg.has_signed != nfds) {
+        for (i = 0; i < nfds; ++i)
+            close(fds[i]);
+        return -1;
+    }
+
+    msg.fn[FNMAXLEN-1] = '\0';
+    strcpy(fn, msg.fn);
+
+    if (msg.has_mail) {
+        ret = map_mail_from_fd(fds[0], mail);
+        close(fds[0]);      /* mail object keeps its mapping */
+    }
+    else
+        ret = map_mail_from_file(fn, mail);
+
+    if (msg.has_signed) {
+        if (0 == ret)
+            *signedfd = fds[nfds-1];
+        else
+            close(fds[nfds-1]);
     }
+    if (0 != ret)
+        return -1;
+
+    mail->rules_set = msg.rules_set;
+    memcpy(mail->rules, msg.rules, sizeof(mail->rules));
+    *times = msg.times;
 
     return 0;
 }
 
+/* upstream_send - forward mail object over persistent connection to mail *
+ *                 server, which is (re)connected when needed, returns 0  *
+ *                 on success                                             */
+static int upstream_send (int *srvfd, struct mail_object *mail)
+{
+    int cli, ret;
+    uint64_t t;
+
+    for (;;) {
+        if (*srvfd >= 0)
+            cli = SMTP_CLI_NXT | SMTP_CLI_CON;
+        else {
+            *srvfd = Socket(AF_INET, SOCK_STREAM, 0);
+            t = stats_now();
+            if (connect(*srvfd, (SA *) &(conf.mail_srv),
+                        sizeof(conf.mail_srv)) < 0) {
+                close(*srvfd);
+                *srvfd = -1;
+                err_ret("connect error");
+                return -1;
+            }
+            stats_record(STAGE_CONNECT, stats_now() - t);
+            cli = SMTP_CLI_NEW | SMTP_CLI_CON;
+        }
+
+        PROBE1(send__start, mail->data_size);
+        t = stats_now();
+        ret = smtp_send_mail(*srvfd, mail, cli);
+        stats_record(STAGE_SEND, stats_now() - t);
+        PROBE1(send__done, ret);
+        if (0 == ret)
+            return 0;
+        *srvfd = -1;    /* closed by smtp_send_mail() */
+
+        /* idle connection may have been dropped by server, *
+         * fresh one has failed for real                    */
+        if (cli & SMTP_CLI_NEW)
+            return -1;
+    }
+}
+
+/* forwarder - process mail objects handed over by session and forward *
+ *             them to mail server, until the session is over           */
+static void forwarder (int fd)
+{
+    int ret, srvfd = -1, signedfd;
+    uint64_t t;
+    char *fn = Malloc(FNMAXLEN);
+    struct mail_object *mail = Malloc(sizeof(struct mail_object));
+    struct sign_stream *ss;
+    struct smtp_reply rply;
+    struct mail_times times;
+
+    while (1 != (ret = pipe_recv(fd, mail, fn, &signedfd, &times))) {
+        if (0 != ret) {
+            err_msg("forwarder: cannot load mail object, left for recovery");
+            continue;
+        }
+
+        /* signing was finished by session, take its result */
+        if (signedfd >= 0 && NULL != (ss = calloc(1, sizeof(*ss)))) {
+            ss->in = -1;
+            ss->out = signedfd;
+            ss->end = 1;
+            mail->priv = ss;
+        }
+        else if (signedfd >= 0)
+            close(signedfd);
+
+        smime_process_mails(&mail, &fn, &times, 1);
+
+        t = stats_now();
+        stats_stages = times.usec;      /* connection and sending */
+        ret = upstream_send(&srvfd, mail);
+        stats_stages = NULL;
+        t = stats_now() - t;
+        trace_event("forward", fn, "\"ok\":%s,\"usec\":%llu",
+                    0 == ret ? "true" : "false", (unsigned long long) t);
+
+        if (0 == ret) {
+#ifdef DEBUG
+            printf(DPREF "forwarder: sent mail %s\n", fn);
+#endif
+            mail_delivered(mail, fn);
+        }
+        else
+            mail_unsent(mail, fn);
+        slow_log(&times, fn, 0 != ret);
+
+        free_mail_object(mail);
+    }
+
+    if (srvfd >= 0) {
+        smtp_send_command(srvfd, QUIT, NULL);
+        smtp_recv_reply(srvfd, &rply);
+        close(srvfd);
+    }
+
+    free(mail);
+    free(fn);
+}
+
+/* pipelined_service - receive mails from client and hand each one over to *
+ *                     forwarder process as soon as it is accepted, so it  *
+ *                     is processed and forwarded while the client sends   *
+ *                     next ones (pipelined mode)                          */
+static void pipelined_service (int sockfd)
+{
+    int sv[2], status, srv = SMTP_SRV_NEW;
+    pid_t pid;
+    char *filename;
+    struct mail_object *mail;
+    struct arena_mark mark;
+    struct mail_times times;
+
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv) < 0)
+        err_sys("socketpair error");
+
+    if ((pid = Fork()) == 0) {
+        Close(sockfd);
+        Close(sv[0]);
+        forwarder(sv[1]);
+        exit(0);
+    }
+    Close(sv[1]);
+
+    /* mail object is reused, anything else is released after each mail */
+    if (NULL == (mail = arena_alloc(&session_arena, sizeof(*mail))))
+        err_sys("malloc error");
+    arena_mark(&session_arena, &mark);
+
+    if (NULL == (filename = generate_filename()))
+        err_sys("malloc error");
+
+    while (0 == recv_mail(sockfd, mail, filename, srv, &times)) {
+#ifdef DEBUG
+        printf(DPREF "received mail, saved in %s\n", filename);
+#endif
+        if (0 == pipe_send(sv[0], mail, filename, &times))
+            free_mail_object(mail);
+        else {
+            /* forwarder is gone, deal with mail on our own */
+            smime_process_mails(&mail, &filename, &times, 1);
+            forward_mails(&mail, &filename, &times, 1);
+        }
+        arena_reset(&session_arena, &mark);
+
+        if (NULL == (filename = generate_filename()))
+            err_sys("malloc error");
+        srv = SMTP_SRV_NXT;
+    }
+
+    /* session lasts until all its mails are forwarded */
+    Close(sv[0]);
+    while (waitpid(pid, &status, 0) < 0 && EINTR == errno)
+        ;
+}
+
+/* dir_entries - number of files in directory */
+static uint64_t dir_entries (const char *dirname)
+{
+    uint64_t n = 0;
+    DIR *dp;
+    struct dirent *en;
+
+    if (NULL == (dp = opendir(dirname)))
+        return 0;
+    while (NULL != (en = readdir(dp))) {
+        if ('.' != en->d_name[0])
+            ++n;
+    }
+    closedir(dp);
+
+    return n;
+}
+
 void unsent_service (void)
 {
     prctl(PR_SET_PDEATHSIG, SIGTERM);
 
     for (;;) {
+        /* queue is measured by this pass, mails left for unsent service *
+         * later on are added to it (see stats_unsent())                 */
+        stats_gauge(GAUGE_UNSENT_MARK, stats_counter(CNT_UNSENT));
+
         if (-1 == send_mails_from_dir(DEFAULT_UNSENT_DIR, &(conf.mail_srv)) )
-            err_sys("failed to open unsent directory");
+            err_msg("failed to open unsent directory");
 #ifdef DEBUG
         else
             printf(DPREF "unsent_service: sent mails from unsent directory\n");
 #endif
+        stats_gauge(GAUGE_UNSENT_DIR, dir_entries(DEFAULT_UNSENT_DIR));
+
+        /* log spool: deliver requeued mails, drop acknowledged segments */
+        if (SPOOL_LOG == conf.spool) {
+            send_mails_from_queue(&(conf.mail_srv));
+            queue_compact();
+        }
 
         sleep(UNSENT_SLEEP);
     }
 }
 
+/* recover_add - collect received but unprocessed mail of log spool *
+ *               (queue_unprocessed() callback)                     */
+static void recover_add (const struct queue_rec *rec, void *arg)
+{
+    struct recovery *rcv = arg;
+
+    if (rcv->n == rcv->size) {
+        rcv->size = rcv->size ? 2 * rcv->size : 64;
+        rcv->ids = realloc(rcv->ids, rcv->size * sizeof(char *));
+        rcv->segs = realloc(rcv->segs, rcv->size * sizeof(uint32_t));
+        rcv->offs = realloc(rcv->offs, rcv->size * sizeof(size_t));
+        if (NULL == rcv->ids || NULL == rcv->segs || NULL == rcv->offs)
+            err_sys("realloc error");
+    }
+
+    rcv->ids[rcv->n] = Malloc(FNMAXLEN);
+    snprintf(rcv->ids[rcv->n], FNMAXLEN, "%s", rec->id);
+    rcv->segs[rcv->n] = rec->segno;
+    rcv->offs[rcv->n] = rec->off;
+    ++rcv->n;
+}
+
+/* recover_load - load i-th mail object to be recovered */
+static int recover_load (struct recovery *rcv, size_t i,
+                         struct mail_object *mail)
+{
+    if (SPOOL_LOG == conf.spool)
+        return queue_load(rcv->segs[i], rcv->offs[i], mail);
+    else
+        return map_mail_from_file(rcv->ids[i], mail);
+}
+
+/* recover_worker - process and forward every RECOVERY_PROCS-th mail, *
+ *                  starting with 'first' (MAILBUF mails at once)     */
+static void recover_worker (struct recovery *rcv, size_t first)
+{
+    int no_mails;
+    size_t i = first;
+    char **fns = Calloc(MAILBUF, sizeof(char *));
+    struct mail_object **mails = Calloc(MAILBUF, sizeof(struct mail_object *));
+
+    prctl(PR_SET_PDEATHSIG, SIGTERM);
+
+    while (i < rcv->n) {
+        for (no_mails = 0; no_mails < MAILBUF && i < rcv->n;
+             i += RECOVERY_PROCS)
+        {
+            mails[no_mails] = Malloc(sizeof(struct mail_object));
+            if (0 != recover_load(rcv, i, mails[no_mails])) {
+                err_msg("cannot recover mail %s, dropping it", rcv->ids[i]);
+                if (SPOOL_DIR == conf.spool)
+                    remove(rcv->ids[i]);
+                else
+                    queue_append(QREC_ACK, rcv->ids[i], NULL);
+                free(mails[no_mails]);
+                continue;
+            }
+
+            fns[no_mails++] = rcv->ids[i];
+            rcv->ids[i] = NULL;
+        }
+
+        if (no_mails > 0) {
+            smime_process_mails(mails, fns, NULL, no_mails);
+            forward_mails(mails, fns, NULL, no_mails);
+        }
+
+        while (no_mails > 0) {
+            --no_mails;
+            free(mails[no_mails]);
+            free(fns[no_mails]);
+        }
+    }
+
+    free(mails);
+    free(fns);
+}
+
+/* recover_mails - resume work of sessions, which crashed: partial results *
+ *                 are dropped, processed mails are handed to the unsent   *
+ *                 service and received ones are processed and forwarded   *
+ *                 by RECOVERY_PROCS worker processes in parallel          */
+void recover_mails (void)
+{
+    int i, n;
+    size_t len, w;
+    char path[RCV_PATHLEN], to[RCV_PATHLEN];
+    struct dirent **eps;
+    struct recovery rcv;
+    sigset_t mask, chld_mask;
+
+    bzero(&rcv, sizeof(rcv));
+
+    if ((n = scandir(DEFAULT_WORKING_DIR, &eps, NULL, alphasort)) < 0) {
+        err_ret("cannot scan working directory");
+        return;
+    }
+
+    /* received mails, not marked as processed */
+    for (i = 0; i < n; ++i) {
+        if (0 != strncmp(eps[i]->d_name, TRACE_PREFIX,
+                         strlen(TRACE_PREFIX)) ||
+            NULL != strchr(eps[i]->d_name, '.'))
+            continue;
+
+        snprintf(path, RCV_PATHLEN, DEFAULT_WORKING_DIR "/%s", eps[i]->d_name);
+        snprintf(to, RCV_PATHLEN, DEFAULT_WORKING_DIR "/%s" RDY_SUFFIX,
+                 eps[i]->d_name);
+        if (0 == access(to, F_OK))
+            remove(path);   /* crashed after processing was stored */
+        else if (SPOOL_DIR == conf.spool) {
+            struct queue_rec rec;
+
+            bzero(&rec, sizeof(rec));
+            rec.id = path;
+            recover_add(&rec, &rcv);
+        }
+        else
+            remove(path);   /* smime-tool input of log spool, remains in log */
+    }
+
+    /* partial results and processed mails */
+    for (i = 0; i < n; ++i) {
+        len = strlen(eps[i]->d_name);
+        snprintf(path, RCV_PATHLEN, DEFAULT_WORKING_DIR "/%s", eps[i]->d_name);
+
+        if ((len > strlen(PRCS_SUFFIX) &&
+             0 == strcmp(eps[i]->d_name + len - strlen(PRCS_SUFFIX),
+                         PRCS_SUFFIX)) ||
+            (len > strlen(PART_SUFFIX) &&
+             0 == strcmp(eps[i]->d_name + len - strlen(PART_SUFFIX),
+                         PART_SUFFIX)))
+        {
+            remove(path);   /* partial result or mail not received whole */
+        }
+        else if (len > strlen(RDY_SUFFIX) &&
+            0 == strcmp(eps[i]->d_name + len - strlen(RDY_SUFFIX), RDY_SUFFIX))
+        {
+            snprintf(to, RCV_PATHLEN, DEFAULT_UNSENT_DIR "/%s", eps[i]->d_name);
+            rename(path, to);
+        }
+        free(eps[i]);
+    }
+    free(eps);
+
+    /* log spool: mails without processed/delivered record */
+    if (SPOOL_LOG == conf.spool && queue_unprocessed(recover_add, &rcv) < 0)
+        err_ret("cannot read queue directory");
+
+    if (0 == rcv.n)
+        return;
+
+    err_msg("recovering %u mails", (unsigned int) rcv.n);
+
+    sigemptyset(&chld_mask);
+    sigaddset(&chld_mask, SIGCHLD);
+
+    for (w = 0; w < RECOVERY_PROCS && w < rcv.n; ++w) {
+        if (Fork() == 0) {
+            recover_worker(&rcv, w);
+            exit(0);
+        }
+        sigprocmask(SIG_BLOCK, &chld_mask, &mask);
+        ++sproc_counter;
+        sigprocmask(SIG_SETMASK, &mask, NULL);
+    }
+
+    for (w = 0; w < rcv.n; ++w)
+        free(rcv.ids[w]);
+    free(rcv.ids);
+    free(rcv.segs);
+    free(rcv.offs);
+}
+
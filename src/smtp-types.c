@@ -7,6 +7,7 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <sys/mman.h>
 #include "smtp-types.h"
 
 /* free_mail_object - free given mail object structure */
@@ -14,6 +15,12 @@ void free_mail_object (struct mail_object *mail)
 {
     unsigned int i;
 
+    /* envelope is released along with session arena */
+    if (mail->in_arena) {
+        mail->mail_from = NULL;
+        mail->rcpt_to = NULL;
+    }
+
     if (NULL != mail->mail_from) {
         free(mail->mail_from);
         mail->mail_from = NULL;
@@ -28,7 +35,10 @@ void free_mail_object (struct mail_object *mail)
         mail->rcpt_to = NULL;
     }
 
-    if (NULL != mail->data)
+    /* mail body may point into a mapped mail file */
+    if (NULL != mail->map_addr)
+        munmap(mail->map_addr, mail->map_size);
+    else if (NULL != mail->data)
         free(mail->data);
 
     memset(mail, 0, sizeof(struct mail_object));
@@ -50,7 +60,7 @@ void print_mail_object (struct mail_object *mail)
         fprintf(stderr, "TO:   %s\n", mail->rcpt_to[i]);
 
     /* mail's SMTP content */
-    fprintf(stderr, "\nDATA (size: %u octets)\n%s=== END OF MAIL ===\n",
-            (unsigned int)mail->data_size, mail->data);
+    fprintf(stderr, "\nDATA (size: %u octets)\n%.*s=== END OF MAIL ===\n",
+            (unsigned int)mail->data_size, (int)mail->data_size, mail->data);
 }
 
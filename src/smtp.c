@@ -4,22 +4,51 @@
  * Author:      Tomasz Pieczerak (tphaster)
  */
 
+#include <ctype.h>
 #include <dirent.h>
 #include <errno.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
+#include "arena.h"
 #include "config.h"
+#include "probes.h"
 #include "smtp-lib.h"
 #include "smtp.h"
 #include "system.h"
 
 #define MAIL_START_LEN  512     /* default mail block size */
+#define RCPT_START_CAP  4       /* default size of recipients array */
+#define RCPT_SET_MIN    16      /* minimum size of recipients set */
 
 ssize_t smtp_recv_mail_data (int sockfd, char **buf_ptr, size_t *buf_size);
 
+/* SMTP Server hooks, by default mail objects are saved to files */
+struct smtp_srv_hooks smtp_hooks = { save_mail_to_file, NULL, NULL, NULL,
+                                     NULL };
+
+/* session arena for mail envelopes (NULL: envelopes are malloc()ed) */
+struct arena *smtp_arena = NULL;
+
+/* drop duplicate recipients (compared case-insensitively)? */
+int smtp_rcpt_dedup = 0;
+
+/* recipients of mail being received (for duplicates detection), open  *
+ * addressing hash table, slot holds index to rcpt_to + 1 (0: empty)   */
+static struct {
+    size_t *slots;
+    size_t size;        /* power of 2 */
+} rcpt_set;
+
+/* mail object, whose data are being received (for data hook) */
+static struct mail_object *data_mail;
+
 
 /* smtp_send_mail - send a mail object through connected socket */
 int smtp_send_mail (int sockfd, struct mail_object *mail, int cli)
@@ -152,19 +181,138 @@ int smtp_send_mail (int sockfd, struct mail_object *mail, int cli)
     return ret;
 }
 
+/* envelope_alloc - allocate memory for mail envelope, from session *
+ *                  arena if there is one                           */
+static void *envelope_alloc (struct mail_object *mail, size_t size)
+{
+    if (NULL == smtp_arena)
+        return malloc(size);
+
+    mail->in_arena = 1;
+    return arena_alloc(smtp_arena, size);
+}
+
+/* rcpt_hash - case-insensitive hash of recipient address (FNV-1a) */
+static uint32_t rcpt_hash (const char *rcpt)
+{
+    uint32_t h = 2166136261u;
+
+    for (; '\0' != *rcpt; ++rcpt) {
+        h ^= (unsigned char) tolower((unsigned char) *rcpt);
+        h *= 16777619u;
+    }
+
+    return h;
+}
+
+/* rcpt_set_find - find recipient's slot in recipients set, or the empty *
+ *                 one, where it belongs                                 */
+static size_t rcpt_set_find (struct mail_object *mail, const char *rcpt)
+{
+    size_t i = rcpt_hash(rcpt) & (rcpt_set.size - 1);
+
+    while (0 != rcpt_set.slots[i] &&
+           0 != strcasecmp(mail->rcpt_to[rcpt_set.slots[i]-1], rcpt))
+        i = (i + 1) & (rcpt_set.size - 1);
+
+    return i;
+}
+
+/* rcpt_set_grow - enlarge recipients set and fill it with recipients *
+ *                 of mail, returns 0 on success                       */
+static int rcpt_set_grow (struct mail_object *mail)
+{
+    size_t i, size = RCPT_SET_MIN;
+    size_t *slots;
+
+    while (size < 2 * (mail->no_rcpt + 1))
+        size *= 2;
+
+    if (NULL == (slots = calloc(size, sizeof(size_t))))
+        return -1;
+    free(rcpt_set.slots);
+    rcpt_set.slots = slots;
+    rcpt_set.size = size;
+
+    for (i = 0; i < mail->no_rcpt; ++i)
+        rcpt_set.slots[rcpt_set_find(mail, mail->rcpt_to[i])] = i + 1;
+
+    return 0;
+}
+
+/* mail_add_rcpt - append recipient to mail object, array of recipients  *
+ *                 grows geometrically; returns 0 if recipient was added, *
+ *                 1 if it is a duplicate (smtp_rcpt_dedup is set) and    *
+ *                 -1 if there is no memory                               */
+static int mail_add_rcpt (struct mail_object *mail, const char *rcpt)
+{
+    size_t cap, slot = 0;
+    char **rcpt_to;
+
+    if (smtp_rcpt_dedup) {
+        /* new mail, forget recipients of previous one */
+        if (0 == mail->no_rcpt && NULL != rcpt_set.slots)
+            memset(rcpt_set.slots, 0, rcpt_set.size * sizeof(size_t));
+
+        if (2 * (mail->no_rcpt + 1) > rcpt_set.size &&
+            0 != rcpt_set_grow(mail))
+            return -1;
+
+        slot = rcpt_set_find(mail, rcpt);
+        if (0 != rcpt_set.slots[slot])
+            return 1;
+    }
+
+    if (mail->no_rcpt == mail->rcpt_cap) {
+        cap = (0 == mail->rcpt_cap) ? RCPT_START_CAP : 2 * mail->rcpt_cap;
+        if (NULL == (rcpt_to = envelope_alloc(mail, cap * sizeof(char *))))
+            return -1;
+
+        if (mail->no_rcpt > 0)
+            memcpy(rcpt_to, mail->rcpt_to, mail->no_rcpt * sizeof(char *));
+        if (!mail->in_arena)
+            free(mail->rcpt_to);
+        mail->rcpt_to = rcpt_to;
+        mail->rcpt_cap = cap;
+    }
+
+    mail->rcpt_to[mail->no_rcpt] = envelope_alloc(mail, strlen(rcpt)+1);
+    if (NULL == mail->rcpt_to[mail->no_rcpt])
+        return -1;
+    strcpy(mail->rcpt_to[mail->no_rcpt], rcpt);
+
+    if (smtp_rcpt_dedup)
+        rcpt_set.slots[slot] = mail->no_rcpt + 1;
+    mail->no_rcpt += 1;
+
+    return 0;
+}
+
+/* drop_mail - free mail object, whose receipt was abandoned, and give *
+ *             its envelope back to session arena                      */
+static void drop_mail (struct mail_object *mail, struct arena_mark *mark)
+{
+    if (NULL != smtp_hooks.drop)
+        smtp_hooks.drop(mail);
+    free_mail_object(mail);
+    if (NULL != smtp_arena)
+        arena_reset(smtp_arena, mark);
+}
+
 /* smtp_recv_mail - receive mail object from connected socket *
  *                  (SMTP server)                             */
 int smtp_recv_mail (int sockfd, struct mail_object *mail, char *filename,
                     int srv)
 {
-    int ret, cmd_ret;
-    unsigned int i;
-    char **temp_rcpt;
+    int ret, cmd_ret, added;
     struct smtp_command cmd;
     ssize_t data_size;          /* size of data received */
     int state = SMTP_CLEAR;     /* SMTP server states */
+    struct arena_mark mark;     /* arena position before this mail */
 
     bzero(mail, sizeof(struct mail_object));
+    if (NULL != smtp_arena)
+        arena_mark(smtp_arena, &mark);
 
     /* sent welcome reply, if it is a new session */
     if (SMTP_SRV_NEW == srv) {
@@ -181,15 +329,23 @@ int smtp_recv_mail (int sockfd, struct mail_object *mail, char *filename,
     for (;;) {
         /* receiving mail object data */
         if (SMTP_DATA == state) {
+            PROBE0(data__start);
+            data_mail = mail;
             data_size = smtp_recv_mail_data(sockfd, &(mail->data), NULL);
+            data_mail = NULL;
             if (data_size <= 0) {
+                drop_mail(mail, &mark);
                 close(sockfd);
                 return ERECVERR;
             }
             mail->data_size = data_size;
+            PROBE1(data__end, data_size);
 
             /* save mail to disk */
-            if (0 == save_mail_to_file(mail, filename)) {
+            PROBE1(spool__start, data_size);
+            ret = smtp_hooks.save(mail, filename);
+            PROBE1(spool__done, ret);
+            if (0 == ret) {
                 smtp_send_reply(sockfd, R250, NULL, 0);     /* mail accepted */
                 return 0;
             }
@@ -204,9 +360,11 @@ int smtp_recv_mail (int sockfd, struct mail_object *mail, char *filename,
 
         /* receiving command */
         if (0 > (cmd_ret = smtp_recv_command(sockfd, &cmd))) {
+            drop_mail(mail, &mark);
             close(sockfd);
             return ERECVERR;
         }
+        PROBE1(command, cmd.code);
 
         switch (state) {
             case SMTP_CLEAR:    /* new SMTP session */
@@ -257,7 +415,7 @@ int smtp_recv_mail (int sockfd, struct mail_object *mail, char *filename,
                         break;
                     }
 
-                    if (NULL == (mail->mail_from = malloc(strlen(cmd.data)+1)))
+                    if (NULL == (mail->mail_from = envelope_alloc(mail, strlen(cmd.data)+1)))
                     {
                         /* insufficient system storage */
                         ret = smtp_send_reply(sockfd, R452, NULL, 0);
@@ -265,6 +423,8 @@ int smtp_recv_mail (int sockfd, struct mail_object *mail, char *filename,
                     }
                     state = SMTP_MAIL;                  /* MAIL received */
                     strcpy(mail->mail_from, cmd.data);
+                    if (NULL != smtp_hooks.envelope)
+                        smtp_hooks.envelope(mail);
                     ret = smtp_send_reply(sockfd, R250, NULL, 0);  /* OK */
                 }
                 else if (QUIT == cmd.code) {
@@ -298,34 +458,25 @@ int smtp_recv_mail (int sockfd, struct mail_object *mail, char *filename,
                         break;
                     }
 
-                    if (NULL == (mail->rcpt_to = malloc(sizeof(char *)))) {
-                        /* insufficient system storage */
-                        ret = smtp_send_reply(sockfd, R452, NULL, 0);
-                        break;
-                    }
-                    if (NULL ==
-                        (mail->rcpt_to[0] = malloc(strlen(cmd.data)+1)))
-                    {
-                        free(mail->rcpt_to);
-                        mail->rcpt_to = NULL;
+                    if (0 != mail_add_rcpt(mail, cmd.data)) {
                         /* insufficient system storage */
                         ret = smtp_send_reply(sockfd, R452, NULL, 0);
                         break;
                     }
                     state = SMTP_RCPT;                  /* RCPT received */
-                    strcpy(mail->rcpt_to[0], cmd.data);
-                    mail->no_rcpt = 1;
+                    if (NULL != smtp_hooks.envelope)
+                        smtp_hooks.envelope(mail);
                     ret = smtp_send_reply(sockfd, R250, NULL, 0);  /* OK */
                 }
                 else if (QUIT == cmd.code) {
                     smtp_send_reply(sockfd, R221, NULL, 0);
                     close(sockfd);
-                    free_mail_object(mail);
+                    drop_mail(mail, &mark);
 
                     return EQUITRECV;   /* mail not received, client quits */
                 }
                 else if (RSET == cmd.code) {
-                    free_mail_object(mail);
+                    drop_mail(mail, &mark);
                     state = SMTP_EHLO;
                     ret = smtp_send_reply(sockfd, R250, NULL, 0); /* OK */
                 }
@@ -351,29 +502,16 @@ int smtp_recv_mail (int sockfd, struct mail_object *mail, char *filename,
                         ret = smtp_send_reply(sockfd, R455, NULL, 0);
                         break;
                     }
-                    /* next recipient */
-                    temp_rcpt = mail->rcpt_to;
-                    mail->rcpt_to = malloc((mail->no_rcpt+1) * sizeof(char *));
-                    if (NULL == mail->rcpt_to) {
-                        mail->rcpt_to = temp_rcpt;
-                        /* insufficient system storage */
-                        ret = smtp_send_reply(sockfd, R452, NULL, 0);
-                        break;
-                    }
-
-                    for (i = 0; i < mail->no_rcpt; ++i)
-                        mail->rcpt_to[i] = temp_rcpt[i];
-                    free(temp_rcpt);
-                    temp_rcpt = NULL;
-
-                    mail->rcpt_to[mail->no_rcpt] = malloc(strlen(cmd.data)+1);
-                    if (NULL == mail->rcpt_to[mail->no_rcpt]) {
+                    /* next recipient (duplicate one is accepted, *
+                     * but not added again)                        */
+                    added = mail_add_rcpt(mail, cmd.data);
+                    if (added < 0) {
                         /* insufficient system storage */
                         ret = smtp_send_reply(sockfd, R452, NULL, 0);
                         break;
                     }
-                    strcpy(mail->rcpt_to[mail->no_rcpt], cmd.data);
-                    mail->no_rcpt += 1;
+                    if (0 == added && NULL != smtp_hooks.envelope)
+                        smtp_hooks.envelope(mail);
 
                     ret = smtp_send_reply(sockfd, R250, NULL, 0);   /* OK */
                 }
@@ -385,12 +523,12 @@ int smtp_recv_mail (int sockfd, struct mail_object *mail, char *filename,
                 else if (QUIT == cmd.code) {
                     smtp_send_reply(sockfd, R221, NULL, 0);
                     close(sockfd);
-                    free_mail_object(mail);
+                    drop_mail(mail, &mark);
 
                     return EQUITRECV;   /* mail not received, client quits */
                 }
                 else if (RSET == cmd.code) {
-                    free_mail_object(mail);
+                    drop_mail(mail, &mark);
                     state = SMTP_EHLO;
                     ret = smtp_send_reply(sockfd, R250, NULL, 0);   /* OK */
                 }
@@ -437,7 +575,7 @@ int smtp_recv_mail (int sockfd, struct mail_object *mail, char *filename,
         }
 
         if (0 != ret) {
-            free_mail_object(mail);
+            drop_mail(mail, &mark);
             close(sockfd);
             return ESENDERR;
         }
@@ -474,7 +612,8 @@ again:
 
 /* smtp_recv_mail_data - accepts mail data from client, it will continue     *
  *                       receiving until it gets .CRLF or system runs out of *
- *                       memory.                                             */
+ *                       memory. Received data are passed to data hook in    *
+ *                       chunks (of at least BUFFSIZE), as they arrive.      */
 
 /* data receipt states */
 #define D_START     0       /* clear, lookin for CR */
@@ -486,7 +625,7 @@ again:
 ssize_t smtp_recv_mail_data (int sockfd, char **buf_ptr, size_t *buf_size)
 {
     int rc, state;
-    size_t n, buflen;
+    size_t n, buflen, passed = 0;
     char c, *ptr, *buf, *temp_buf;
 
     if (NULL == (buf = malloc(MAIL_START_LEN * sizeof(char))))
@@ -543,7 +682,8 @@ ssize_t smtp_recv_mail_data (int sockfd, char **buf_ptr, size_t *buf_size)
         }
         else {
             *buf_ptr = NULL;
-            *buf_size = 0;
+            if (NULL != buf_size)
+                *buf_size = 0;
             free(buf);
 
             if (rc == 1)
@@ -554,6 +694,13 @@ ssize_t smtp_recv_mail_data (int sockfd, char **buf_ptr, size_t *buf_size)
 
         ++n;
 
+        /* pass received data, except for possible start of ".CRLF" */
+        if (NULL != data_mail && NULL != smtp_hooks.data &&
+            n - passed >= BUFFSIZE + 2) {
+            smtp_hooks.data(data_mail, buf+passed, n-2-passed, 0);
+            passed = n-2;
+        }
+
         if (n == buflen) {
             buflen *= 2;
             temp_buf = buf;
@@ -569,6 +716,9 @@ ssize_t smtp_recv_mail_data (int sockfd, char **buf_ptr, size_t *buf_size)
         }
     }
 
+    if (NULL != data_mail && NULL != smtp_hooks.data)
+        smtp_hooks.data(data_mail, buf+passed, n-passed, 1);
+
     *buf_ptr = buf;
     if (NULL != buf_size)
         *buf_size = buflen;
@@ -597,7 +747,12 @@ int save_mail_to_file (struct mail_object *mail, const char *filename)
     for (i = 0; i < mail->data_size; ++i)
         putc(mail->data[i], fp);
 
-    fclose(fp);
+    if (ferror(fp)) {
+        fclose(fp);
+        return EFWRITE;     /* can't write file */
+    }
+    if (0 != fclose(fp))
+        return EFWRITE;
 
     return 0;
 }
@@ -676,19 +831,133 @@ int load_mail_from_file (const char *filename, struct mail_object *mail)
     return 0;
 }
 
-static int mail_file_filter (const struct dirent *en) {
-    struct stat buf;
+/* map_line - duplicate one '\n' terminated line of mapped mail file, *
+ *            advances *pos past the line; returns NULL at end of map  */
+static char *map_line (const char *map, size_t size, size_t *pos)
+{
+    char *eol, *line;
+    size_t len;
+
+    if (*pos >= size)
+        return NULL;
+    if (NULL == (eol = memchr(map + *pos, '\n', size - *pos)))
+        return NULL;
+
+    len = eol - (map + *pos);
+    if (NULL == (line = malloc(len+1)))
+        return NULL;
+    memcpy(line, map + *pos, len);
+    line[len] = '\0';
+    *pos += len+1;
+
+    return line;
+}
+
+/* parse_mail_buffer - parse mail object stored in memory (in the same   *
+ *                     format as mail file), mail body is not copied but *
+ *                     points into given buffer                          */
+int parse_mail_buffer (const char *buf, size_t size, struct mail_object *mail)
+{
+    char *line;
+    size_t pos = 0, i;
+
+    bzero(mail, sizeof(struct mail_object));
 
-    stat(en->d_name, &buf);
+    /* get MAIL FROM: */
+    if (NULL == (mail->mail_from = map_line(buf, size, &pos)))
+        return EUEXEOF;
+
+    /* get RCPT TO: */
+    if (NULL == (line = map_line(buf, size, &pos))) {
+        free_mail_object(mail);
+        return EUEXEOF;
+    }
+    mail->no_rcpt = atoi(line);
+    free(line);
+
+    if (NULL == (mail->rcpt_to = calloc(mail->no_rcpt, sizeof(char *)))) {
+        free_mail_object(mail);
+        return ENOMEM;
+    }
+
+    for (i = 0; i < mail->no_rcpt; ++i) {
+        if (NULL == (mail->rcpt_to[i] = map_line(buf, size, &pos))) {
+            free_mail_object(mail);
+            return EUEXEOF;
+        }
+    }
+
+    /* get DATA, the rest of the buffer */
+    mail->data = (char *) buf + pos;
+    mail->data_size = size - pos;
+
+    return 0;
+}
+
+/* map_mail_from_fd - loads mail object from open file (or memfd), mail *
+ *                    body is not copied but points into read-only       *
+ *                    mapping of the file (released by free_mail_object()) */
+int map_mail_from_fd (int fd, struct mail_object *mail)
+{
+    int ret;
+    char *map;
+    struct stat st;
+
+    bzero(mail, sizeof(struct mail_object));
 
-    /* mails are stored in regular files */
-    if (S_ISREG(buf.st_mode))
+    if (fstat(fd, &st) < 0 || 0 == st.st_size)
+        return EUEXEOF;
+
+    /* mapping holds its own reference to the file */
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    if (MAP_FAILED == map)
+        return EMMAP;
+
+    /* mail is read once from the beginning to the end */
+    madvise(map, st.st_size, MADV_SEQUENTIAL);
+
+    if (0 != (ret = parse_mail_buffer(map, st.st_size, mail))) {
+        munmap(map, st.st_size);
+        return ret;
+    }
+    mail->map_addr = map;
+    mail->map_size = st.st_size;
+
+    return 0;
+}
+
+/* map_mail_from_file - loads mail object from file (see map_mail_from_fd) */
+int map_mail_from_file (const char *filename, struct mail_object *mail)
+{
+    int fd, ret;
+
+    bzero(mail, sizeof(struct mail_object));
+
+    if ((fd = open(filename, O_RDONLY)) < 0)
+        return EFOPEN;  /* can't open file */
+
+    ret = map_mail_from_fd(fd, mail);
+    close(fd);
+
+    return ret;
+}
+
+static int mail_file_filter (const struct dirent *en) {
+    /* mails are stored in regular files (d_name is not relative to *
+     * current directory, so it can't be stat()ed here), names      *
+     * starting with dot (".", ".." or hidden files) are skipped    */
+    if ('.' == en->d_name[0])
+        return 0;
+    else if (DT_REG == en->d_type || DT_UNKNOWN == en->d_type)
         return 1;
     else
         return 0;
 }
 
-/* send_mails_from_dir - send all mail stored in given directory */
+/* send_mails_from_dir - send all mail stored in given directory, in one *
+ *                       session; files, which cannot be loaded, are     *
+ *                       skipped and delivery stops when mail server is  *
+ *                       unavailable (mails are left for next attempt)   */
 int send_mails_from_dir (const char *dirname, struct sockaddr_in *srv_sock)
 {
     int n, ret = 0;
@@ -715,39 +984,58 @@ int send_mails_from_dir (const char *dirname, struct sockaddr_in *srv_sock)
     else if (0 == n)
         return 0;   /* no mails in directory */
     else {
-        int cnt, srv, srvfd;
-        char *fpath = Malloc(FNMAXLEN);
-
-        srvfd = Socket(AF_INET, SOCK_STREAM, 0);
-        Connect(srvfd, (SA *) srv_sock, sizeof(*srv_sock));
-        if (1 == n)
-            srv = SMTP_CLI_NEW | SMTP_CLI_LST;
-        else
-            srv = SMTP_CLI_NEW | SMTP_CLI_CON;
+        int cnt, srv = SMTP_CLI_NEW | SMTP_CLI_CON, srvfd = -1;
+        char fpath[FNMAXLEN];
+        struct smtp_reply rply;
 
         for (cnt = 0; cnt < n; ++cnt) {
-            snprintf(fpath, FNMAXLEN, "%s/%s", dirname, eps[cnt]->d_name);
-
-            if (load_mail_from_file(fpath, &mail)) {
-                err_sys("cannot load mail");
+            if (snprintf(fpath, FNMAXLEN, "%s/%s", dirname, eps[cnt]->d_name)
+                >= FNMAXLEN || map_mail_from_file(fpath, &mail)) {
+                err_msg("cannot load mail %s, skipped", fpath);
                 continue;
             }
 
+            /* connect on first mail, which can be sent */
+            if (srvfd < 0) {
+                if ((srvfd = socket(AF_INET, SOCK_STREAM, 0)) < 0 ||
+                    connect(srvfd, (SA *) srv_sock, sizeof(*srv_sock)) < 0) {
+                    err_ret("cannot connect to mail server");
+                    if (srvfd >= 0)
+                        close(srvfd);
+                    srvfd = -1;
+                    free_mail_object(&mail);
+                    break;
+                }
+            }
+
             if (0 == smtp_send_mail(srvfd, &mail, srv)) {
+                if (NULL != smtp_hooks.sent)
+                    smtp_hooks.sent(fpath);
                 remove(fpath);
                 ++ret;
+                srv = SMTP_CLI_NXT | SMTP_CLI_CON;
             }
             else {
-                /* mail still cannot be sent, leave it */;
+                /* mail still cannot be sent, leave it (and the rest of *
+                 * them, session was closed by smtp_send_mail())         */
+                srvfd = -1;
+                free_mail_object(&mail);
+                break;
             }
 
             free_mail_object(&mail);
+        }
 
-            if (n-2 == cnt)
-                srv = SMTP_CLI_NXT | SMTP_CLI_LST;
-            else
-                srv = SMTP_CLI_NXT | SMTP_CLI_CON;
+        /* end session */
+        if (srvfd >= 0) {
+            if (0 == smtp_send_command(srvfd, QUIT, NULL))
+                smtp_recv_reply(srvfd, &rply);
+            close(srvfd);
         }
+
+        for (cnt = 0; cnt < n; ++cnt)
+            free(eps[cnt]);
+        free(eps);
     }
 
     return ret;  /* return number of sent mails */
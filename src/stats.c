@@ -0,0 +1,383 @@
+/**
+ * File:        src/stats.c
+ * Description: Pipeline statistics. Every process records counters and
+ *              latencies of pipeline stages into its own slot of shared
+ *              memory (mapped before the first fork), so recording takes
+ *              no locks; slots are summed up when statistics are read
+ *              (SIGUSR1 logs them, control socket prints them).
+ * Author:      Tomasz Pieczerak (tphaster)
+ */
+
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "stats.h"
+#include "system.h"
+
+
+/** Global variables **/
+volatile sig_atomic_t stats_request = 0;
+
+/* spool write measured by stats_save_mail() */
+int (*stats_save) (struct mail_object *mail, const char *filename) = NULL;
+
+/* stage times of mail object being handled (NULL: none), recorded *
+ * times are added to it                                            */
+uint64_t *stats_stages = NULL;
+
+
+/** Local variables **/
+static struct stats_area *area;     /* shared memory (NULL: no statistics) */
+static struct stats_slot *slots;    /* slots of processes (in area) */
+static struct stats_slot *my_slot;  /* slot of this process */
+static pid_t my_pid;                /* process, which my_slot belongs to */
+
+static const char *stage_names[STAGES] = {
+    "recv", "spool", "encr", "sign", "decr", "vrfy", "connect", "send"
+};
+
+static const char *counter_names[COUNTERS] = {
+    "connections_accepted", "connections_refused", "sessions_closed",
+    "mails_received", "mails_encrypted", "mails_signed", "mails_decrypted",
+    "mails_verified", "crypto_failures", "mails_forwarded", "mails_unsent",
+    "bytes_in", "bytes_out", "log_dropped"
+};
+
+
+/* stats_init - map shared memory for statistics of all processes */
+void stats_init (void)
+{
+    area = mmap(NULL, sizeof(struct stats_area), PROT_READ | PROT_WRITE,
+                MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (MAP_FAILED == area)
+        err_sys("mmap error");
+    slots = area->slots;
+}
+
+/* stats_slot - find slot of calling process, free slot or the one of *
+ *              terminated process is taken over (its values are kept) */
+static struct stats_slot *stats_slot (void)
+{
+    int i;
+    pid_t pid = getpid(), owner;
+    struct stats_slot *s;
+
+    if (NULL == area)
+        return NULL;
+    if (pid == my_pid)
+        return my_slot;
+
+    my_pid = pid;
+    my_slot = NULL;
+
+    /* start at different slot in every process, not to check the same *
+     * owners again and again                                           */
+    for (i = 0; i < STATS_SLOTS; ++i) {
+        s = &(slots[(pid + i) % STATS_SLOTS]);
+        owner = __atomic_load_n(&(s->pid), __ATOMIC_ACQUIRE);
+
+        if (owner != pid) {
+            if (0 != owner && (0 == kill(owner, 0) || ESRCH != errno))
+                continue;   /* live process owns it */
+            if (!__atomic_compare_exchange_n(&(s->pid), &owner, pid, 0,
+                                             __ATOMIC_ACQ_REL,
+                                             __ATOMIC_ACQUIRE))
+                continue;   /* somebody else was faster */
+        }
+
+        my_slot = s;
+        break;
+    }
+
+    return my_slot;
+}
+
+/* stats_slot_no - number of calling process's slot (or -1), other per- *
+ *                 process areas of shared memory may be indexed by it  */
+int stats_slot_no (void)
+{
+    struct stats_slot *s = stats_slot();
+
+    return (NULL == s) ? -1 : (int) (s - slots);
+}
+
+/* stats_now - monotonic time in microseconds */
+uint64_t stats_now (void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* hist_bucket - bucket of value in log-bucketed histogram */
+static unsigned int hist_bucket (uint64_t v)
+{
+    int e;
+
+    if (v < HIST_SUB)
+        return v;
+
+    e = 63 - __builtin_clzll(v);    /* highest bit set */
+    if (e >= HIST_MAX_BITS)
+        return HIST_BUCKETS - 1;
+
+    return (e - HIST_SUB_BITS + 1) * HIST_SUB +
+           ((v >> (e - HIST_SUB_BITS)) & (HIST_SUB - 1));
+}
+
+/* hist_value - highest value counted in bucket */
+static uint64_t hist_value (unsigned int b)
+{
+    unsigned int e;
+
+    if (b < HIST_SUB)
+        return b;
+
+    e = b / HIST_SUB + HIST_SUB_BITS - 1;
+    return (((uint64_t) HIST_SUB + b % HIST_SUB + 1) << (e - HIST_SUB_BITS))
+           - 1;
+}
+
+/* hist_add - add to counter of own slot (there is one writer only) */
+static void hist_add (uint64_t *cnt, uint64_t v)
+{
+    __atomic_store_n(cnt, __atomic_load_n(cnt, __ATOMIC_RELAXED) + v,
+                     __ATOMIC_RELAXED);
+}
+
+/* stats_record - record latency of pipeline stage (it is also added to *
+ *                stats_stages, if it is set)                           */
+void stats_record (int stage, uint64_t usec)
+{
+    struct stats_slot *s;
+    struct stats_hist *h;
+
+    if (stage < 0 || stage >= STAGES)
+        return;
+    if (NULL != stats_stages)
+        stats_stages[stage] += usec;
+    if (NULL == (s = stats_slot()))
+        return;     /* statistics are not vital */
+
+    h = &(s->hist[stage]);
+    hist_add(&(h->buckets[hist_bucket(usec)]), 1);
+    hist_add(&(h->sum), usec);
+    if (usec > h->max)
+        __atomic_store_n(&(h->max), usec, __ATOMIC_RELAXED);
+    hist_add(&(h->count), 1);
+}
+
+/* stats_count - add to counter */
+void stats_count (int counter, uint64_t n)
+{
+    struct stats_slot *s;
+
+    if (counter < 0 || counter >= COUNTERS || NULL == (s = stats_slot()))
+        return;
+
+    hist_add(&(s->counters[counter]), n);
+}
+
+/* stats_gauge - set gauge (only one process is supposed to set it) */
+void stats_gauge (int gauge, uint64_t v)
+{
+    if (gauge < 0 || gauge >= GAUGES || NULL == area)
+        return;
+
+    __atomic_store_n(&(area->gauges[gauge]), v, __ATOMIC_RELAXED);
+}
+
+/* stats_counter - sum up counter of all processes */
+uint64_t stats_counter (int counter)
+{
+    int i;
+    uint64_t sum = 0;
+
+    if (NULL == area)
+        return 0;
+
+    for (i = 0; i < STATS_SLOTS; ++i)
+        sum += __atomic_load_n(&(slots[i].counters[counter]), __ATOMIC_RELAXED);
+
+    return sum;
+}
+
+/* stats_gauge_value - current value of gauge */
+uint64_t stats_gauge_value (int gauge)
+{
+    if (NULL == area)
+        return 0;
+
+    return __atomic_load_n(&(area->gauges[gauge]), __ATOMIC_RELAXED);
+}
+
+/* stats_collect - sum up histograms of stage from all processes */
+void stats_collect (int stage, struct stats_hist *hist)
+{
+    int i, b;
+    uint64_t v;
+    const struct stats_hist *h;
+
+    memset(hist, 0, sizeof(struct stats_hist));
+    if (NULL == area)
+        return;
+
+    for (i = 0; i < STATS_SLOTS; ++i) {
+        h = &(slots[i].hist[stage]);
+        if (0 == __atomic_load_n(&(h->count), __ATOMIC_RELAXED))
+            continue;
+
+        for (b = 0; b < HIST_BUCKETS; ++b) {
+            v = __atomic_load_n(&(h->buckets[b]), __ATOMIC_RELAXED);
+            hist->buckets[b] += v;
+            hist->count += v;   /* consistent with buckets */
+        }
+        hist->sum += __atomic_load_n(&(h->sum), __ATOMIC_RELAXED);
+        v = __atomic_load_n(&(h->max), __ATOMIC_RELAXED);
+        if (v > hist->max)
+            hist->max = v;
+    }
+}
+
+/* stats_percentile - value, which q-th part (0 < q <= 1) of histogram's *
+ *                    values does not exceed                             */
+uint64_t stats_percentile (const struct stats_hist *hist, double q)
+{
+    unsigned int b;
+    uint64_t seen = 0, rank;
+
+    if (0 == hist->count)
+        return 0;
+
+    rank = (uint64_t) (q * hist->count);
+    if (rank < q * hist->count || 0 == rank)
+        ++rank;     /* rounded up */
+
+    for (b = 0; b < HIST_BUCKETS; ++b) {
+        seen += hist->buckets[b];
+        if (seen >= rank)
+            break;
+    }
+
+    if (b >= HIST_BUCKETS || hist_value(b) > hist->max)
+        return hist->max;
+    return hist_value(b);
+}
+
+/* stats_count_below - number of histogram's values not exceeding usec *
+ *                     (bucket counts if its highest value does)        */
+uint64_t stats_count_below (const struct stats_hist *hist, uint64_t usec)
+{
+    unsigned int b;
+    uint64_t n = 0;
+
+    for (b = 0; b < HIST_BUCKETS && hist_value(b) <= usec; ++b)
+        n += hist->buckets[b];
+
+    return n;
+}
+
+/* stats_stage_name - name of pipeline stage */
+const char *stats_stage_name (int stage)
+{
+    if (stage < 0 || stage >= STAGES)
+        return "unknown";
+    return stage_names[stage];
+}
+
+/* stats_log - log latency percentiles of all stages */
+void stats_log (void)
+{
+    int i;
+    struct stats_hist h;
+
+    for (i = 0; i < STAGES; ++i) {
+        stats_collect(i, &h);
+        if (0 == h.count)
+            continue;
+
+        err_msg("stats: %-7s n=%llu p50=%lluus p99=%lluus p999=%lluus "
+                "max=%lluus", stats_stage_name(i),
+                (unsigned long long) h.count,
+                (unsigned long long) stats_percentile(&h, 0.5),
+                (unsigned long long) stats_percentile(&h, 0.99),
+                (unsigned long long) stats_percentile(&h, 0.999),
+                (unsigned long long) h.max);
+    }
+}
+
+/* stats_unsent - number of mails waiting for unsent service: measured *
+ *                by the service after each pass, mails left for it    *
+ *                since then are added                                 */
+uint64_t stats_unsent (void)
+{
+    uint64_t unsent = stats_counter(CNT_UNSENT);
+    uint64_t mark = stats_gauge_value(GAUGE_UNSENT_MARK);
+
+    return stats_gauge_value(GAUGE_UNSENT_DIR) +
+           stats_gauge_value(GAUGE_UNSENT_LOG) +
+           (unsent > mark ? unsent - mark : 0);
+}
+
+/* stats_print - print counters, one 'name value' pair per line */
+void stats_print (FILE *fp)
+{
+    int i;
+    uint64_t accepted, closed;
+
+    for (i = 0; i < COUNTERS; ++i)
+        fprintf(fp, "%s %llu\n", counter_names[i],
+                (unsigned long long) stats_counter(i));
+
+    /* sessions, which crashed, are still counted as active */
+    accepted = stats_counter(CNT_ACCEPTED);
+    closed = stats_counter(CNT_CLOSED);
+    fprintf(fp, "connections_active %llu\n",
+            (unsigned long long) (accepted > closed ? accepted - closed : 0));
+    fprintf(fp, "subprocesses %d\n", (int) sproc_counter);
+    fprintf(fp, "subprocesses_max %d\n", MAXSUBPROC);
+    fprintf(fp, "unsent_queue %llu\n", (unsigned long long) stats_unsent());
+}
+
+/* stats_print_hist - print latency statistics of all stages */
+void stats_print_hist (FILE *fp)
+{
+    int i;
+    struct stats_hist h;
+
+    for (i = 0; i < STAGES; ++i) {
+        stats_collect(i, &h);
+        fprintf(fp, "%s count=%llu mean=%llu p50=%llu p99=%llu p999=%llu "
+                "max=%llu\n", stats_stage_name(i),
+                (unsigned long long) h.count,
+                (unsigned long long) (h.count ? h.sum / h.count : 0),
+                (unsigned long long) stats_percentile(&h, 0.5),
+                (unsigned long long) stats_percentile(&h, 0.99),
+                (unsigned long long) stats_percentile(&h, 0.999),
+                (unsigned long long) h.max);
+    }
+}
+
+/* stats_save_mail - save mail object with stats_save hook and record *
+ *                   time of spool write (SMTP Server hook)           */
+int stats_save_mail (struct mail_object *mail, const char *filename)
+{
+    int ret;
+    uint64_t t = stats_now();
+
+    ret = stats_save(mail, filename);
+    stats_record(STAGE_SPOOL, stats_now() - t);
+
+    return ret;
+}
+
+/* sig_usr1 - request statistics to be logged */
+void sig_usr1 (int signo __attribute__((__unused__)))
+{
+    stats_request = 1;
+}
@@ -0,0 +1,186 @@
+/**
+ * File:        src/trace.c
+ * Description: Message tracing. Every accepted mail object gets unique
+ *              identifier, which names its spooled file, and the way of
+ *              the mail through the gateway (receipt, processing steps,
+ *              forwarding) is written to event log as JSON lines.
+ * Author:      Tomasz Pieczerak (tphaster)
+ */
+
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/random.h>
+#include "config.h"
+#include "stats.h"
+#include "system.h"
+#include "trace.h"
+
+
+/** Global variables **/
+
+/* spool write wrapped by trace_save_mail() */
+int (*trace_save) (struct mail_object *mail, const char *filename) = NULL;
+
+
+/** Local variables **/
+static int trace_fd = -1;       /* event log (-1: events are not logged) */
+static pid_t id_pid;            /* process, which id_seq belongs to */
+static uint64_t id_seq;         /* sequence of identifiers */
+
+
+/* trace_init - open event log, if it is set in configuration */
+void trace_init (void)
+{
+    if (NULL == conf.event_log)
+        return;
+
+    /* every event is written at once, lines of processes don't mix */
+    trace_fd = open(conf.event_log, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC,
+                    0640);
+    if (trace_fd < 0)
+        err_ret("cannot open event log %s", conf.event_log);
+}
+
+/* trace_id - generate unique message identifier (TRACE_IDLEN bytes): *
+ *            microseconds since the Epoch and per-process sequence,   *
+ *            which starts at random number                            */
+void trace_id (char *id)
+{
+    struct timespec ts;
+    uint64_t usec;
+
+    if (getpid() != id_pid) {
+        id_pid = getpid();
+        if (getrandom(&id_seq, sizeof(id_seq), 0) != sizeof(id_seq))
+            id_seq = ((uint64_t) id_pid << 24) ^ stats_now();
+    }
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    usec = (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+
+    snprintf(id, TRACE_IDLEN, "%013llx%011llx", (unsigned long long) usec,
+             (unsigned long long) (id_seq++ & 0xfffffffffffULL));
+}
+
+/* trace_fn_id - get message identifier (TRACE_IDLEN bytes) from name of *
+ *               its file: without directory, prefix and suffix         */
+void trace_fn_id (const char *fn, char *id)
+{
+    const char *base = strrchr(fn, '/');
+
+    base = (NULL != base) ? base + 1 : fn;
+    if (0 == strncmp(base, TRACE_PREFIX, strlen(TRACE_PREFIX)))
+        base += strlen(TRACE_PREFIX);
+
+    snprintf(id, TRACE_IDLEN, "%.*s", (int) strcspn(base, "."), base);
+}
+
+/* trace_event - write event of mail object spooled in 'fn' (or of the    *
+ *               process, if it is NULL), 'fmt' gives additional members  *
+ *               of JSON object, which are replaced with "truncated":true *
+ *               if they don't fit in the line                            */
+void trace_event (const char *event, const char *fn, const char *fmt, ...)
+{
+    int n, base;
+    char line[TRACE_LINELEN];
+    char stamp[32], id[TRACE_IDLEN];
+    struct timespec ts;
+    struct tm tm;
+    va_list ap;
+
+    if (trace_fd < 0)
+        return;
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    gmtime_r(&ts.tv_sec, &tm);
+    strftime(stamp, sizeof(stamp), "%Y-%m-%dT%H:%M:%S", &tm);
+
+    n = snprintf(line, TRACE_LINELEN, "{\"ts\":\"%s.%06ldZ\",\"event\":\"%s\","
+                 "\"pid\":%d", stamp, ts.tv_nsec / 1000, event, (int) getpid());
+
+    if (NULL != fn) {
+        trace_fn_id(fn, id);
+        n += snprintf(line+n, TRACE_LINELEN-n, ",\"id\":\"%s\"", id);
+    }
+
+    /* (members above are short, so they always fit) */
+    if (NULL != fmt) {
+        base = n;
+        line[n++] = ',';
+        va_start(ap, fmt);
+        n += vsnprintf(line+n, TRACE_LINELEN-n, fmt, ap);
+        va_end(ap);
+
+        /* cut member would make invalid JSON, leave them all out */
+        if (n > TRACE_LINELEN - 3)
+            n = base + sprintf(line+base, ",\"truncated\":true");
+    }
+
+    line[n++] = '}';
+    line[n++] = '\n';
+
+    /* failure of event log mustn't disturb mail processing */
+    writen(trace_fd, line, n);
+}
+
+/* trace_addr - write event with mail address, 'key' is its member name *
+ *              (bytes, which aren't ASCII, are escaped one by one, so   *
+ *              address which isn't UTF-8 gives valid JSON too)          */
+void trace_addr (const char *event, const char *fn, const char *key,
+                 const char *addr)
+{
+    size_t i, n = 0;
+    char esc[2*CONF_MAXLEN];
+
+    if (trace_fd < 0)
+        return;
+
+    /* escape address as JSON string */
+    for (i = 0; '\0' != addr[i] && n < sizeof(esc) - 7; ++i) {
+        if ('"' == addr[i] || '\\' == addr[i]) {
+            esc[n++] = '\\';
+            esc[n++] = addr[i];
+        }
+        else if ((unsigned char) addr[i] < 0x20 ||
+                 (unsigned char) addr[i] >= 0x80)
+            n += snprintf(esc+n, sizeof(esc)-n, "\\u%04x",
+                          (unsigned char) addr[i]);
+        else
+            esc[n++] = addr[i];
+    }
+    esc[n] = '\0';
+
+    trace_event(event, fn, "\"%s\":\"%s\"", key, esc);
+}
+
+/* trace_save_mail - save mail object with trace_save hook, end of mail *
+ *                   data and spool write are logged (SMTP Server hook)  */
+int trace_save_mail (struct mail_object *mail, const char *filename)
+{
+    int ret;
+    uint64_t t;
+
+    trace_event("data", filename, "\"size\":%zu,\"rcpts\":%zu",
+                mail->data_size, mail->no_rcpt);
+
+    t = stats_now();
+    ret = trace_save(mail, filename);
+    trace_event("spool", filename, "\"ok\":%s,\"usec\":%llu",
+                0 == ret ? "true" : "false",
+                (unsigned long long) (stats_now() - t));
+
+    return ret;
+}
+
+/* trace_sent - mail object stored in file was delivered by unsent *
+ *              service (SMTP hook of send_mails_from_dir())        */
+void trace_sent (const char *filename)
+{
+    trace_event("deliver", filename, "\"by\":\"unsent\"");
+}
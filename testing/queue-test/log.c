@@ -0,0 +1,478 @@
+/**
+ * queue-test (log) - log queue test; MAIL, DONE and ACK records are appended,
+ *                    segment is damaged (corrupted and truncated records),
+ *                    then it is checked what queue_scan(), queue_load() and
+ *                    queue_unprocessed() return and what survives
+ *                    queue_compact(); then recovery from segment cut in the
+ *                    middle of record header, compaction running while
+ *                    other processes append and unreadable segment are
+ *                    tested (queue.c is built with its own DEFAULT_QUEUE_DIR
+ *                    and small QSEG_MAXSIZE, see Makefile)
+ */
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include "system.h"
+#include "config.h"
+#include "queue.h"
+#include "smtp.h"
+
+struct config conf;                     /* global configuration */
+volatile sig_atomic_t sproc_counter;    /* (for durable.c) */
+
+#define QT_MAILS    6       /* mails in the test */
+#define QT_RECS     16      /* maximum of records found by scan */
+#define QT_PROCS    8       /* appending processes */
+#define QT_APPENDS  600     /* mails appended by each of them */
+
+/* Mails (index to mail_ids[]) */
+#define M_ACKED     0       /* received, processed and delivered */
+#define M_DONE      1       /* received and processed */
+#define M_RECV      2       /* received only */
+#define M_CORRUPT   3       /* received, payload corrupted */
+#define M_BADHDR    4       /* received, record magic corrupted */
+#define M_TORN      5       /* received, record truncated */
+
+static const char *mail_ids[QT_MAILS] = {
+    "acked", "done", "recv", "corrupt", "badhdr", "torn"
+};
+
+/* struct found - records found by queue_scan() or queue_unprocessed() */
+struct found {
+    struct queue_rec recs[QT_RECS];
+    char ids[QT_RECS][QID_LEN];
+    int n;
+};
+
+static int failed = 0;
+
+/* struct seen - unprocessed mails of appending processes */
+struct seen {
+    int count[QT_PROCS][QT_APPENDS];
+    int other;
+};
+
+static void check (int cond, const char *what);
+static void flip (int fd, size_t off);
+static void make_mail (struct mail_object *mail, const char *id);
+static void append (int type, int m);
+static void append_id (int type, const char *id);
+static void collect (const struct queue_rec *rec, void *arg);
+static void count_seen (const struct queue_rec *rec, void *arg);
+static int find (const struct found *f, int type, int m);
+static int find_id (const struct found *f, int type, const char *id);
+static void check_mail (uint32_t segno, size_t off, int m, const char *what);
+static void clear_queue (void);
+static void test_torn_tail (void);
+static void test_concurrent (void);
+static void test_unreadable (void);
+
+
+int main (void)
+{
+    int fd, i;
+    size_t torn;
+    struct stat st;
+    struct found f;
+    struct mail_object mail;
+    char path[QSEG_FNMAXLEN];
+
+    clear_queue();
+    queue_init();
+
+    /* damaged records lie between good ones, torn one is the last */
+    append(QREC_MAIL, M_ACKED);
+    append(QREC_MAIL, M_DONE);
+    append(QREC_MAIL, M_CORRUPT);
+    append(QREC_MAIL, M_BADHDR);
+    append(QREC_MAIL, M_RECV);
+    append(QREC_DONE, M_ACKED);
+    append(QREC_DONE, M_DONE);
+    append(QREC_ACK, M_ACKED);
+    append(QREC_MAIL, M_TORN);
+
+    bzero(&f, sizeof(f));
+    queue_scan(collect, &f);
+    check(9 == f.n, "all records are scanned");
+    if (9 != f.n)
+        goto end_test;
+
+    /* corrupt payload of one record (its last byte) and magic of *
+     * another one, cut off the end of the last one                */
+    queue_segpath(path, f.recs[0].segno);
+    if ((fd = open(path, O_RDWR)) < 0 || fstat(fd, &st) < 0)
+        err_sys("can't open %s", path);
+
+    i = find(&f, QREC_MAIL, M_CORRUPT);
+    flip(fd, f.recs[i+1].off - 1);
+    i = find(&f, QREC_MAIL, M_BADHDR);
+    flip(fd, f.recs[i].off);
+
+    torn = f.recs[find(&f, QREC_MAIL, M_TORN)].off;
+    if (0 != ftruncate(fd, st.st_size - 10))
+        err_sys("can't truncate %s", path);
+    close(fd);
+
+    /* damaged records are skipped, following ones are found */
+    bzero(&f, sizeof(f));
+    queue_scan(collect, &f);
+    check(6 == f.n, "damaged records are skipped");
+    check(find(&f, QREC_MAIL, M_CORRUPT) < 0, "corrupted record is skipped");
+    check(find(&f, QREC_MAIL, M_BADHDR) < 0, "record with bad magic is skipped");
+    check(find(&f, QREC_MAIL, M_TORN) < 0, "torn record is skipped");
+    check(find(&f, QREC_MAIL, M_RECV) >= 0, "record after damaged is found");
+
+    /* queue_load() */
+    if ((i = find(&f, QREC_MAIL, M_RECV)) >= 0)
+        check_mail(f.recs[i].segno, f.recs[i].off, M_RECV, "MAIL record");
+    if ((i = find(&f, QREC_DONE, M_DONE)) >= 0)
+        check_mail(f.recs[i].segno, f.recs[i].off, M_DONE, "DONE record");
+
+    check(EUEXEOF == queue_load(f.recs[0].segno, torn, &mail),
+          "load of torn record fails");
+    free_mail_object(&mail);
+
+    /* mails of crashed sessions */
+    bzero(&f, sizeof(f));
+    check(1 == queue_unprocessed(collect, &f), "one mail is unprocessed");
+    check(1 == f.n && find(&f, QREC_MAIL, M_RECV) >= 0,
+          "unprocessed mail is the received one");
+    if (1 == f.n)
+        check_mail(f.recs[0].segno, f.recs[0].off, M_RECV, "unprocessed mail");
+
+    /* restart closes the segment, compaction keeps only live records */
+    queue_init();
+    queue_compact();
+
+    queue_segpath(path, 1);
+    check(0 != access(path, F_OK), "compacted segment is deleted");
+
+    bzero(&f, sizeof(f));
+    queue_scan(collect, &f);
+    check(2 == f.n, "two records survive compaction");
+    check(find(&f, QREC_MAIL, M_RECV) >= 0, "unprocessed mail survives");
+    check(find(&f, QREC_DONE, M_DONE) >= 0, "undelivered mail survives");
+    check(find(&f, QREC_MAIL, M_DONE) < 0, "superseded MAIL record is dropped");
+    check(find(&f, QREC_DONE, M_ACKED) < 0, "delivered mail is dropped");
+    check(find(&f, QREC_ACK, M_ACKED) < 0, "ACK record is dropped");
+
+    if ((i = find(&f, QREC_MAIL, M_RECV)) >= 0)
+        check_mail(f.recs[i].segno, f.recs[i].off, M_RECV, "copied MAIL");
+    if ((i = find(&f, QREC_DONE, M_DONE)) >= 0)
+        check_mail(f.recs[i].segno, f.recs[i].off, M_DONE, "copied DONE");
+
+    bzero(&f, sizeof(f));
+    check(1 == queue_unprocessed(collect, &f), "one mail is unprocessed after "
+          "compaction");
+
+    test_torn_tail();
+    test_concurrent();
+    test_unreadable();
+
+end_test:
+    clear_queue();
+
+    printf("%s\n", failed ? "FAILED" : "OK");
+    exit(failed ? 1 : 0);
+}
+
+/* check - report failed check */
+static void check (int cond, const char *what)
+{
+    if (!cond) {
+        printf("failed: %s\n", what);
+        failed = 1;
+    }
+}
+
+/* flip - flip all bits of byte in file */
+static void flip (int fd, size_t off)
+{
+    unsigned char byte;
+
+    if (1 != pread(fd, &byte, 1, off))
+        err_sys("can't read byte %lu", (unsigned long) off);
+    byte ^= 0xff;
+    if (1 != pwrite(fd, &byte, 1, off))
+        err_sys("can't write byte %lu", (unsigned long) off);
+}
+
+/* make_mail - make mail object of given mail (envelope and data differ) */
+static void make_mail (struct mail_object *mail, const char *id)
+{
+    static char from[64], rcpt[64], data[256];
+    static char *rcpt_to[1];
+
+    bzero(mail, sizeof(struct mail_object));
+
+    snprintf(from, sizeof(from), "%s@example.org", id);
+    snprintf(rcpt, sizeof(rcpt), "rcpt-%s@example.org", id);
+    snprintf(data, sizeof(data), "From: <%s>\r\nSubject: %s\r\n\r\n"
+             "Body of mail '%s'.\r\n", from, id, id);
+
+    rcpt_to[0] = rcpt;
+    mail->mail_from = from;
+    mail->rcpt_to = rcpt_to;
+    mail->no_rcpt = 1;
+    mail->data = data;
+    mail->data_size = strlen(data);
+}
+
+/* append - append record of m-th mail */
+static void append (int type, int m)
+{
+    append_id(type, mail_ids[m]);
+}
+
+/* append_id - append record of given mail (only MAIL and DONE carry it) */
+static void append_id (int type, const char *id)
+{
+    struct mail_object mail;
+
+    make_mail(&mail, id);
+    if (0 != queue_append(type, id, (QREC_ACK == type) ? NULL : &mail))
+        err_sys("can't append record of %s", id);
+}
+
+/* collect - store found record (queue_scan() callback) */
+static void collect (const struct queue_rec *rec, void *arg)
+{
+    struct found *f = arg;
+
+    if (f->n == QT_RECS)
+        return;
+
+    f->recs[f->n] = *rec;
+    strncpy(f->ids[f->n], rec->id, QID_LEN-1);
+    f->recs[f->n].id = f->ids[f->n];
+    f->recs[f->n].payload = NULL;   /* mapping is gone after scan */
+    ++f->n;
+}
+
+/* count_seen - count unprocessed mail of appending process (queue_scan() *
+ *              callback), identifier is 'p<process>-<mail>'               */
+static void count_seen (const struct queue_rec *rec, void *arg)
+{
+    int p, m;
+    struct seen *s = arg;
+
+    if (2 == sscanf(rec->id, "p%d-%d", &p, &m) && p >= 0 && p < QT_PROCS
+        && m >= 0 && m < QT_APPENDS)
+        ++s->count[p][m];
+    else
+        ++s->other;
+}
+
+/* find - find record of m-th mail, returns its index or -1 */
+static int find (const struct found *f, int type, int m)
+{
+    return find_id(f, type, mail_ids[m]);
+}
+
+/* find_id - find record of given mail, returns its index or -1 */
+static int find_id (const struct found *f, int type, const char *id)
+{
+    int i;
+
+    for (i = 0; i < f->n; ++i) {
+        if (type == f->recs[i].type && 0 == strcmp(f->ids[i], id))
+            return i;
+    }
+
+    return -1;
+}
+
+/* check_mail - load mail at given location and compare it with m-th mail */
+static void check_mail (uint32_t segno, size_t off, int m, const char *what)
+{
+    char msg[128];
+    struct mail_object mail, orig;
+
+    snprintf(msg, sizeof(msg), "%s of %s is loaded", what, mail_ids[m]);
+    check(0 == queue_load(segno, off, &mail), msg);
+
+    make_mail(&orig, mail_ids[m]);
+    snprintf(msg, sizeof(msg), "%s of %s is intact", what, mail_ids[m]);
+    check(NULL != mail.mail_from && 0 == strcmp(mail.mail_from, orig.mail_from)
+          && 1 == mail.no_rcpt && 0 == strcmp(mail.rcpt_to[0], orig.rcpt_to[0])
+          && mail.data_size == orig.data_size
+          && 0 == memcmp(mail.data, orig.data, orig.data_size), msg);
+
+    free_mail_object(&mail);
+}
+
+/* clear_queue - remove queue directory of the test */
+static void clear_queue (void)
+{
+    DIR *dp;
+    struct dirent *en;
+    char path[QSEG_FNMAXLEN];
+
+    if (NULL == (dp = opendir(DEFAULT_QUEUE_DIR)))
+        return;
+    while (NULL != (en = readdir(dp))) {
+        if ('.' == en->d_name[0])
+            continue;
+        if (snprintf(path, sizeof(path), "%s/%s", DEFAULT_QUEUE_DIR,
+                     en->d_name) < (int) sizeof(path) && 0 != unlink(path))
+            rmdir(path);    /* (unreadable segment) */
+    }
+    closedir(dp);
+    rmdir(DEFAULT_QUEUE_DIR);
+}
+
+/* test_torn_tail - crash cuts the last segment in the middle of record *
+ *                  header, restart has to recover the mails before it  */
+static void test_torn_tail (void)
+{
+    int i;
+    size_t torn;
+    uint32_t segno;
+    struct found f;
+    struct mail_object mail;
+    char path[QSEG_FNMAXLEN];
+
+    append_id(QREC_MAIL, "tail-ok");
+    append_id(QREC_MAIL, "tail-torn");
+
+    bzero(&f, sizeof(f));
+    queue_scan(collect, &f);
+    if ((i = find_id(&f, QREC_MAIL, "tail-torn")) < 0) {
+        check(0, "torn tail: records are appended");
+        return;
+    }
+    segno = f.recs[i].segno;
+    torn = f.recs[i].off;
+
+    queue_segpath(path, segno);
+    if (0 != truncate(path, torn + 10))
+        err_sys("can't truncate %s", path);
+
+    /* restart */
+    queue_init();
+    append_id(QREC_MAIL, "tail-new");
+
+    bzero(&f, sizeof(f));
+    check(queue_unprocessed(collect, &f) >= 0, "torn tail: queue is read");
+    check(find_id(&f, QREC_MAIL, "tail-ok") >= 0,
+          "torn tail: mail before torn one is recovered");
+    check(find_id(&f, QREC_MAIL, "tail-torn") < 0,
+          "torn tail: torn mail is not recovered");
+    i = find_id(&f, QREC_MAIL, "tail-new");
+    check(i >= 0 && f.recs[i].segno > segno,
+          "torn tail: mail after restart goes to new segment");
+
+    check(EUEXEOF == queue_load(segno, torn, &mail),
+          "torn tail: load of torn record fails");
+    free_mail_object(&mail);
+
+    /* torn segment is compacted away, recovered mail survives */
+    queue_compact();
+    check(0 != access(path, F_OK), "torn tail: torn segment is deleted");
+
+    bzero(&f, sizeof(f));
+    queue_unprocessed(collect, &f);
+    check(find_id(&f, QREC_MAIL, "tail-ok") >= 0 &&
+          find_id(&f, QREC_MAIL, "tail-new") >= 0,
+          "torn tail: mails survive compaction");
+    check(find_id(&f, QREC_MAIL, "tail-torn") < 0,
+          "torn tail: torn mail doesn't survive compaction");
+}
+
+/* test_concurrent - processes append mails (every other one is delivered) *
+ *                   and rotate segments, while compaction runs repeatedly; *
+ *                   all undelivered mails have to survive exactly once     */
+static void test_concurrent (void)
+{
+    int p, m, status, running, lost = 0, dup = 0;
+    uint32_t first;
+    char id[QID_LEN], path[QSEG_FNMAXLEN];
+    struct found f;
+    struct seen *s;
+
+    /* segments which existed before are compacted away too */
+    bzero(&f, sizeof(f));
+    queue_scan(collect, &f);
+    first = (f.n > 0) ? f.recs[0].segno : 0;
+
+    for (p = 0; p < QT_PROCS; ++p) {
+        if (0 == Fork()) {
+            for (m = 0; m < QT_APPENDS; ++m) {
+                snprintf(id, sizeof(id), "p%d-%d", p, m);
+                append_id(QREC_MAIL, id);
+                if (0 == m % 2) {
+                    append_id(QREC_DONE, id);
+                    append_id(QREC_ACK, id);
+                }
+            }
+            _exit(0);
+        }
+    }
+
+    for (running = QT_PROCS; running > 0; ) {
+        queue_compact();
+        while (running > 0 && waitpid(-1, &status, WNOHANG) > 0) {
+            check(WIFEXITED(status) && 0 == WEXITSTATUS(status),
+                  "concurrent: appending process succeeds");
+            --running;
+        }
+    }
+    queue_compact();
+
+    s = Calloc(1, sizeof(struct seen));
+    check(queue_unprocessed(count_seen, s) >= 0, "concurrent: queue is read");
+    for (p = 0; p < QT_PROCS; ++p) {
+        for (m = 0; m < QT_APPENDS; ++m) {
+            if (0 == m % 2)
+                dup += (0 != s->count[p][m]);   /* delivered */
+            else if (0 == s->count[p][m])
+                ++lost;
+            else
+                dup += (1 != s->count[p][m]);
+        }
+    }
+    if (0 != lost || 0 != dup)
+        printf("concurrent: %d mails lost, %d wrong\n", lost, dup);
+    check(0 == lost, "concurrent: no undelivered mail is lost");
+    check(0 == dup, "concurrent: each undelivered mail is there once");
+    free(s);
+
+    queue_segpath(path, first);
+    check(0 != first && 0 != access(path, F_OK),
+          "concurrent: segments are compacted during appends");
+}
+
+/* test_unreadable - segment which can't be read (a directory) makes scan *
+ *                   fail and compaction keep it and all later segments    */
+static void test_unreadable (void)
+{
+    uint32_t kept;
+    struct found f;
+    char path[QSEG_FNMAXLEN];
+
+    bzero(&f, sizeof(f));
+    queue_scan(collect, &f);
+    kept = (f.n > 0) ? f.recs[0].segno : 0;
+
+    queue_segpath(path, 0);     /* (the oldest one) */
+    if (0 != mkdir(path, 0700))
+        err_sys("can't create %s", path);
+
+    bzero(&f, sizeof(f));
+    check(0 != queue_scan(collect, &f), "unreadable: scan fails");
+    check(queue_unprocessed(collect, &f) < 0, "unreadable: recovery fails");
+
+    queue_init();       /* (closes the active segment) */
+    queue_compact();
+    check(0 == access(path, F_OK), "unreadable: segment is kept");
+    queue_segpath(path, kept);
+    check(0 != kept && 0 == access(path, F_OK),
+          "unreadable: following segments are kept");
+}
@@ -0,0 +1,246 @@
+/**
+ * rules-test (lookup) - rules lookup test; small rules file (and generated
+ *                       exact rules, which make hash table grow) is loaded,
+ *                       it is checked which rule wins for given addresses, then
+ *                       rules are compiled into snapshot (--compile-rules)
+ *                       and the same lookups have to give identical results;
+ *                       snapshots with damaged header have to be rejected
+ *                       (or still be usable), not crash the loader
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "system.h"
+#include "config.h"
+#include "rules.h"
+
+struct config conf;     /* global configuration */
+
+#define GEN_RULES   300     /* generated exact rules (after rules_file[]) */
+
+/* rules of one type (ENCR), their index is in comment */
+static const char *rules_file[] = {
+    "ENCR alice@example.org c0\n",      /* 0: exact */
+    "ENCR example.org c1\n",            /* 1: partial */
+    "ENCR bob@example.org c2\n",        /* 2: exact, after partial 1 */
+    "ENCR *@mail.test c3\n",            /* 3: domain */
+    "ENCR carol@mail.test c4\n",        /* 4: exact, after domain 3 */
+    "ENCR *@deep.sub.mail.test c5\n",   /* 5: deeper than domain 3 */
+    "ENCR *@a.b.org c6\n",              /* 6: deeper than domain 7 */
+    "ENCR *@b.org c7\n",                /* 7: domain */
+    "ENCR Eve@Upper.TEST c8\n",         /* 8: exact, uppercase */
+    "ENCR SHOUT c9\n",                  /* 9: partial, uppercase */
+    "ENCR jkjz c10\n",                  /* 10: partial */
+    "ENCR kjz c11\n",                   /* 11: partial, suffix of 10 */
+    "ENCR zz c12\n",                    /* 12: partial */
+    "ENCR jkjkz c13\n",                 /* 13: partial, shares prefix */
+    "ENCR jzz c14\n",                   /* 14: partial, 12 is its suffix */
+    "ENCR *@ORG c15\n",                 /* 15: top-level domain */
+    "ENCR *@mail.test c16\n",           /* 16: duplicate of domain 3 */
+    "ENCR *@ail.test c17\n",            /* 17: suffix of label of 3 */
+    NULL
+};
+
+/* struct lookup_case - address and rule, which has to win (-1: none) */
+struct lookup_case {
+    const char *what;
+    const char *addr;
+    long rule;
+};
+
+static const struct lookup_case cases[] = {
+    { "exact beats later partial",      "alice@example.org",       0 },
+    { "earlier partial beats exact",    "bob@example.org",         1 },
+    { "partial",                        "dave@example.org.pl",     1 },
+    { "domain only if nothing matches", "carol@mail.test",         4 },
+    { "domain",                         "dave@mail.test",          3 },
+    { "domain, not partial",            "dave@xmail.test",        -1 },
+    { "deepest domain wins",            "x@deep.sub.mail.test",    5 },
+    { "deepest domain wins",            "x@y.deep.sub.mail.test",  5 },
+    { "shallower domain",               "x@other.sub.mail.test",   3 },
+    { "deepest domain wins (earlier)",  "x@a.b.org",               6 },
+    { "deepest domain wins (later)",    "x@c.b.org",               7 },
+    { "case folding of address",        "ALICE@Example.ORG",       0 },
+    { "case folding of domain",         "x@DEEP.Sub.mail.test",    5 },
+    { "case folding of exact rule",     "eve@upper.test",          8 },
+    { "case folding of partial rule",   "xShoutx@q.net",           9 },
+    { "earliest of overlapping partial", "a-jkjz@q.net",           10 },
+    { "partial suffix of other one",    "a-kjz@q.net",            11 },
+    { "partial after failed prefix",    "jkjkjz@q.net",           10 },
+    { "longer partial with prefix",     "jkjkz@q.net",            13 },
+    { "earlier partial as suffix",      "a-jzz@q.net",            12 },
+    { "partial in domain",              "x@kjz.net",              11 },
+    { "case folding of partial text",   "A-JKJZ@Q.NET",           10 },
+    { "no partial (prefixes only)",     "jkj-jzk@q.net",          -1 },
+    { "top-level domain",               "x@other.org",            15 },
+    { "domain equal to rule",           "x@org",                  15 },
+    { "earlier of duplicate domains",   "x@q.mail.test",           3 },
+    { "domain label, not its suffix",   "x@ail.test",             17 },
+    { "domain label, not its part",     "x@borg",                 -1 },
+    { "domain of address in brackets",  "<x@c.b.org>",             7 },
+    { "no domain without '@'",          "localpart.org",          -1 },
+    { "angle brackets",                 "<alice@example.org>",     0 },
+    { "no rule",                        "nobody@nowhere.net",     -1 },
+    { NULL, NULL, 0 }
+};
+
+static size_t static_rules;     /* rules in rules_file[] */
+
+static int check_lookups (const char *which);
+static int check_damaged (const char *snap, const char *dir);
+
+
+int main (void)
+{
+    int i, failed = 0;
+    char dir[] = "/tmp/rules-test.XXXXXX";
+    char config[64], rules[64], snap[64];
+    FILE *fp;
+
+    if (NULL == mkdtemp(dir))
+        err_sys("mkdtemp error");
+    snprintf(config, sizeof(config), "%s/config", dir);
+    snprintf(rules, sizeof(rules), "%s/rules", dir);
+    snprintf(snap, sizeof(snap), "%s/rules.snap", dir);
+
+    if (NULL == (fp = fopen(config, "w")))
+        err_sys("can't write %s", config);
+    fprintf(fp, "smtp_port = 2525\nmail_srv_addr = 127.0.0.1\n"
+                "mail_srv_port = 25\nrules = %s\n", rules);
+    fclose(fp);
+
+    if (NULL == (fp = fopen(rules, "w")))
+        err_sys("can't write %s", rules);
+    for (i = 0; NULL != rules_file[i]; ++i)
+        fputs(rules_file[i], fp);
+    static_rules = i;
+    for (; i < (int) static_rules + GEN_RULES; ++i)
+        fprintf(fp, "ENCR user%03d@gen.example g%d\n", i, i);
+    fprintf(fp, "ENCR user%03zu@gen.example dup\n", static_rules);
+    ++i;    /* (duplicate of the first generated one) */
+    fclose(fp);
+
+    /* plain rules file */
+    conf.config_file = config;
+    load_config();
+    if (i != (int) conf.encr_rules_size)
+        err_quit("loaded %zu rules of %d", conf.encr_rules_size, i);
+    failed |= check_lookups("rules file");
+
+    /* compiled snapshot of the same rules */
+    if (0 != rules_snapshot_save(snap))
+        err_sys("can't write %s", snap);
+    free_rules();
+    if (0 != rules_snapshot_load(snap))
+        err_quit("can't load %s", snap);
+    failed |= check_lookups("snapshot");
+    free_rules();
+
+    failed |= check_damaged(snap, dir);
+
+    unlink(snap);
+    unlink(rules);
+    unlink(config);
+    rmdir(dir);
+
+    printf("%s\n", failed ? "FAILED" : "OK");
+    exit(failed ? 1 : 0);
+}
+
+/* check_lookups - look up all test cases, returns 1 if any of them fails */
+static int check_lookups (const char *which)
+{
+    int i, failed = 0;
+    long r;
+    char addr[64];
+
+    for (i = 0; NULL != cases[i].addr; ++i) {
+        r = rules_lookup(RULE_ENCR, cases[i].addr);
+        if (r != cases[i].rule) {
+            printf("%s: %s: %s -> rule %ld, expected %ld\n", which,
+                   cases[i].what, cases[i].addr, r, cases[i].rule);
+            failed = 1;
+        }
+    }
+
+    /* generated exact rules: each one is found (first of duplicates *
+     * wins), while addresses differing in one character are not     */
+    for (i = static_rules; i < (int) static_rules + GEN_RULES; ++i) {
+        snprintf(addr, sizeof(addr), "USER%03d@Gen.Example", i);
+        if ((r = rules_lookup(RULE_ENCR, addr)) != i) {
+            printf("%s: exact: %s -> rule %ld, expected %d\n", which,
+                   addr, r, i);
+            failed = 1;
+        }
+        snprintf(addr, sizeof(addr), "user%03d@gen.exampla", i);
+        if ((r = rules_lookup(RULE_ENCR, addr)) != -1) {
+            printf("%s: exact: %s -> rule %ld, expected -1\n", which,
+                   addr, r);
+            failed = 1;
+        }
+    }
+
+    return failed;
+}
+
+/* check_damaged - overwrite words of snapshot header (counts, offsets) one *
+ *                 by one, each damaged copy has to be either rejected or   *
+ *                 loaded and looked up in without crash, returns 1 if     *
+ *                 nothing is rejected or intact snapshot stops loading    */
+static int check_damaged (const char *snap, const char *dir)
+{
+    static const uint64_t values[] = { 0, 3, UINT64_MAX };
+    char bad[64], *buf;
+    uint64_t word;
+    long len, off;
+    size_t v;
+    int rejected = 0, loaded = 0, failed;
+    FILE *fp;
+
+    snprintf(bad, sizeof(bad), "%s/bad.snap", dir);
+    if (NULL == (fp = fopen(snap, "r")) || 0 != fseek(fp, 0, SEEK_END) ||
+        (len = ftell(fp)) < 0)
+        err_sys("can't read %s", snap);
+    buf = Malloc(len);
+    rewind(fp);
+    if (len != (long) fread(buf, 1, len, fp))
+        err_sys("can't read %s", snap);
+    fclose(fp);
+
+    /* (magic is skipped, file is not a snapshot without it) */
+    for (off = 8; off + 8 <= len && off < 2048; off += 8) {
+        memcpy(&word, buf+off, sizeof(word));
+        for (v = 0; v < sizeof(values)/sizeof(values[0]); ++v) {
+            memcpy(buf+off, values+v, sizeof(word));
+            if (NULL == (fp = fopen(bad, "w")))
+                err_sys("can't write %s", bad);
+            fwrite(buf, 1, len, fp);
+            fclose(fp);
+
+            if (0 == rules_snapshot_load(bad)) {
+                rules_lookup(RULE_ENCR, "alice@example.org");
+                rules_lookup(RULE_ENCR, "dave@example.org.pl");
+                rules_lookup(RULE_ENCR, "x@y.deep.sub.mail.test");
+                free_rules();
+                ++loaded;
+            }
+            else
+                ++rejected;
+        }
+        memcpy(buf+off, &word, sizeof(word));
+    }
+    unlink(bad);
+    free(buf);
+
+    failed = (0 != rules_snapshot_load(snap)) || check_lookups("reloaded");
+    free_rules();
+    if (0 == rejected) {
+        printf("damaged snapshot: none of %d copies is rejected\n", loaded);
+        failed = 1;
+    }
+
+    return failed;
+}
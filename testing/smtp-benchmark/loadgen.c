@@ -0,0 +1,709 @@
+/**
+ * smtp-benchmark (loadgen) - open-loop SMTP load generator, sessions arrive
+ *                            at Poisson times regardless of how fast the
+ *                            server is, latencies of every phase are
+ *                            measured from the scheduled arrival and
+ *                            printed as percentiles (CSV or JSON)
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include "system.h"
+
+#define SMIME_GATE_PORT 5555
+
+#define LG_MAXCONN      1000    /* default maximum of concurrent sessions */
+#define LG_TIMEOUT      30      /* (sec) default reply timeout */
+#define LG_BUFLEN       1024    /* reply buffer length */
+#define LG_CMDLEN       600     /* command buffer length */
+#define LG_HDRLEN       512     /* mail header buffer length */
+#define LG_LINELEN      78      /* body line length (with CRLF) */
+
+/* Phases */
+#define PH_CONNECT      0       /* arrival -> 220 greeting */
+#define PH_ENVELOPE     1       /* MAIL sent -> 354 reply to DATA */
+#define PH_DATA         2       /* data sent -> 250 reply */
+#define PH_MESSAGE      3       /* message start -> 250 (first message *
+                                 * of session starts at its arrival)   */
+#define PH_SESSION      4       /* arrival -> 221 reply to QUIT */
+#define PHASES          5
+
+/* Errors */
+#define ER_DROPPED      0       /* arrival, when all sessions were busy */
+#define ER_CONNECT      1       /* connection failed */
+#define ER_TIMEOUT      2       /* no reply in time */
+#define ER_CLOSED       3       /* connection closed or reset by server */
+#define ER_GREETING     4       /* unexpected replies, by command */
+#define ER_EHLO         5
+#define ER_MAIL         6
+#define ER_RCPT         7
+#define ER_DATA         8
+#define ER_DOT          9
+#define ER_QUIT         10
+#define ERRORS          11
+
+/* Session states (reply awaited) */
+#define ST_CONNECT      0
+#define ST_GREETING     1
+#define ST_EHLO         2
+#define ST_MAIL         3
+#define ST_RCPT         4
+#define ST_DATA         5
+#define ST_DOT          6
+#define ST_QUIT         7
+
+/* Distribution kinds */
+#define DI_FIXED        0       /* fixed:N */
+#define DI_UNIFORM      1       /* uniform:MIN-MAX */
+#define DI_EXP          2       /* exp:MEAN */
+#define DI_LOGNORMAL    3       /* lognormal:MEDIAN,SIGMA */
+
+
+/** Typedefs **/
+
+/* struct dist - random distribution of integer values */
+struct dist {
+    int kind;                   /* see Distribution kinds */
+    double a, b;                /* parameters */
+};
+
+/* struct lat - latencies of phase (microseconds) */
+struct lat {
+    uint32_t *v;
+    size_t n, size;
+};
+
+/* struct sess - SMTP session */
+struct sess {
+    int fd;                     /* socket (-1: free slot) */
+    int state;                  /* see Session states */
+    uint64_t arrival;           /* scheduled arrival */
+    uint64_t deadline;          /* reply timeout */
+    uint64_t msg_start;         /* current message started */
+    uint64_t env_start;         /* MAIL of current message sent */
+    uint64_t data_start;        /* data of current message sent */
+    int msgs;                   /* messages left in session */
+    int rcpts;                  /* recipients of current message */
+    int rcpt;                   /* recipients sent */
+    size_t size;                /* body size of current message */
+    char cmd[LG_CMDLEN];        /* command (or mail header) being sent */
+    struct iovec out[3];        /* data being sent */
+    struct iovec *outp;         /* first unsent part */
+    int outcnt;                 /* number of unsent parts */
+    char in[LG_BUFLEN];         /* reply being received */
+    size_t inlen;
+};
+
+
+/** Local variables **/
+static struct sockaddr_in servaddr;
+static double rate = 10.0;              /* messages per second */
+static double duration = 10.0;          /* seconds */
+static double warmup = 0.0;             /* seconds not measured */
+static int maxconn = LG_MAXCONN;
+static int timeout = LG_TIMEOUT;
+static struct dist size_dist = { DI_FIXED, 4096, 0 };
+static struct dist rcpt_dist = { DI_FIXED, 1, 0 };
+static struct dist msgs_dist = { DI_FIXED, 1, 0 };
+static const char *from = "loadgen@example.org";
+static const char *to = "rcpt%d@example.org";
+static const char *label = "loadgen";
+static int json = 0;
+
+static uint64_t t0;                     /* start of run */
+static uint64_t measured;               /* start of measurement */
+static char *body;                      /* body lines (shared by sessions) */
+static size_t body_size;
+static struct lat lats[PHASES];
+static uint64_t errors[ERRORS];
+static uint64_t sessions, messages, bytes;
+
+static const char *phase_names[PHASES] = {
+    "connect", "envelope", "data", "message", "session"
+};
+
+static const char *error_names[ERRORS] = {
+    "dropped", "connect", "timeout", "closed", "greeting", "ehlo", "mail",
+    "rcpt", "data", "dot", "quit"
+};
+
+
+/* now - monotonic time in microseconds */
+static uint64_t now (void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* usage - print usage and exit */
+static void usage (void)
+{
+    fprintf(stderr,
+"usage: loadgen [options] <IPaddress>\n"
+"  -p port       gateway port (%d)\n"
+"  -r rate       offered load, messages per second (10)\n"
+"  -d seconds    duration of arrivals (10)\n"
+"  -w seconds    warm-up, not measured (0)\n"
+"  -s dist       message body size in bytes (fixed:4096)\n"
+"  -n dist       recipients per message (fixed:1)\n"
+"  -m dist       messages per session (fixed:1)\n"
+"  -c sessions   maximum of concurrent sessions (%d)\n"
+"  -t seconds    reply timeout (%d)\n"
+"  -F address    sender (loadgen@example.org)\n"
+"  -T format     recipient, %%d is its number (rcpt%%d@example.org)\n"
+"  -l label      label of results (loadgen)\n"
+"  -S seed       random seed (time)\n"
+"  -j            print results as JSON (CSV by default)\n"
+"dist is fixed:N, uniform:MIN-MAX, exp:MEAN or lognormal:MEDIAN,SIGMA\n",
+            SMIME_GATE_PORT, LG_MAXCONN, LG_TIMEOUT);
+    exit(1);
+}
+
+/* parse_dist - parse distribution (see usage()), returns 0 on success */
+static int parse_dist (const char *s, struct dist *d)
+{
+    if (1 == sscanf(s, "fixed:%lf", &(d->a)))
+        d->kind = DI_FIXED;
+    else if (2 == sscanf(s, "uniform:%lf-%lf", &(d->a), &(d->b)) &&
+             d->a <= d->b)
+        d->kind = DI_UNIFORM;
+    else if (1 == sscanf(s, "exp:%lf", &(d->a)) && d->a > 0)
+        d->kind = DI_EXP;
+    else if (2 == sscanf(s, "lognormal:%lf,%lf", &(d->a), &(d->b)) &&
+             d->a > 0)
+        d->kind = DI_LOGNORMAL;
+    else
+        return -1;
+
+    return (d->a < 0) ? -1 : 0;
+}
+
+/* sample - draw value from distribution (at least 'min') */
+static size_t sample (const struct dist *d, size_t min)
+{
+    double v, u1, u2;
+
+    switch (d->kind) {
+        case DI_UNIFORM:
+            v = d->a + floor(drand48() * (d->b - d->a + 1));
+            break;
+        case DI_EXP:
+            v = -d->a * log(1.0 - drand48());
+            break;
+        case DI_LOGNORMAL:
+            /* Box-Muller transform */
+            u1 = 1.0 - drand48();
+            u2 = drand48();
+            v = d->a * exp(d->b * sqrt(-2.0 * log(u1)) * cos(2 * M_PI * u2));
+            break;
+        default:
+            v = d->a;
+    }
+
+    return (v < min) ? min : (size_t) v;
+}
+
+/* lat_add - record latency of phase (if measurement has started) */
+static void lat_add (int phase, uint64_t start, uint64_t end)
+{
+    struct lat *l = &(lats[phase]);
+    uint32_t *v;
+
+    if (start < measured)
+        return;
+
+    if (l->n == l->size) {
+        l->size = l->size ? 2 * l->size : 4096;
+        if (NULL == (v = realloc(l->v, l->size * sizeof(uint32_t))))
+            err_quit("realloc error");
+        l->v = v;
+    }
+    l->v[l->n++] = (end - start > UINT32_MAX) ? UINT32_MAX : end - start;
+}
+
+/* count_error - count error of session, which arrived at 'arrival' */
+static void count_error (int err, uint64_t arrival)
+{
+    if (arrival >= measured)
+        ++errors[err];
+}
+
+/* body_get - shared body of (at least) 'size' bytes, in whole lines, *
+ *            no line starts with dot                                 */
+static const char *body_get (size_t size)
+{
+    size_t i;
+    char *b;
+
+    if (size <= body_size)
+        return body;
+
+    if (NULL == (b = realloc(body, size)))
+        err_quit("realloc error");
+    body = b;
+
+    for (i = body_size; i < size; ++i) {
+        if (LG_LINELEN-2 == i % LG_LINELEN)
+            body[i] = '\r';
+        else if (LG_LINELEN-1 == i % LG_LINELEN)
+            body[i] = '\n';
+        else
+            body[i] = 'a' + (i / LG_LINELEN + i) % 26;
+    }
+    body_size = size;
+
+    return body;
+}
+
+/* sess_send - queue data to be sent (up to 3 parts, NULL terminated) */
+static void sess_send (struct sess *s, const char *p1, size_t l1,
+                       const char *p2, size_t l2, const char *p3, size_t l3)
+{
+    s->out[0].iov_base = (void *) p1;
+    s->out[0].iov_len = l1;
+    s->out[1].iov_base = (void *) p2;
+    s->out[1].iov_len = l2;
+    s->out[2].iov_base = (void *) p3;
+    s->out[2].iov_len = l3;
+    s->outp = s->out;
+    s->outcnt = (NULL == p3) ? ((NULL == p2) ? 1 : 2) : 3;
+    s->inlen = 0;
+    s->deadline = now() + (uint64_t) timeout * 1000000;
+}
+
+/* sess_cmd - send formatted command */
+static void sess_cmd (struct sess *s, const char *fmt, const char *arg)
+{
+    int n = snprintf(s->cmd, LG_CMDLEN, fmt, arg);
+
+    sess_send(s, s->cmd, (n < LG_CMDLEN) ? n : LG_CMDLEN-1, NULL, 0, NULL, 0);
+}
+
+/* sess_close - finish session */
+static void sess_close (struct sess *s)
+{
+    close(s->fd);
+    s->fd = -1;
+}
+
+/* sess_fail - finish session with error */
+static void sess_fail (struct sess *s, int err)
+{
+    count_error(err, s->arrival);
+    sess_close(s);
+}
+
+/* sess_start - start session, which was scheduled at 'arrival' */
+static int sess_start (struct sess *s, uint64_t arrival)
+{
+    int one = 1;
+
+    s->arrival = s->msg_start = arrival;
+    s->msgs = sample(&msgs_dist, 1);
+    s->outcnt = 0;
+    s->inlen = 0;
+    s->deadline = now() + (uint64_t) timeout * 1000000;
+    s->state = ST_CONNECT;
+
+    if ((s->fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0)) < 0)
+        return -1;
+    setsockopt(s->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    if (connect(s->fd, (SA *) &servaddr, sizeof(servaddr)) < 0 &&
+        EINPROGRESS != errno) {
+        close(s->fd);
+        s->fd = -1;
+        return -1;
+    }
+
+    if (arrival >= measured)
+        ++sessions;
+    return 0;
+}
+
+/* msg_start - start next message of session with MAIL command */
+static void msg_start (struct sess *s)
+{
+    s->rcpts = sample(&rcpt_dist, 1);
+    s->rcpt = 0;
+    s->size = sample(&size_dist, 1);
+    s->size = (s->size + LG_LINELEN - 1) / LG_LINELEN * LG_LINELEN;
+    s->env_start = now();
+    s->state = ST_MAIL;
+    sess_cmd(s, "MAIL FROM:<%s>\r\n", from);
+}
+
+/* sess_reply - handle complete reply 'code' of session */
+static void sess_reply (struct sess *s, int code)
+{
+    int n;
+    char rcpt[LG_CMDLEN/2];
+    uint64_t t = now();
+
+    switch (s->state) {
+        case ST_GREETING:
+            if (220 != code) {
+                sess_fail(s, ER_GREETING);
+                return;
+            }
+            lat_add(PH_CONNECT, s->arrival, t);
+            s->state = ST_EHLO;
+            sess_cmd(s, "EHLO %s\r\n", "loadgen");
+            break;
+
+        case ST_EHLO:
+            if (250 != code) {
+                sess_fail(s, ER_EHLO);
+                return;
+            }
+            msg_start(s);
+            break;
+
+        case ST_MAIL:
+        case ST_RCPT:
+            if (250 != code) {
+                sess_fail(s, ST_MAIL == s->state ? ER_MAIL : ER_RCPT);
+                return;
+            }
+
+            if (s->rcpt < s->rcpts) {
+                snprintf(rcpt, sizeof(rcpt), to, ++s->rcpt);
+                s->state = ST_RCPT;
+                sess_cmd(s, "RCPT TO:<%s>\r\n", rcpt);
+            }
+            else {
+                s->state = ST_DATA;
+                sess_cmd(s, "%sDATA\r\n", "");
+            }
+            break;
+
+        case ST_DATA:
+            if (354 != code) {
+                sess_fail(s, ER_DATA);
+                return;
+            }
+            lat_add(PH_ENVELOPE, s->env_start, t);
+
+            n = snprintf(s->cmd, LG_HDRLEN, "From: <%s>\r\n"
+                         "Subject: loadgen %zu bytes\r\n\r\n", from, s->size);
+            s->data_start = t;
+            s->state = ST_DOT;
+            sess_send(s, s->cmd, (n < LG_HDRLEN) ? n : LG_HDRLEN-1,
+                      body_get(s->size), s->size, ".\r\n", 3);
+            break;
+
+        case ST_DOT:
+            if (250 != code) {
+                sess_fail(s, ER_DOT);
+                return;
+            }
+            lat_add(PH_DATA, s->data_start, t);
+            lat_add(PH_MESSAGE, s->msg_start, t);
+            if (s->msg_start >= measured) {
+                ++messages;
+                bytes += s->size;
+            }
+
+            if (--s->msgs > 0) {
+                s->msg_start = t;
+                msg_start(s);
+            }
+            else {
+                s->state = ST_QUIT;
+                sess_cmd(s, "%sQUIT\r\n", "");
+            }
+            break;
+
+        case ST_QUIT:
+            if (221 != code) {
+                sess_fail(s, ER_QUIT);
+                return;
+            }
+            lat_add(PH_SESSION, s->arrival, t);
+            sess_close(s);
+            break;
+    }
+}
+
+/* sess_io - handle readiness of session socket */
+static void sess_io (struct sess *s, short revents)
+{
+    int err;
+    char *nl, *line;
+    ssize_t n;
+    socklen_t len = sizeof(err);
+
+    if (ST_CONNECT == s->state) {
+        if (getsockopt(s->fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0 ||
+            0 != err) {
+            sess_fail(s, ER_CONNECT);
+            return;
+        }
+        s->state = ST_GREETING;
+        return;
+    }
+
+    /* send queued data */
+    if ((revents & POLLOUT) && s->outcnt > 0) {
+        if ((n = writev(s->fd, s->outp, s->outcnt)) < 0) {
+            if (EAGAIN != errno && EINTR != errno)
+                sess_fail(s, ER_CLOSED);
+            return;
+        }
+
+        while (s->outcnt > 0 && (size_t) n >= s->outp->iov_len) {
+            n -= s->outp->iov_len;
+            ++s->outp;
+            --s->outcnt;
+        }
+        if (s->outcnt > 0) {
+            s->outp->iov_base = (char *) s->outp->iov_base + n;
+            s->outp->iov_len -= n;
+        }
+    }
+
+    if (!(revents & (POLLIN | POLLHUP | POLLERR)))
+        return;
+
+    n = read(s->fd, s->in + s->inlen, LG_BUFLEN - 1 - s->inlen);
+    if (n <= 0) {
+        if (n < 0 && (EAGAIN == errno || EINTR == errno))
+            return;
+        sess_fail(s, ER_CLOSED);
+        return;
+    }
+    s->inlen += n;
+    s->in[s->inlen] = '\0';
+
+    /* reply ends with line "NNN text" (not "NNN-text") */
+    line = s->in;
+    while (NULL != (nl = strstr(line, "\r\n"))) {
+        if (nl - line >= 3 && '-' != line[3]) {
+            sess_reply(s, atoi(line));
+            return;
+        }
+        line = nl + 2;
+    }
+
+    /* keep incomplete line only */
+    if (line != s->in) {
+        s->inlen -= line - s->in;
+        memmove(s->in, line, s->inlen + 1);
+    }
+    if (LG_BUFLEN - 1 == s->inlen)
+        s->inlen = 0;   /* too long line, skip it */
+}
+
+/* cmp_u32 - compare latencies (for qsort()) */
+static int cmp_u32 (const void *a, const void *b)
+{
+    uint32_t x = *(const uint32_t *) a, y = *(const uint32_t *) b;
+
+    return (x > y) - (x < y);
+}
+
+/* pct - percentile of sorted latencies in milliseconds */
+static double pct (const struct lat *l, double q)
+{
+    size_t i;
+
+    if (0 == l->n)
+        return 0.0;
+    i = (size_t) ceil(q * l->n);
+    i = (i > 0) ? i - 1 : 0;
+    return l->v[(i < l->n) ? i : l->n - 1] / 1000.0;
+}
+
+/* print_results - print latencies and errors of measured part of run */
+static void print_results (double secs)
+{
+    int i;
+    size_t j;
+    double mean;
+    struct lat *l;
+
+    if (json) {
+        printf("{\"label\":\"%s\",\"offered_rate\":%.2f,\"duration\":%.2f,"
+               "\"sessions\":%llu,\"messages\":%llu,\"throughput\":%.2f,"
+               "\"bytes\":%llu,\"latency_ms\":{", label, rate, secs,
+               (unsigned long long) sessions, (unsigned long long) messages,
+               messages / secs, (unsigned long long) bytes);
+    }
+    else {
+        printf("label,phase,count,mean_ms,p50_ms,p90_ms,p99_ms,p999_ms,"
+               "max_ms\n");
+    }
+
+    for (i = 0; i < PHASES; ++i) {
+        l = &(lats[i]);
+        qsort(l->v, l->n, sizeof(uint32_t), cmp_u32);
+        for (j = 0, mean = 0.0; j < l->n; ++j)
+            mean += l->v[j];
+        mean = l->n ? mean / l->n / 1000.0 : 0.0;
+
+        printf(json ? "%s\"%s\":{\"count\":%zu,\"mean\":%.3f,\"p50\":%.3f,"
+                      "\"p90\":%.3f,\"p99\":%.3f,\"p999\":%.3f,\"max\":%.3f}"
+                    : "%s,%s,%zu,%.3f,%.3f,%.3f,%.3f,%.3f,%.3f\n",
+               json ? (i ? "," : "") : label, phase_names[i], l->n,
+               mean, pct(l, 0.5), pct(l, 0.9), pct(l, 0.99), pct(l, 0.999),
+                l->n ? l->v[l->n-1] / 1000.0 : 0.0);
+    }
+
+    if (json)
+        printf("},\"errors\":{");
+    for (i = 0; i < ERRORS; ++i) {
+        if (json)
+            printf("%s\"%s\":%llu", i ? "," : "", error_names[i],
+                   (unsigned long long) errors[i]);
+        else
+            printf("%s,error:%s,%llu,,,,,,\n", label, error_names[i],
+                   (unsigned long long) errors[i]);
+    }
+
+    if (json)
+        printf("}}\n");
+    else
+        printf("%s,throughput,%llu,%.2f,,,,,\n", label,
+               (unsigned long long) messages, messages / secs);
+}
+
+int main (int argc, char **argv)
+{
+    int i, c, nfds, active;
+    long seed = time(NULL);
+    uint64_t t, next, end, wait;
+    double interval;
+    struct sess *ss;
+    struct pollfd *fds;
+    int *idx;
+
+    servaddr.sin_family = AF_INET;
+    servaddr.sin_port = htons(SMIME_GATE_PORT);
+
+    while (-1 != (c = getopt(argc, argv, "p:r:d:w:s:n:m:c:t:F:T:l:S:j"))) {
+        switch (c) {
+            case 'p': servaddr.sin_port = htons(atoi(optarg)); break;
+            case 'r': rate = atof(optarg); break;
+            case 'd': duration = atof(optarg); break;
+            case 'w': warmup = atof(optarg); break;
+            case 'c': maxconn = atoi(optarg); break;
+            case 't': timeout = atoi(optarg); break;
+            case 'F': from = optarg; break;
+            case 'T': to = optarg; break;
+            case 'l': label = optarg; break;
+            case 'S': seed = atol(optarg); break;
+            case 'j': json = 1; break;
+            case 's':
+                if (0 != parse_dist(optarg, &size_dist))
+                    usage();
+                break;
+            case 'n':
+                if (0 != parse_dist(optarg, &rcpt_dist))
+                    usage();
+                break;
+            case 'm':
+                if (0 != parse_dist(optarg, &msgs_dist))
+                    usage();
+                break;
+            default:
+                usage();
+        }
+    }
+
+    if (optind + 1 != argc || rate <= 0 || duration <= 0 || warmup < 0 ||
+        maxconn <= 0 || timeout <= 0 ||
+        1 != inet_pton(AF_INET, argv[optind], &servaddr.sin_addr))
+        usage();
+
+    srand48(seed);
+    signal(SIGPIPE, SIG_IGN);
+
+    ss = Calloc(maxconn, sizeof(struct sess));
+    fds = Calloc(maxconn, sizeof(struct pollfd));
+    idx = Calloc(maxconn, sizeof(int));
+    for (i = 0; i < maxconn; ++i)
+        ss[i].fd = -1;
+
+    /* sessions arrive at rate of messages divided by mean messages per *
+     * session, intervals are exponential (Poisson process)             */
+    switch (msgs_dist.kind) {
+        case DI_UNIFORM:
+            interval = (msgs_dist.a + msgs_dist.b) / 2 / rate;
+            break;
+        case DI_LOGNORMAL:
+            interval = msgs_dist.a * exp(msgs_dist.b * msgs_dist.b / 2) / rate;
+            break;
+        default:
+            interval = msgs_dist.a / rate;
+    }
+    if (interval <= 0)
+        interval = 1.0 / rate;
+
+    t0 = now();
+    measured = t0 + (uint64_t) (warmup * 1000000);
+    end = t0 + (uint64_t) ((warmup + duration) * 1000000);
+    next = t0;
+    active = 0;
+
+    while (next < end || active > 0) {
+        t = now();
+
+        /* start every session, which is due (even late ones) */
+        while (next < end && next <= t) {
+            for (i = 0; i < maxconn && ss[i].fd >= 0; ++i)
+                ;
+            if (i == maxconn)
+                count_error(ER_DROPPED, next);
+            else if (0 != sess_start(&(ss[i]), next))
+                count_error(ER_CONNECT, next);
+            next += (uint64_t) (-interval * log(1.0 - drand48()) * 1000000);
+        }
+
+        /* wait for sockets, next arrival or timeout */
+        wait = (next < end) ? next - t : 1000000;
+        for (i = nfds = 0; i < maxconn; ++i) {
+            if (ss[i].fd < 0)
+                continue;
+            if (ss[i].deadline <= t) {
+                sess_fail(&(ss[i]), ER_TIMEOUT);
+                continue;
+            }
+            if (ss[i].deadline - t < wait)
+                wait = ss[i].deadline - t;
+
+            fds[nfds].fd = ss[i].fd;
+            fds[nfds].events = POLLIN;
+            if (ST_CONNECT == ss[i].state || ss[i].outcnt > 0)
+                fds[nfds].events |= POLLOUT;
+            idx[nfds++] = i;
+        }
+        active = nfds;
+
+        if (poll(fds, nfds, (wait + 999) / 1000) < 0 && EINTR != errno)
+            err_sys("poll error");
+
+        for (i = 0; i < nfds; ++i) {
+            if (0 != fds[i].revents)
+                sess_io(&(ss[idx[i]]), fds[i].revents);
+        }
+    }
+
+    print_results(duration);
+
+    return 0;
+}
@@ -0,0 +1,386 @@
+/**
+ * smtp-benchmark (parser) - microbenchmark of SMTP line, command, reply and
+ *                           mail data receipt; synthetic corpora are written
+ *                           to socketpair by child process, while parent
+ *                           parses them and counts time and allocations
+ *                           (linked with --wrap for malloc, calloc, realloc)
+ */
+
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include "system.h"
+#include "smtp.h"
+#include "smtp-lib.h"
+
+#define PB_VOLUME       64      /* (MB) default data parsed in each case */
+#define PB_MAXBODY      100     /* (MB) default largest mail body */
+#define PB_LINEMAX      998     /* longest body line (RFC 5321) */
+#define PB_CMDS         1024    /* commands in command corpus */
+#define PB_RCPTS        1000    /* recipients in RCPT list corpus */
+
+/* Cases */
+#define CASE_READLINE   0       /* smtp_readline() */
+#define CASE_COMMAND    1       /* smtp_recv_command() */
+#define CASE_REPLY      2       /* smtp_recv_reply() */
+#define CASE_DATA       3       /* smtp_recv_mail_data() */
+
+ssize_t smtp_recv_mail_data (int sockfd, char **buf_ptr, size_t *buf_size);
+
+void *__real_malloc (size_t size);
+void *__real_calloc (size_t n, size_t size);
+void *__real_realloc (void *ptr, size_t size);
+
+
+/** Typedefs **/
+
+/* struct corpus - synthetic input of one case */
+struct corpus {
+    char name[32];              /* case name */
+    int type;                   /* see Cases */
+    char *buf;                  /* input data */
+    size_t len;
+    size_t ops;                 /* lines, commands, replies or mails in buf */
+};
+
+
+/** Local variables **/
+static uint64_t allocs, alloc_bytes;    /* allocations counted by wrappers */
+static uint32_t seed = 1;
+static const size_t body_sizes[] = {    /* mail data corpora */
+    1024, 10*1024, 100*1024, 1024*1024, 10*1024*1024, 100*1024*1024
+};
+
+
+/* __wrap_malloc - count allocation and pass it to malloc() */
+void *__wrap_malloc (size_t size)
+{
+    ++allocs;
+    alloc_bytes += size;
+    return __real_malloc(size);
+}
+
+/* __wrap_calloc - count allocation and pass it to calloc() */
+void *__wrap_calloc (size_t n, size_t size)
+{
+    ++allocs;
+    alloc_bytes += n * size;
+    return __real_calloc(n, size);
+}
+
+/* __wrap_realloc - count allocation and pass it to realloc() */
+void *__wrap_realloc (void *ptr, size_t size)
+{
+    ++allocs;
+    alloc_bytes += size;
+    return __real_realloc(ptr, size);
+}
+
+/* rnd - pseudo-random number in range [0, n), same sequence in every run */
+static uint32_t rnd (uint32_t n)
+{
+    seed = seed * 1103515245 + 12345;
+    return (seed >> 8) % n;
+}
+
+/* now - monotonic time in nanoseconds */
+static uint64_t now (void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* append - append formatted text to corpus */
+static void append (struct corpus *c, size_t *size, const char *fmt, ...)
+    __attribute__ ((format (printf, 3, 4)));
+
+static void append (struct corpus *c, size_t *size, const char *fmt, ...)
+{
+    int n;
+    va_list ap;
+
+    for (;;) {
+        va_start(ap, fmt);
+        n = vsnprintf(c->buf + c->len, *size - c->len, fmt, ap);
+        va_end(ap);
+
+        if ((size_t) n < *size - c->len)
+            break;
+        *size *= 2;
+        if (NULL == (c->buf = realloc(c->buf, *size)))
+            err_quit("realloc error");
+    }
+    c->len += n;
+}
+
+/* make_address - random mail address of 'len' characters (at least 12) */
+static void make_address (char *addr, size_t len)
+{
+    size_t i, at = len - 12;
+
+    for (i = 0; i < len; ++i)
+        addr[i] = 'a' + rnd(26);
+    memcpy(addr + at, "@example.org", 12);
+    addr[len] = '\0';
+}
+
+/* make_lines - lines of varied length for smtp_readline() */
+static void make_lines (struct corpus *c)
+{
+    size_t i, len, size = 4096;
+    char line[LINE_MAXLEN];
+
+    strcpy(c->name, "readline");
+    c->type = CASE_READLINE;
+    c->buf = Malloc(size);
+
+    for (i = 0; i < PB_CMDS; ++i) {
+        len = 1 + rnd(LINE_MAXLEN - 3);
+        memset(line, 'a' + i % 26, len);
+        line[len] = '\0';
+        append(c, &size, "%s\r\n", line);
+    }
+    c->ops = PB_CMDS;
+}
+
+/* make_commands - short commands of SMTP sessions */
+static void make_commands (struct corpus *c)
+{
+    size_t i, size = 4096;
+    char addr[64];
+
+    strcpy(c->name, "commands");
+    c->type = CASE_COMMAND;
+    c->buf = Malloc(size);
+
+    for (i = 0; i < PB_CMDS; i += 8) {
+        make_address(addr, 16 + rnd(32));
+        append(c, &size, "EHLO client%zu.example.org\r\n", i);
+        append(c, &size, "MAIL FROM:<%s>\r\n", addr);
+        make_address(addr, 16 + rnd(32));
+        append(c, &size, "RCPT TO:<%s>\r\n", addr);
+        make_address(addr, 16 + rnd(32));
+        append(c, &size, "rcpt to:<%s>\r\n", addr);
+        append(c, &size, "DATA\r\nNOOP\r\nRSET\r\nQUIT\r\n");
+    }
+    c->ops = i;
+}
+
+/* make_rcpts - long list of RCPT commands with long addresses */
+static void make_rcpts (struct corpus *c)
+{
+    size_t i, size = 4096;
+    char addr[ADDR_MAXLEN];
+
+    strcpy(c->name, "rcpt-list");
+    c->type = CASE_COMMAND;
+    c->buf = Malloc(size);
+
+    for (i = 0; i < PB_RCPTS; ++i) {
+        make_address(addr, 32 + rnd(ADDR_MAXLEN - 33));
+        append(c, &size, "RCPT TO:<%s>\r\n", addr);
+    }
+    c->ops = PB_RCPTS;
+}
+
+/* make_replies - replies of SMTP sessions, with multiline EHLO replies */
+static void make_replies (struct corpus *c)
+{
+    size_t i, size = 4096;
+
+    strcpy(c->name, "replies");
+    c->type = CASE_REPLY;
+    c->buf = Malloc(size);
+
+    for (i = 0; i < PB_CMDS; i += 16) {
+        append(c, &size, "220 mx.example.org ESMTP ready\r\n"
+               "250-mx.example.org Hello client.example.org\r\n"
+               "250-SIZE 52428800\r\n250-8BITMIME\r\n250-PIPELINING\r\n"
+               "250-DSN\r\n250-ENHANCEDSTATUSCODES\r\n250 HELP\r\n"
+               "250 2.1.0 Sender OK\r\n250 2.1.5 Recipient OK\r\n"
+               "450 4.2.1 Mailbox busy, try again later\r\n"
+               "354 End data with <CR><LF>.<CR><LF>\r\n"
+               "250 2.0.0 Ok: queued as %08zX\r\n"
+               "250 2.0.0 Reset state\r\n550 5.1.1 User unknown\r\n"
+               "221 2.0.0 Bye\r\n", i);
+    }
+    c->ops = i;
+}
+
+/* make_body - mail data of (about) 'size' bytes, with lines of varied *
+ *             length, some of them dot-stuffed, ended with ".CRLF"    */
+static void make_body (struct corpus *c, size_t size)
+{
+    size_t len, end;
+
+    if (size >= 1024*1024)
+        snprintf(c->name, sizeof(c->name), "data-%zuM", size / (1024*1024));
+    else
+        snprintf(c->name, sizeof(c->name), "data-%zuK", size / 1024);
+    c->type = CASE_DATA;
+    c->buf = Malloc(size + PB_LINEMAX + 5);
+    c->len = 0;
+
+    while (c->len < size) {
+        /* mostly short lines, some long ones */
+        len = (0 == rnd(8)) ? rnd(PB_LINEMAX) : rnd(80);
+        end = c->len + len;
+
+        /* dot-stuffed line */
+        if (len > 1 && 0 == rnd(16)) {
+            c->buf[c->len++] = '.';
+            c->buf[c->len++] = '.';
+        }
+        else if (c->len < end)
+            c->buf[c->len++] = 'A' + rnd(26);   /* no dot at line start */
+        while (c->len < end)
+            c->buf[c->len++] = ' ' + 1 + rnd(94);
+        c->buf[c->len++] = '\r';
+        c->buf[c->len++] = '\n';
+    }
+    memcpy(c->buf + c->len, ".\r\n", 3);
+    c->len += 3;
+    c->ops = 1;
+}
+
+/* parse - parse corpus 'n' times from socket, returns number of errors */
+static size_t parse (int fd, const struct corpus *c, size_t n)
+{
+    size_t i, j, err = 0;
+    ssize_t len;
+    char *buf, line[LINE_MAXLEN];
+    struct smtp_command cmd;
+    struct smtp_reply rply;
+
+    for (i = 0; i < n; ++i) {
+        for (j = 0; j < c->ops; ++j) {
+            switch (c->type) {
+                case CASE_READLINE:
+                    if (smtp_readline(fd, line, LINE_MAXLEN) <= 0)
+                        ++err;
+                    break;
+                case CASE_COMMAND:
+                    if (0 != smtp_recv_command(fd, &cmd) || 0 == cmd.code)
+                        ++err;
+                    break;
+                case CASE_REPLY:
+                    if (0 != smtp_recv_reply(fd, &rply))
+                        ++err;
+                    break;
+                case CASE_DATA:
+                    if ((len = smtp_recv_mail_data(fd, &buf, NULL)) <= 0)
+                        ++err;
+                    free(buf);
+                    break;
+            }
+        }
+    }
+
+    return err;
+}
+
+/* run - write corpus to socketpair (from child process) and parse it, *
+ *       print results                                                  */
+static void run (const struct corpus *c, size_t volume)
+{
+    int sv[2];
+    size_t i, n, err;
+    pid_t pid;
+    uint64_t t, a, ab, bytes;
+
+    n = volume / c->len;
+    if (0 == n)
+        n = 1;
+
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0)
+        err_sys("socketpair error");
+
+    if (0 == (pid = Fork())) {
+        close(sv[0]);
+        for (i = 0; i < n; ++i) {
+            if (writen(sv[1], c->buf, c->len) < 0)
+                _exit(1);
+        }
+        _exit(0);  /* stdout buffer belongs to parent */
+    }
+    close(sv[1]);
+
+    a = allocs;
+    ab = alloc_bytes;
+    t = now();
+    err = parse(sv[0], c, n);
+    t = now() - t;
+    a = allocs - a;
+    ab = alloc_bytes - ab;
+
+    close(sv[0]);
+    waitpid(pid, NULL, 0);
+
+    bytes = (uint64_t) c->len * n;
+    printf("%s,%zu,%llu,%.1f,%.3f,%.1f,%.2f,%.0f,%zu\n", c->name, n * c->ops,
+           (unsigned long long) bytes, (double) t / (n * c->ops),
+           (double) t / bytes, bytes * 1000.0 / t, (double) a / (n * c->ops),
+           (double) ab / (n * c->ops), err);
+    fflush(stdout);
+}
+
+int main (int argc, char **argv)
+{
+    int opt;
+    size_t i, volume = PB_VOLUME, maxbody = PB_MAXBODY;
+    struct corpus c;
+
+    while (-1 != (opt = getopt(argc, argv, "v:m:"))) {
+        switch (opt) {
+            case 'v': volume = atoi(optarg); break;
+            case 'm': maxbody = atoi(optarg); break;
+            default:
+                err_quit("usage: parser [-v MB parsed per case (%d)] "
+                         "[-m largest body in MB (%d)]",
+                         PB_VOLUME, PB_MAXBODY);
+        }
+    }
+    volume *= 1024*1024;
+
+    printf("case,ops,bytes,ns_per_op,ns_per_byte,mb_per_s,allocs_per_op,"
+           "alloc_bytes_per_op,errors\n");
+
+    memset(&c, 0, sizeof(c));
+    make_lines(&c);
+    run(&c, volume);
+    free(c.buf);
+
+    memset(&c, 0, sizeof(c));
+    make_commands(&c);
+    run(&c, volume);
+    free(c.buf);
+
+    memset(&c, 0, sizeof(c));
+    make_rcpts(&c);
+    run(&c, volume);
+    free(c.buf);
+
+    memset(&c, 0, sizeof(c));
+    make_replies(&c);
+    run(&c, volume);
+    free(c.buf);
+
+    for (i = 0; i < sizeof(body_sizes)/sizeof(body_sizes[0]) &&
+                body_sizes[i] <= maxbody*1024*1024; ++i) {
+        memset(&c, 0, sizeof(c));
+        make_body(&c, body_sizes[i]);
+        run(&c, volume);
+        free(c.buf);
+    }
+
+    return 0;
+}
@@ -0,0 +1,589 @@
+/**
+ * smtp-benchmark (sink) - fake upstream MTA, accepts mail objects and
+ *                         discards (or checksums) them in memory, replies
+ *                         can be delayed and failures (4xx/5xx replies,
+ *                         disconnects, slow reads) injected at given rates
+ */
+
+#define _GNU_SOURCE
+#include <ctype.h>
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include "system.h"
+
+#define SMTP_PORT   5780
+
+#define SK_MAXCONN      1024    /* default maximum of connections */
+#define SK_BUFLEN       65536   /* input buffer length */
+#define SK_OUTLEN       1024    /* reply buffer length */
+#define SK_EXTS         "PIPELINING,8BITMIME,SIZE"  /* default extensions */
+#define SK_TICK         10000   /* (usec) slow read interval */
+
+/* Injection points */
+#define P_GREETING      0
+#define P_EHLO          1       /* EHLO and HELO */
+#define P_MAIL          2
+#define P_RCPT          3
+#define P_DATA          4
+#define P_DOT           5       /* end of mail data */
+#define P_QUIT          6
+#define P_OTHER         7       /* RSET, NOOP, VRFY, ... */
+#define POINTS          8
+
+/* Connection states */
+#define CS_CMD          0       /* receiving commands */
+#define CS_DATA         1       /* receiving mail data */
+#define CS_CLOSE        2       /* closing after reply */
+
+
+/** Typedefs **/
+
+/* struct inject - latency and failures injected at point */
+struct inject {
+    double delay;               /* (msec) reply delay */
+    double jitter;              /* (msec) uniform extra delay */
+    int code;                   /* reply code injected (0: none) */
+    double code_prob;           /* probability of injected reply */
+    double drop_prob;           /* probability of disconnection */
+};
+
+/* struct conn - client connection */
+struct conn {
+    int fd;                     /* socket (-1: free slot) */
+    int state;                  /* see Connection states */
+    int mail;                   /* MAIL received */
+    int rcpts;                  /* recipients accepted */
+    int eom;                    /* "\r\n.\r\n" characters matched */
+    size_t size;                /* mail data received */
+    uint64_t sum;               /* mail data checksum */
+    size_t slow;                /* (bytes per tick) slow read, 0: normal */
+    uint64_t next_read;         /* slow read allowed */
+    uint64_t due;               /* reply to be sent */
+    char in[SK_BUFLEN];         /* input not processed yet */
+    size_t inlen;
+    char out[SK_OUTLEN];        /* reply being sent */
+    size_t outlen, outoff;
+};
+
+
+/** Local variables **/
+static struct inject inj[POINTS];
+static const char *point_names[POINTS] = {
+    "greeting", "ehlo", "mail", "rcpt", "data", "dot", "quit", "other"
+};
+static char exts[SK_OUTLEN/2] = "";     /* EHLO reply lines */
+static int checksum = 0;
+static int verbose = 0;
+static double slow_prob = 0.0;
+static size_t slow_bps = 0;
+static volatile sig_atomic_t stop = 0;
+
+static uint64_t st_conns, st_mails, st_bytes, st_rcpts;
+static uint64_t st_injected, st_dropped, st_slow, st_sum;
+
+
+/* now - monotonic time in microseconds */
+static uint64_t now (void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* sig_stop - stop sink (SIGINT and SIGTERM handler) */
+static void sig_stop (int signo)
+{
+    (void) signo;
+    stop = 1;
+}
+
+/* usage - print usage and exit */
+static void usage (void)
+{
+    fprintf(stderr,
+"usage: sink [options]\n"
+"  -p port               listen port (%d)\n"
+"  -c connections        maximum of connections (%d)\n"
+"  -x ext,ext,...        ESMTP extensions advertised, or none (%s)\n"
+"  -l point:ms[:jitter]  delay replies at point\n"
+"  -f point:code:prob    reply with code (4xx/5xx) at point with probability\n"
+"  -f point:drop:prob    disconnect at point with probability\n"
+"  -s prob:bytes         read connections slowly (bytes/s) with probability\n"
+"  -k                    checksum mail data (FNV-1a)\n"
+"  -v                    print every mail received\n"
+"  -S seed               random seed (time)\n"
+"point is greeting, ehlo, mail, rcpt, data, dot, quit, other or all\n",
+            SMTP_PORT, SK_MAXCONN, SK_EXTS);
+    exit(1);
+}
+
+/* parse_point - parse injection point name, returns its number, POINTS *
+ *               for all points and -1 on error                          */
+static int parse_point (const char *s, size_t len)
+{
+    int i;
+
+    if (3 == len && 0 == strncmp(s, "all", 3))
+        return POINTS;
+    for (i = 0; i < POINTS; ++i) {
+        if (strlen(point_names[i]) == len &&
+            0 == strncmp(s, point_names[i], len))
+            return i;
+    }
+
+    return -1;
+}
+
+/* parse_inject - parse -l (latency) or -f (failure) option argument, *
+ *                returns 0 on success                                */
+static int parse_inject (int opt, const char *arg)
+{
+    int i, p, last, code = 0;
+    double a, b = 0.0;
+    char what[8];
+    const char *colon = strchr(arg, ':');
+
+    if (NULL == colon || (p = parse_point(arg, colon - arg)) < 0)
+        return -1;
+
+    if ('l' == opt) {
+        if (sscanf(colon+1, "%lf:%lf", &a, &b) < 1 || a < 0 || b < 0)
+            return -1;
+    }
+    else {
+        if (2 != sscanf(colon+1, "%7[^:]:%lf", what, &b) || b < 0 || b > 1)
+            return -1;
+        if (0 != strcmp(what, "drop") &&
+            ((code = atoi(what)) < 400 || code > 599))
+            return -1;
+    }
+
+    last = (POINTS == p) ? POINTS-1 : p;
+    for (i = (POINTS == p) ? 0 : p; i <= last; ++i) {
+        if ('l' == opt) {
+            inj[i].delay = a;
+            inj[i].jitter = b;
+        }
+        else if (0 == code)
+            inj[i].drop_prob = b;
+        else {
+            inj[i].code = code;
+            inj[i].code_prob = b;
+        }
+    }
+
+    return 0;
+}
+
+/* parse_exts - make EHLO reply lines from list of extensions */
+static void parse_exts (const char *list)
+{
+    size_t len = 0;
+    const char *p, *end;
+
+    exts[0] = '\0';
+    if (0 == strcmp(list, "none"))
+        return;
+
+    for (p = list; '\0' != *p; p = ('\0' == *end) ? end : end+1) {
+        if (NULL == (end = strchr(p, ',')))
+            end = p + strlen(p);
+        if (end != p && len + (end - p) + 7 < sizeof(exts))
+            len += sprintf(exts + len, "250-%.*s\r\n", (int) (end - p), p);
+    }
+}
+
+/* reply - set reply of connection, which is sent after delay of point */
+static void reply (struct conn *c, int point, const char *fmt, ...)
+    __attribute__ ((format (printf, 3, 4)));
+
+static void reply (struct conn *c, int point, const char *fmt, ...)
+{
+    int n;
+    va_list ap;
+    double delay = inj[point].delay + inj[point].jitter * drand48();
+
+    va_start(ap, fmt);
+    n = vsnprintf(c->out, SK_OUTLEN, fmt, ap);
+    va_end(ap);
+
+    c->outlen = (n < SK_OUTLEN) ? n : SK_OUTLEN-1;
+    c->outoff = 0;
+    c->due = now() + (uint64_t) (delay * 1000);
+}
+
+/* conn_close - close connection */
+static void conn_close (struct conn *c)
+{
+    close(c->fd);
+    c->fd = -1;
+}
+
+/* injected - decide failure at point, returns 1 if connection was dropped *
+ *            or failure reply was set, 0 if command should succeed         */
+static int injected (struct conn *c, int point)
+{
+    if (inj[point].drop_prob > 0 && drand48() < inj[point].drop_prob) {
+        ++st_dropped;
+        conn_close(c);
+        return 1;
+    }
+
+    if (inj[point].code_prob > 0 && drand48() < inj[point].code_prob) {
+        ++st_injected;
+        reply(c, point, "%d %s failure (injected)\r\n", inj[point].code,
+              (inj[point].code < 500) ? "Temporary" : "Permanent");
+        if (421 == inj[point].code)
+            c->state = CS_CLOSE;
+        return 1;
+    }
+
+    return 0;
+}
+
+/* command - handle command line (without CRLF) */
+static void command (struct conn *c, const char *line)
+{
+    char *p;
+
+    if (0 == strncasecmp(line, "EHLO", 4) || 0 == strncasecmp(line, "HELO", 4)) {
+        if (injected(c, P_EHLO))
+            return;
+        c->mail = c->rcpts = 0;
+        if ('E' == toupper((unsigned char) line[0]) && '\0' != exts[0]) {
+            reply(c, P_EHLO, "250-sink\r\n%s", exts);
+
+            /* last line is "250 extension" */
+            for (p = c->out + c->outlen - 2; '\n' != p[-1]; --p)
+                ;
+            p[3] = ' ';
+        }
+        else
+            reply(c, P_EHLO, "250 sink\r\n");
+    }
+    else if (0 == strncasecmp(line, "MAIL", 4)) {
+        if (c->mail)
+            reply(c, P_MAIL, "503 Nested MAIL command\r\n");
+        else if (!injected(c, P_MAIL)) {
+            c->mail = 1;
+            c->rcpts = 0;
+            reply(c, P_MAIL, "250 OK\r\n");
+        }
+    }
+    else if (0 == strncasecmp(line, "RCPT", 4)) {
+        if (!c->mail)
+            reply(c, P_RCPT, "503 Need MAIL command\r\n");
+        else if (!injected(c, P_RCPT)) {
+            ++c->rcpts;
+            reply(c, P_RCPT, "250 OK\r\n");
+        }
+    }
+    else if (0 == strncasecmp(line, "DATA", 4)) {
+        if (0 == c->rcpts)
+            reply(c, P_DATA, "554 No valid recipients\r\n");
+        else if (!injected(c, P_DATA)) {
+            c->state = CS_DATA;
+            c->eom = 2;     /* DATA line ended with CRLF */
+            c->size = 0;
+            c->sum = 14695981039346656037ULL;
+            reply(c, P_DATA, "354 End data with <CR><LF>.<CR><LF>\r\n");
+        }
+    }
+    else if (0 == strncasecmp(line, "QUIT", 4)) {
+        if (!injected(c, P_QUIT)) {
+            c->state = CS_CLOSE;
+            reply(c, P_QUIT, "221 Bye\r\n");
+        }
+    }
+    else if (0 == strncasecmp(line, "RSET", 4)) {
+        if (!injected(c, P_OTHER)) {
+            c->mail = c->rcpts = 0;
+            reply(c, P_OTHER, "250 OK\r\n");
+        }
+    }
+    else if (0 == strncasecmp(line, "NOOP", 4)) {
+        if (!injected(c, P_OTHER))
+            reply(c, P_OTHER, "250 OK\r\n");
+    }
+    else if (0 == strncasecmp(line, "VRFY", 4)) {
+        if (!injected(c, P_OTHER))
+            reply(c, P_OTHER, "252 Cannot VRFY user\r\n");
+    }
+    else
+        reply(c, P_OTHER, "500 Command unrecognized\r\n");
+}
+
+/* mail_data - consume mail data from input, returns number of bytes used */
+static size_t mail_data (struct conn *c)
+{
+    size_t i;
+    unsigned char ch;
+
+    for (i = 0; i < c->inlen && 5 != c->eom; ++i) {
+        ch = c->in[i];
+        if (checksum)
+            c->sum = (c->sum ^ ch) * 1099511628211ULL;
+
+        /* match "\r\n.\r\n" */
+        if ("\r\n.\r\n"[c->eom] == ch)
+            ++c->eom;
+        else
+            c->eom = ('\r' == ch) ? 1 : 0;
+    }
+    c->size += i;
+
+    if (5 == c->eom) {
+        c->state = CS_CMD;
+        if (!injected(c, P_DOT)) {
+            ++st_mails;
+            st_bytes += c->size;
+            st_rcpts += c->rcpts;
+            st_sum ^= c->sum;
+            if (verbose)
+                printf("mail %llu: %zu bytes, %d rcpts, checksum %016llx\n",
+                       (unsigned long long) st_mails, c->size, c->rcpts,
+                       (unsigned long long) c->sum);
+            reply(c, P_DOT, "250 OK\r\n");
+        }
+        c->mail = c->rcpts = 0;
+    }
+
+    return i;
+}
+
+/* process - handle buffered input, until reply is pending */
+static void process (struct conn *c)
+{
+    size_t used;
+    char *nl;
+
+    while (c->fd >= 0 && 0 == c->outlen && CS_CLOSE != c->state &&
+           c->inlen > 0) {
+        if (CS_DATA == c->state)
+            used = mail_data(c);
+        else if (NULL != (nl = memchr(c->in, '\n', c->inlen))) {
+            *nl = '\0';
+            if (nl > c->in && '\r' == nl[-1])
+                nl[-1] = '\0';
+            used = nl - c->in + 1;
+            command(c, c->in);
+        }
+        else if (SK_BUFLEN == c->inlen) {
+            used = c->inlen;    /* too long line */
+            reply(c, P_OTHER, "500 Line too long\r\n");
+        }
+        else
+            break;
+
+        if (c->fd < 0)
+            break;
+        c->inlen -= used;
+        memmove(c->in, c->in + used, c->inlen);
+    }
+}
+
+/* conn_io - handle readiness of connection */
+static void conn_io (struct conn *c, short revents)
+{
+    ssize_t n;
+    size_t len;
+
+    if ((revents & POLLOUT) && c->outlen > 0) {
+        n = write(c->fd, c->out + c->outoff, c->outlen - c->outoff);
+        if (n < 0) {
+            if (EAGAIN != errno && EINTR != errno)
+                conn_close(c);
+            return;
+        }
+        if ((c->outoff += n) < c->outlen)
+            return;
+
+        c->outlen = 0;
+        if (CS_CLOSE == c->state) {
+            conn_close(c);
+            return;
+        }
+    }
+
+    if (revents & (POLLIN | POLLHUP | POLLERR)) {
+        len = SK_BUFLEN - c->inlen;
+        if (c->slow > 0) {
+            if (len > c->slow)
+                len = c->slow;
+            c->next_read = now() + SK_TICK;
+        }
+
+        n = read(c->fd, c->in + c->inlen, len);
+        if (0 == n || (n < 0 && EAGAIN != errno && EINTR != errno)) {
+            conn_close(c);
+            return;
+        }
+        if (n > 0)
+            c->inlen += n;
+    }
+
+    process(c);
+}
+
+/* conn_open - set up accepted connection and its greeting */
+static void conn_open (struct conn *c, int fd)
+{
+    c->fd = fd;
+    c->state = CS_CMD;
+    c->mail = c->rcpts = 0;
+    c->inlen = c->outlen = 0;
+    c->next_read = 0;
+    c->slow = 0;
+    ++st_conns;
+
+    if (slow_prob > 0 && drand48() < slow_prob) {
+        c->slow = slow_bps * SK_TICK / 1000000;
+        if (0 == c->slow)
+            c->slow = 1;
+        ++st_slow;
+    }
+
+    if (!injected(c, P_GREETING))
+        reply(c, P_GREETING, "220 sink ESMTP\r\n");
+}
+
+int main (int argc, char **argv)
+{
+    int i, opt, listenfd, connfd, nfds, maxconn = SK_MAXCONN;
+    int one = 1, port = SMTP_PORT;
+    long seed = time(NULL);
+    uint64_t t, wait;
+    struct sockaddr_in servaddr;
+    struct conn *cs;
+    struct pollfd *fds;
+    int *idx;
+
+    parse_exts(SK_EXTS);
+
+    while (-1 != (opt = getopt(argc, argv, "p:c:x:l:f:s:kvS:"))) {
+        switch (opt) {
+            case 'p': port = atoi(optarg); break;
+            case 'c': maxconn = atoi(optarg); break;
+            case 'x': parse_exts(optarg); break;
+            case 'k': checksum = 1; break;
+            case 'v': verbose = 1; break;
+            case 'S': seed = atol(optarg); break;
+            case 'l':
+            case 'f':
+                if (0 != parse_inject(opt, optarg))
+                    usage();
+                break;
+            case 's':
+                if (2 != sscanf(optarg, "%lf:%zu", &slow_prob, &slow_bps) ||
+                    slow_prob < 0 || slow_prob > 1 || 0 == slow_bps)
+                    usage();
+                break;
+            default:
+                usage();
+        }
+    }
+    if (optind != argc || maxconn <= 0)
+        usage();
+
+    srand48(seed);
+    signal(SIGPIPE, SIG_IGN);
+    signal(SIGINT, sig_stop);
+    signal(SIGTERM, sig_stop);
+
+    cs = Calloc(maxconn, sizeof(struct conn));
+    fds = Calloc(maxconn + 1, sizeof(struct pollfd));
+    idx = Calloc(maxconn + 1, sizeof(int));
+    for (i = 0; i < maxconn; ++i)
+        cs[i].fd = -1;
+
+    /* create listen socket */
+    listenfd = Socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+    bzero(&servaddr, sizeof(servaddr));
+    servaddr.sin_family      = AF_INET;
+    servaddr.sin_addr.s_addr = htonl(INADDR_ANY);
+    servaddr.sin_port        = htons(port);
+
+    Bind(listenfd, (SA *) &servaddr, sizeof(servaddr));
+    Listen(listenfd, LISTENQ);
+
+    while (!stop) {
+        t = now();
+        wait = 1000000;
+
+        /* listen socket only while there is free slot */
+        for (i = 0; i < maxconn && cs[i].fd >= 0; ++i)
+            ;
+        fds[0].fd = (i < maxconn) ? listenfd : -1;
+        fds[0].events = POLLIN;
+        nfds = 1;
+
+        for (i = 0; i < maxconn; ++i) {
+            if (cs[i].fd < 0)
+                continue;
+
+            fds[nfds].fd = cs[i].fd;
+            fds[nfds].events = 0;
+            if (cs[i].outlen > 0) {
+                if (cs[i].due <= t)
+                    fds[nfds].events |= POLLOUT;
+                else if (cs[i].due - t < wait)
+                    wait = cs[i].due - t;
+            }
+            else if (CS_CLOSE != cs[i].state) {
+                if (cs[i].next_read <= t)
+                    fds[nfds].events |= POLLIN;
+                else if (cs[i].next_read - t < wait)
+                    wait = cs[i].next_read - t;
+            }
+            idx[nfds++] = i;
+        }
+
+        if (poll(fds, nfds, (wait + 999) / 1000) < 0) {
+            if (EINTR == errno)
+                continue;
+            err_sys("poll error");
+        }
+
+        for (i = 1; i < nfds; ++i) {
+            if (0 != fds[i].revents)
+                conn_io(&(cs[idx[i]]), fds[i].revents);
+        }
+
+        /* accept clients */
+        if (fds[0].revents & POLLIN) {
+            for (i = 0; i < maxconn; ++i) {
+                if (cs[i].fd >= 0)
+                    continue;
+                if ((connfd = accept4(listenfd, NULL, NULL, SOCK_NONBLOCK)) < 0)
+                    break;
+                conn_open(&(cs[i]), connfd);
+            }
+        }
+    }
+
+    printf("connections %llu (slow %llu), mails %llu, bytes %llu, rcpts %llu, "
+           "injected replies %llu, drops %llu",
+           (unsigned long long) st_conns, (unsigned long long) st_slow,
+           (unsigned long long) st_mails, (unsigned long long) st_bytes,
+           (unsigned long long) st_rcpts, (unsigned long long) st_injected,
+           (unsigned long long) st_dropped);
+    if (checksum)
+        printf(", checksum %016llx", (unsigned long long) st_sum);
+    printf("\n");
+
+    return 0;
+}